@@ -7,6 +7,8 @@
 // This is a grab-bag of various demos and not very readable.
 #include "led-matrix.h"
 #include "threaded-canvas-manipulator.h"
+#include "frame-renderer.h"
+#include "parallel-renderer.h"
 #include "pixel-mapper.h"
 #include "graphics.h"
 
@@ -36,77 +38,80 @@ static void InterruptHandler(int signo) {
 }
 
 /*
- * The following are demo image generators. They all use the utility
- * class ThreadedCanvasManipulator to generate new frames.
+ * The following are demo image generators. Most of them are animations
+ * using the utility class FrameRenderer, which calls RenderFrame() for each
+ * frame to be shown; the static test images use ThreadedCanvasManipulator.
  */
 
 // Simple generator that pulses through RGB and White.
-class ColorPulseGenerator : public ThreadedCanvasManipulator {
+class ColorPulseGenerator : public FrameRenderer {
 public:
-  ColorPulseGenerator(RGBMatrix *m) : ThreadedCanvasManipulator(m), matrix_(m) {
-    off_screen_canvas_ = m->CreateFrameCanvas();
+  ColorPulseGenerator(RGBMatrix *m) : FrameRenderer(m, 5), continuum_(0) {}
+  virtual ~ColorPulseGenerator() {
+    Stop();
+    WaitStopped();
   }
-  void Run() {
-    uint32_t continuum = 0;
-    while (running() && !interrupt_received) {
-      usleep(5 * 1000);
-      continuum += 1;
-      continuum %= 3 * 255;
-      int r = 0, g = 0, b = 0;
-      if (continuum <= 255) {
-        int c = continuum;
-        b = 255 - c;
-        r = c;
-      } else if (continuum > 255 && continuum <= 511) {
-        int c = continuum - 256;
-        r = 255 - c;
-        g = c;
-      } else {
-        int c = continuum - 512;
-        g = 255 - c;
-        b = c;
-      }
-      off_screen_canvas_->Fill(r, g, b);
-      off_screen_canvas_ = matrix_->SwapOnVSync(off_screen_canvas_);
+
+protected:
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+    continuum_ += 1;
+    continuum_ %= 3 * 255;
+    int r = 0, g = 0, b = 0;
+    if (continuum_ <= 255) {
+      int c = continuum_;
+      b = 255 - c;
+      r = c;
+    } else if (continuum_ > 255 && continuum_ <= 511) {
+      int c = continuum_ - 256;
+      r = 255 - c;
+      g = c;
+    } else {
+      int c = continuum_ - 512;
+      g = 255 - c;
+      b = c;
     }
+    canvas->Fill(r, g, b);
   }
 
 private:
-  RGBMatrix *const matrix_;
-  FrameCanvas *off_screen_canvas_;
+  uint32_t continuum_;
 };
 
 // Simple generator that pulses through brightness on red, green, blue and white
-class BrightnessPulseGenerator : public ThreadedCanvasManipulator {
+class BrightnessPulseGenerator : public FrameRenderer {
 public:
   BrightnessPulseGenerator(RGBMatrix *m)
-    : ThreadedCanvasManipulator(m), matrix_(m) {}
-  void Run() {
-    const uint8_t max_brightness = matrix_->brightness();
-    const uint8_t c = 255;
-    uint8_t count = 0;
-
-    while (running() && !interrupt_received) {
-      if (matrix_->brightness() < 1) {
-        matrix_->SetBrightness(max_brightness);
-        count++;
-      } else {
-        matrix_->SetBrightness(matrix_->brightness() - 1);
-      }
+    : FrameRenderer(m, 20), max_brightness_(m->brightness()),
+      brightness_(max_brightness_), count_(0) {}
+  virtual ~BrightnessPulseGenerator() {
+    Stop();
+    WaitStopped();
+  }
 
-      switch (count % 4) {
-      case 0: matrix_->Fill(c, 0, 0); break;
-      case 1: matrix_->Fill(0, c, 0); break;
-      case 2: matrix_->Fill(0, 0, c); break;
-      case 3: matrix_->Fill(c, c, c); break;
-      }
+protected:
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+    const uint8_t c = 255;
+    if (brightness_ < 1) {
+      brightness_ = max_brightness_;
+      count_++;
+    } else {
+      brightness_--;
+    }
 
-      usleep(20 * 1000);
+    // The brightness applies to the pixels set afterwards.
+    canvas->SetBrightness(brightness_);
+    switch (count_ % 4) {
+    case 0: canvas->Fill(c, 0, 0); break;
+    case 1: canvas->Fill(0, c, 0); break;
+    case 2: canvas->Fill(0, 0, c); break;
+    case 3: canvas->Fill(c, c, c); break;
     }
   }
 
 private:
-  RGBMatrix *const matrix_;
+  const uint8_t max_brightness_;
+  uint8_t brightness_;
+  uint8_t count_;
 };
 
 class SimpleSquare : public ThreadedCanvasManipulator {
@@ -127,38 +132,60 @@ public:
   }
 };
 
-class GrayScaleBlock : public ThreadedCanvasManipulator {
+class GrayScaleBlock : public FrameRenderer {
 public:
-  GrayScaleBlock(Canvas *m) : ThreadedCanvasManipulator(m) {}
-  void Run() {
+  GrayScaleBlock(RGBMatrix *m) : FrameRenderer(m, 2000), count_(0) {}
+  virtual ~GrayScaleBlock() {
+    Stop();
+    WaitStopped();
+  }
+
+protected:
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
     const int sub_blocks = 16;
-    const int width = canvas()->width();
-    const int height = canvas()->height();
+    const int width = canvas->width();
+    const int height = canvas->height();
     const int x_step = max(1, width / sub_blocks);
     const int y_step = max(1, height / sub_blocks);
-    uint8_t count = 0;
-    while (running() && !interrupt_received) {
-      for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-          int c = sub_blocks * (y / y_step) + x / x_step;
-          switch (count % 4) {
-          case 0: canvas()->SetPixel(x, y, c, c, c); break;
-          case 1: canvas()->SetPixel(x, y, c, 0, 0); break;
-          case 2: canvas()->SetPixel(x, y, 0, c, 0); break;
-          case 3: canvas()->SetPixel(x, y, 0, 0, c); break;
-          }
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        int c = sub_blocks * (y / y_step) + x / x_step;
+        switch (count_ % 4) {
+        case 0: canvas->SetPixel(x, y, c, c, c); break;
+        case 1: canvas->SetPixel(x, y, c, 0, 0); break;
+        case 2: canvas->SetPixel(x, y, 0, c, 0); break;
+        case 3: canvas->SetPixel(x, y, 0, 0, c); break;
         }
       }
-      count++;
-      sleep(2);
     }
+    count_++;
   }
+
+private:
+  uint8_t count_;
 };
 
 // Simple class that generates a rotating block on the screen.
-class RotatingBlockGenerator : public ThreadedCanvasManipulator {
+// Each frame is drawn by several threads with the ParallelRenderer: for
+// every pixel of the screen, it looks up where it comes from in the block.
+class RotatingBlockGenerator : public FrameRenderer,
+                               public ParallelRenderer::Job {
 public:
-  RotatingBlockGenerator(Canvas *m) : ThreadedCanvasManipulator(m) {}
+  RotatingBlockGenerator(RGBMatrix *m)
+    : FrameRenderer(m), cos_angle_(1), sin_angle_(0) {
+    cent_x_ = m->width() / 2;
+    cent_y_ = m->height() / 2;
+
+    // The square to display is within the visible area.
+    const int display_square = min(m->width(), m->height()) * 0.7;
+    min_display_ = cent_x_ - display_square / 2;
+    max_display_ = cent_x_ + display_square / 2;
+  }
+
+  virtual ~RotatingBlockGenerator() {
+    Stop();
+    WaitStopped();   // The renderer must not be deleted while in use.
+  }
 
   uint8_t scale_col(int val, int lo, int hi) {
     if (val < lo) return 0;
@@ -166,71 +193,61 @@ public:
     return 255 * (val - lo) / (hi - lo);
   }
 
-  void Run() {
-    const int cent_x = canvas()->width() / 2;
-    const int cent_y = canvas()->height() / 2;
-
-    // The square to rotate (inner square + black frame) needs to cover the
-    // whole area, even if diagnoal. Thus, when rotating, the outer pixels from
-    // the previous frame are cleared.
-    const int rotate_square = min(canvas()->width(), canvas()->height()) * 1.41;
-    const int min_rotate = cent_x - rotate_square / 2;
-    const int max_rotate = cent_x + rotate_square / 2;
-
-    // The square to display is within the visible area.
-    const int display_square = min(canvas()->width(), canvas()->height()) * 0.7;
-    const int min_display = cent_x - display_square / 2;
-    const int max_display = cent_x + display_square / 2;
-
-    const float deg_to_rad = 2 * 3.14159265 / 360;
-    int rotation = 0;
-    while (running() && !interrupt_received) {
-      ++rotation;
-      usleep(15 * 1000);
-      rotation %= 360;
-      for (int x = min_rotate; x < max_rotate; ++x) {
-        for (int y = min_rotate; y < max_rotate; ++y) {
-          float rot_x, rot_y;
-          Rotate(x - cent_x, y - cent_x,
-                 deg_to_rad * rotation, &rot_x, &rot_y);
-          if (x >= min_display && x < max_display &&
-              y >= min_display && y < max_display) { // within display square
-            canvas()->SetPixel(rot_x + cent_x, rot_y + cent_y,
-                               scale_col(x, min_display, max_display),
-                               255 - scale_col(y, min_display, max_display),
-                               scale_col(y, min_display, max_display));
-          } else {
-            // black frame.
-            canvas()->SetPixel(rot_x + cent_x, rot_y + cent_y, 0, 0, 0);
-          }
+  // Called from the threads of the ParallelRenderer.
+  virtual void RenderRows(FrameCanvas *canvas, int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++y) {
+      for (int x = 0; x < canvas->width(); ++x) {
+        const float rel_x = x - cent_x_, rel_y = y - cent_y_;
+        const int block_x = floorf(rel_x * cos_angle_ - rel_y * sin_angle_
+                                   + 0.5f) + cent_x_;
+        const int block_y = floorf(rel_x * sin_angle_ + rel_y * cos_angle_
+                                   + 0.5f) + cent_x_;
+        if (block_x >= min_display_ && block_x < max_display_ &&
+            block_y >= min_display_ && block_y < max_display_) {
+          canvas->SetPixel(x, y,
+                           scale_col(block_x, min_display_, max_display_),
+                           255 - scale_col(block_y, min_display_, max_display_),
+                           scale_col(block_y, min_display_, max_display_));
+        } else {
+          canvas->SetPixel(x, y, 0, 0, 0);   // black frame.
         }
       }
     }
   }
 
-private:
-  void Rotate(int x, int y, float angle,
-              float *new_x, float *new_y) {
-    *new_x = x * cosf(angle) - y * sinf(angle);
-    *new_y = x * sinf(angle) + y * cosf(angle);
+protected:
+  // Called for each refresh; the block turns by one degree every 15ms.
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+    const float deg_to_rad = 2 * 3.14159265 / 360;
+    const int rotation = (frame_time_us / 15000) % 360;
+    // Rotating the screen back shows where its pixels are in the block.
+    cos_angle_ = cosf(-deg_to_rad * rotation);
+    sin_angle_ = sinf(-deg_to_rad * rotation);
+    renderer_.Render(this, canvas);
   }
+
+private:
+  ParallelRenderer renderer_;
+  int cent_x_, cent_y_;
+  int min_display_, max_display_;
+  float cos_angle_, sin_angle_;
 };
 
-class ImageScroller : public ThreadedCanvasManipulator {
+class ImageScroller : public FrameRenderer {
 public:
   // Scroll image with "scroll_jumps" pixels every "scroll_ms" milliseconds.
   // If "scroll_ms" is negative, don't do any scrolling.
+  // Without new content, frames keep what was shown before.
   ImageScroller(RGBMatrix *m, int scroll_jumps, int scroll_ms = 30)
-    : ThreadedCanvasManipulator(m), scroll_jumps_(scroll_jumps),
-      scroll_ms_(scroll_ms),
-      horizontal_position_(0),
-      matrix_(m) {
-    offscreen_ = matrix_->CreateFrameCanvas();
+    : FrameRenderer(m, scroll_ms > 0 ? scroll_ms : 100, true),
+      scroll_jumps_(scroll_jumps), scroll_ms_(scroll_ms), content_(NULL),
+      horizontal_position_(0) {
   }
 
   virtual ~ImageScroller() {
     Stop();
     WaitStopped();   // only now it is safe to delete our instance variables.
+    delete content_;
   }
 
   // _very_ simplified. Can only read binary P6 PPM. Expects newlines in headers
@@ -279,39 +296,31 @@ public:
     return true;
   }
 
-  void Run() {
-    const int screen_height = offscreen_->height();
-    const int screen_width = offscreen_->width();
-    while (running() && !interrupt_received) {
-      {
-        MutexLock l(&mutex_new_image_);
-        if (new_image_.IsValid()) {
-          current_image_.Delete();
-          current_image_ = new_image_;
-          new_image_.Reset();
-        }
-      }
-      if (!current_image_.IsValid()) {
-        usleep(100 * 1000);
-        continue;
-      }
-      for (int x = 0; x < screen_width; ++x) {
-        for (int y = 0; y < screen_height; ++y) {
-          const Pixel &p = current_image_.getPixel(
-            (horizontal_position_ + x) % current_image_.width, y);
-          offscreen_->SetPixel(x, y, p.red, p.green, p.blue);
-        }
-      }
-      offscreen_ = matrix_->SwapOnVSync(offscreen_);
-      horizontal_position_ += scroll_jumps_;
-      if (horizontal_position_ < 0) horizontal_position_ = current_image_.width;
-      if (scroll_ms_ <= 0) {
-        // No scrolling. We don't need the image anymore.
-        current_image_.Delete();
-      } else {
-        usleep(scroll_ms_ * 1000);
+protected:
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+    {
+      MutexLock l(&mutex_new_image_);
+      if (new_image_.IsValid()) {
+        // Draw the whole image once; scrolling then only has to copy
+        // the visible part. Below the image, it stays black.
+        delete content_;
+        content_ = matrix()->CreateWideCanvas(new_image_.width,
+                                              canvas->height());
+        content_->SetPixels(0, 0, new_image_.width, new_image_.height,
+                            (const uint8_t*) new_image_.image);
+        new_image_.Delete();
       }
     }
+    if (content_ == NULL)
+      return;
+    canvas->CopyViewport(*content_, horizontal_position_, 0);
+    horizontal_position_ += scroll_jumps_;
+    if (horizontal_position_ < 0) horizontal_position_ = content_->width();
+    if (scroll_ms_ <= 0) {
+      // No scrolling. We don't need the image anymore.
+      delete content_;
+      content_ = NULL;
+    }
   }
 
 private:
@@ -328,11 +337,6 @@ private:
     void Delete() { delete [] image; Reset(); }
     void Reset() { image = NULL; width = -1; height = -1; }
     inline bool IsValid() { return image && height > 0 && width > 0; }
-    const Pixel &getPixel(int x, int y) {
-      static Pixel black;
-      if (x < 0 || x >= width || y < 0 || y >= height) return black;
-      return image[x + width * y];
-    }
 
     int width;
     int height;
@@ -351,28 +355,25 @@ private:
   const int scroll_jumps_;
   const int scroll_ms_;
 
-  // Current image is only manipulated in our thread.
-  Image current_image_;
+  // Current image, drawn once. Only manipulated in our thread.
+  WideCanvas *content_;
 
   // New image can be loaded from another thread, then taken over in main thread
   Mutex mutex_new_image_;
   Image new_image_;
 
   int32_t horizontal_position_;
-
-  RGBMatrix* matrix_;
-  FrameCanvas* offscreen_;
 };
 
 
 // Abelian sandpile
 // Contributed by: Vliedel
-class Sandpile : public ThreadedCanvasManipulator {
+class Sandpile : public FrameRenderer {
 public:
-  Sandpile(Canvas *m, int delay_ms=50)
-    : ThreadedCanvasManipulator(m), delay_ms_(delay_ms) {
-    width_ = canvas()->width() - 1; // We need an odd width
-    height_ = canvas()->height() - 1; // We need an odd height
+  Sandpile(RGBMatrix *m, int delay_ms=50)
+    : FrameRenderer(m, delay_ms) {
+    width_ = m->width() - 1; // We need an odd width
+    height_ = m->height() - 1; // We need an odd height
 
     // Allocate memory
     values_ = new int*[width_];
@@ -394,6 +395,8 @@ public:
   }
 
   ~Sandpile() {
+    Stop();
+    WaitStopped();
     for (int x=0; x<width_; ++x) {
       delete [] values_[x];
     }
@@ -404,33 +407,31 @@ public:
     delete [] newValues_;
   }
 
-  void Run() {
-    while (running() && !interrupt_received) {
-      // Drop a sand grain in the centre
-      values_[width_/2][height_/2]++;
-      updateValues();
+protected:
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+    // Drop a sand grain in the centre
+    values_[width_/2][height_/2]++;
+    updateValues();
 
-      for (int x=0; x<width_; ++x) {
-        for (int y=0; y<height_; ++y) {
-          switch (values_[x][y]) {
-          case 0:
-            canvas()->SetPixel(x, y, 0, 0, 0);
-            break;
-          case 1:
-            canvas()->SetPixel(x, y, 0, 0, 200);
-            break;
-          case 2:
-            canvas()->SetPixel(x, y, 0, 200, 0);
-            break;
-          case 3:
-            canvas()->SetPixel(x, y, 150, 100, 0);
-            break;
-          default:
-            canvas()->SetPixel(x, y, 200, 0, 0);
-          }
+    for (int x=0; x<width_; ++x) {
+      for (int y=0; y<height_; ++y) {
+        switch (values_[x][y]) {
+        case 0:
+          canvas->SetPixel(x, y, 0, 0, 0);
+          break;
+        case 1:
+          canvas->SetPixel(x, y, 0, 0, 200);
+          break;
+        case 2:
+          canvas->SetPixel(x, y, 0, 200, 0);
+          break;
+        case 3:
+          canvas->SetPixel(x, y, 150, 100, 0);
+          break;
+        default:
+          canvas->SetPixel(x, y, 200, 0, 0);
         }
       }
-      usleep(delay_ms_ * 1000); // ms
     }
   }
 
@@ -472,18 +473,17 @@ private:
   int height_;
   int** values_;
   int** newValues_;
-  int delay_ms_;
 };
 
 
 // Conway's game of life
 // Contributed by: Vliedel
-class GameLife : public ThreadedCanvasManipulator {
+class GameLife : public FrameRenderer {
 public:
-  GameLife(Canvas *m, int delay_ms=500, bool torus=true)
-    : ThreadedCanvasManipulator(m), delay_ms_(delay_ms), torus_(torus) {
-    width_ = canvas()->width();
-    height_ = canvas()->height();
+  GameLife(RGBMatrix *m, int delay_ms=500, bool torus=true)
+    : FrameRenderer(m, delay_ms), torus_(torus) {
+    width_ = m->width();
+    height_ = m->height();
 
     // Allocate memory
     values_ = new int*[width_];
@@ -523,6 +523,8 @@ public:
   }
 
   ~GameLife() {
+    Stop();
+    WaitStopped();
     for (int x=0; x<width_; ++x) {
       delete [] values_[x];
     }
@@ -533,20 +535,17 @@ public:
     delete [] newValues_;
   }
 
-  void Run() {
-    while (running() && !interrupt_received) {
-
-      updateValues();
+protected:
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+    updateValues();
 
-      for (int x=0; x<width_; ++x) {
-        for (int y=0; y<height_; ++y) {
-          if (values_[x][y])
-            canvas()->SetPixel(x, y, r_, g_, b_);
-          else
-            canvas()->SetPixel(x, y, 0, 0, 0);
-        }
+    for (int x=0; x<width_; ++x) {
+      for (int y=0; y<height_; ++y) {
+        if (values_[x][y])
+          canvas->SetPixel(x, y, r_, g_, b_);
+        else
+          canvas->SetPixel(x, y, 0, 0, 0);
       }
-      usleep(delay_ms_ * 1000); // ms
     }
   }
 
@@ -621,7 +620,6 @@ private:
 
   int** values_;
   int** newValues_;
-  int delay_ms_;
   int r_;
   int g_;
   int b_;
@@ -632,13 +630,14 @@ private:
 
 // Langton's ant
 // Contributed by: Vliedel
-class Ant : public ThreadedCanvasManipulator {
+// Only the pixels that change are drawn, so frames keep the previous content.
+class Ant : public FrameRenderer {
 public:
-  Ant(Canvas *m, int delay_ms=500)
-    : ThreadedCanvasManipulator(m), delay_ms_(delay_ms) {
+  Ant(RGBMatrix *m, int delay_ms=500)
+    : FrameRenderer(m, delay_ms, true), started_(false) {
     numColors_ = 4;
-    width_ = canvas()->width();
-    height_ = canvas()->height();
+    width_ = m->width();
+    height_ = m->height();
     values_ = new int*[width_];
     for (int x=0; x<width_; ++x) {
       values_[x] = new int[height_];
@@ -646,79 +645,84 @@ public:
   }
 
   ~Ant() {
+    Stop();
+    WaitStopped();
     for (int x=0; x<width_; ++x) {
       delete [] values_[x];
     }
     delete [] values_;
   }
 
-  void Run() {
-    antX_ = width_/2;
-    antY_ = height_/2-3;
-    antDir_ = 0;
-    for (int x=0; x<width_; ++x) {
-      for (int y=0; y<height_; ++y) {
-        values_[x][y] = 0;
-        updatePixel(x, y);
+protected:
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+    if (!started_) {
+      antX_ = width_/2;
+      antY_ = height_/2-3;
+      antDir_ = 0;
+      for (int x=0; x<width_; ++x) {
+        for (int y=0; y<height_; ++y) {
+          values_[x][y] = 0;
+          updatePixel(canvas, x, y);
+        }
       }
+      started_ = true;
     }
 
-    while (running() && !interrupt_received) {
-      // LLRR
-      switch (values_[antX_][antY_]) {
-      case 0:
-      case 1:
-        antDir_ = (antDir_+1+4) % 4;
-        break;
-      case 2:
-      case 3:
-        antDir_ = (antDir_-1+4) % 4;
-        break;
-      }
+    // LLRR
+    switch (values_[antX_][antY_]) {
+    case 0:
+    case 1:
+      antDir_ = (antDir_+1+4) % 4;
+      break;
+    case 2:
+    case 3:
+      antDir_ = (antDir_-1+4) % 4;
+      break;
+    }
 
-      values_[antX_][antY_] = (values_[antX_][antY_] + 1) % numColors_;
-      int oldX = antX_;
-      int oldY = antY_;
-      switch (antDir_) {
-      case 0:
-        antX_++;
-        break;
-      case 1:
-        antY_++;
-        break;
-      case 2:
-        antX_--;
-        break;
-      case 3:
-        antY_--;
-        break;
-      }
-      updatePixel(oldX, oldY);
-      if (antX_ < 0 || antX_ >= width_ || antY_ < 0 || antY_ >= height_)
-        return;
-      updatePixel(antX_, antY_);
-      usleep(delay_ms_ * 1000);
+    values_[antX_][antY_] = (values_[antX_][antY_] + 1) % numColors_;
+    int oldX = antX_;
+    int oldY = antY_;
+    switch (antDir_) {
+    case 0:
+      antX_++;
+      break;
+    case 1:
+      antY_++;
+      break;
+    case 2:
+      antX_--;
+      break;
+    case 3:
+      antY_--;
+      break;
     }
+    updatePixel(canvas, oldX, oldY);
+    if (antX_ < 0 || antX_ >= width_ || antY_ < 0 || antY_ >= height_) {
+      Stop();   // Walked off the screen; keep showing the last frame.
+      return;
+    }
+    updatePixel(canvas, antX_, antY_);
   }
 
 private:
-  void updatePixel(int x, int y) {
+  void updatePixel(FrameCanvas *canvas, int x, int y) {
     switch (values_[x][y]) {
     case 0:
-      canvas()->SetPixel(x, y, 200, 0, 0);
+      canvas->SetPixel(x, y, 200, 0, 0);
       break;
     case 1:
-      canvas()->SetPixel(x, y, 0, 200, 0);
+      canvas->SetPixel(x, y, 0, 200, 0);
       break;
     case 2:
-      canvas()->SetPixel(x, y, 0, 0, 200);
+      canvas->SetPixel(x, y, 0, 0, 200);
       break;
     case 3:
-      canvas()->SetPixel(x, y, 150, 100, 0);
+      canvas->SetPixel(x, y, 150, 100, 0);
       break;
     }
     if (x == antX_ && y == antY_)
-      canvas()->SetPixel(x, y, 0, 0, 0);
+      canvas->SetPixel(x, y, 0, 0, 0);
   }
 
   int numColors_;
@@ -726,7 +730,7 @@ private:
   int antX_;
   int antY_;
   int antDir_; // 0 right, 1 up, 2 left, 3 down
-  int delay_ms_;
+  bool started_;
   int width_;
   int height_;
 };
@@ -736,22 +740,12 @@ private:
 // Imitation of volume bars
 // Purely random height doesn't look realistic
 // Contributed by: Vliedel
-class VolumeBars : public ThreadedCanvasManipulator {
+class VolumeBars : public FrameRenderer {
 public:
-  VolumeBars(Canvas *m, int delay_ms=50, int numBars=8)
-    : ThreadedCanvasManipulator(m), delay_ms_(delay_ms),
-      numBars_(numBars), t_(0) {
-  }
-
-  ~VolumeBars() {
-    delete [] barHeights_;
-    delete [] barFreqs_;
-    delete [] barMeans_;
-  }
-
-  void Run() {
-    const int width = canvas()->width();
-    height_ = canvas()->height();
+  VolumeBars(RGBMatrix *m, int delay_ms=50, int numBars=8)
+    : FrameRenderer(m, delay_ms), numBars_(numBars), t_(0) {
+    const int width = m->width();
+    height_ = m->height();
     barWidth_ = width/numBars_;
     barHeights_ = new int[numBars_];
     barMeans_ = new int[numBars_];
@@ -762,73 +756,81 @@ public:
     heightRed_    = height_*12/12;
 
     // Array of possible bar means
-    int numMeans = 10;
-    int means[10] = {1,2,3,4,5,6,7,8,16,32};
-    for (int i=0; i<numMeans; ++i) {
-      means[i] = height_ - means[i]*height_/8;
+    const int means[kNumMeans] = {1,2,3,4,5,6,7,8,16,32};
+    for (int i=0; i<kNumMeans; ++i) {
+      means_[i] = height_ - means[i]*height_/8;
     }
     // Initialize bar means randomly
     srand(time(NULL));
     for (int i=0; i<numBars_; ++i) {
-      barMeans_[i] = rand()%numMeans;
+      barMeans_[i] = rand()%kNumMeans;
       barFreqs_[i] = 1<<(rand()%3);
     }
+  }
 
-    // Start the loop
-    while (running() && !interrupt_received) {
-      if (t_ % 8 == 0) {
-        // Change the means
-        for (int i=0; i<numBars_; ++i) {
-          barMeans_[i] += rand()%3 - 1;
-          if (barMeans_[i] >= numMeans)
-            barMeans_[i] = numMeans-1;
-          if (barMeans_[i] < 0)
-            barMeans_[i] = 0;
-        }
-      }
+  ~VolumeBars() {
+    Stop();
+    WaitStopped();
+    delete [] barHeights_;
+    delete [] barFreqs_;
+    delete [] barMeans_;
+  }
 
-      // Update bar heights
-      t_++;
+protected:
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+    if (t_ % 8 == 0) {
+      // Change the means
       for (int i=0; i<numBars_; ++i) {
-        barHeights_[i] = (height_ - means[barMeans_[i]])
-          * sin(0.1*t_*barFreqs_[i]) + means[barMeans_[i]];
-        if (barHeights_[i] < height_/8)
-          barHeights_[i] = rand() % (height_/8) + 1;
+        barMeans_[i] += rand()%3 - 1;
+        if (barMeans_[i] >= kNumMeans)
+          barMeans_[i] = kNumMeans-1;
+        if (barMeans_[i] < 0)
+          barMeans_[i] = 0;
       }
+    }
 
-      for (int i=0; i<numBars_; ++i) {
-        int y;
-        for (y=0; y<barHeights_[i]; ++y) {
-          if (y<heightGreen_) {
-            drawBarRow(i, y, 0, 200, 0);
-          }
-          else if (y<heightYellow_) {
-            drawBarRow(i, y, 150, 150, 0);
-          }
-          else if (y<heightOrange_) {
-            drawBarRow(i, y, 250, 100, 0);
-          }
-          else {
-            drawBarRow(i, y, 200, 0, 0);
-          }
+    // Update bar heights
+    t_++;
+    for (int i=0; i<numBars_; ++i) {
+      barHeights_[i] = (height_ - means_[barMeans_[i]])
+        * sin(0.1*t_*barFreqs_[i]) + means_[barMeans_[i]];
+      if (barHeights_[i] < height_/8)
+        barHeights_[i] = rand() % (height_/8) + 1;
+    }
+
+    for (int i=0; i<numBars_; ++i) {
+      int y;
+      for (y=0; y<barHeights_[i]; ++y) {
+        if (y<heightGreen_) {
+          drawBarRow(canvas, i, y, 0, 200, 0);
         }
-        // Anything above the bar should be black
-        for (; y<height_; ++y) {
-          drawBarRow(i, y, 0, 0, 0);
+        else if (y<heightYellow_) {
+          drawBarRow(canvas, i, y, 150, 150, 0);
         }
+        else if (y<heightOrange_) {
+          drawBarRow(canvas, i, y, 250, 100, 0);
+        }
+        else {
+          drawBarRow(canvas, i, y, 200, 0, 0);
+        }
+      }
+      // Anything above the bar should be black
+      for (; y<height_; ++y) {
+        drawBarRow(canvas, i, y, 0, 0, 0);
       }
-      usleep(delay_ms_ * 1000);
     }
   }
 
 private:
-  void drawBarRow(int bar, int y, uint8_t r, uint8_t g, uint8_t b) {
+  void drawBarRow(FrameCanvas *canvas, int bar, int y,
+                  uint8_t r, uint8_t g, uint8_t b) {
     for (int x=bar*barWidth_; x<(bar+1)*barWidth_; ++x) {
-      canvas()->SetPixel(x, height_-1-y, r, g, b);
+      canvas->SetPixel(x, height_-1-y, r, g, b);
     }
   }
 
-  int delay_ms_;
+  static const int kNumMeans = 10;
+  int means_[kNumMeans];
   int numBars_;
   int* barHeights_;
   int barWidth_;
@@ -845,61 +847,61 @@ private:
 /// Genetic Colors
 /// A genetic algorithm to evolve colors
 /// by bbhsu2 + anonymous
-class GeneticColors : public ThreadedCanvasManipulator {
+class GeneticColors : public FrameRenderer {
 public:
-  GeneticColors(Canvas *m, int delay_ms = 200)
-    : ThreadedCanvasManipulator(m), delay_ms_(delay_ms) {
-    width_ = canvas()->width();
-    height_ = canvas()->height();
+  GeneticColors(RGBMatrix *m, int delay_ms = 200)
+    : FrameRenderer(m, delay_ms) {
+    width_ = m->width();
+    height_ = m->height();
     popSize_ = width_ * height_;
 
     // Allocate memory
     children_ = new citizen[popSize_];
     parents_ = new citizen[popSize_];
     srand(time(NULL));
+
+    // Set a random target_
+    target_ = rand() & 0xFFFFFF;
+
+    // Create the first generation of random children_
+    for (int i = 0; i < popSize_; ++i) {
+      children_[i].dna = rand() & 0xFFFFFF;
+    }
   }
 
   ~GeneticColors() {
+    Stop();
+    WaitStopped();
     delete [] children_;
     delete [] parents_;
   }
 
   static int rnd (int i) { return rand() % i; }
 
-  void Run() {
-    // Set a random target_
-    target_ = rand() & 0xFFFFFF;
-
-    // Create the first generation of random children_
-    for (int i = 0; i < popSize_; ++i) {
-      children_[i].dna = rand() & 0xFFFFFF;
+protected:
+  void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+    swap();
+    sort();
+    mate();
+    std::random_shuffle (children_, children_ + popSize_, rnd);
+
+    // Draw citizens to canvas
+    for(int i=0; i < popSize_; i++) {
+      int c = children_[i].dna;
+      int x = i % width_;
+      int y = (int)(i / width_);
+      canvas->SetPixel(x, y, R(c), G(c), B(c));
     }
 
-    while (running() && !interrupt_received) {
-      swap();
-      sort();
-      mate();
-      std::random_shuffle (children_, children_ + popSize_, rnd);
-
-      // Draw citizens to canvas
-      for(int i=0; i < popSize_; i++) {
-        int c = children_[i].dna;
-        int x = i % width_;
-        int y = (int)(i / width_);
-        canvas()->SetPixel(x, y, R(c), G(c), B(c));
-      }
-
-      // When we reach the 85% fitness threshold...
-      if(is85PercentFit()) {
-        // ...set a new random target_
-        target_ = rand() & 0xFFFFFF;
+    // When we reach the 85% fitness threshold...
+    if(is85PercentFit()) {
+      // ...set a new random target_
+      target_ = rand() & 0xFFFFFF;
 
-        // Randomly mutate everyone for sake of new colors
-        for (int i = 0; i < popSize_; ++i) {
-          mutate(children_[i]);
-        }
+      // Randomly mutate everyone for sake of new colors
+      for (int i = 0; i < popSize_; ++i) {
+        mutate(children_[i]);
       }
-      usleep(delay_ms_ * 1000);
     }
   }
 
@@ -1012,7 +1014,6 @@ private:
   static const int bitsPerPixel = 24;
   int popSize_;
   int width_, height_;
-  int delay_ms_;
   int target_;
   citizen* children_;
   citizen* parents_;
@@ -1146,12 +1147,12 @@ int main(int argc, char *argv[]) {
 
   Canvas *canvas = matrix;
 
-  // The ThreadedCanvasManipulator objects are filling
+  // The FrameRenderer and ThreadedCanvasManipulator objects are filling
   // the matrix continuously.
-  ThreadedCanvasManipulator *image_gen = NULL;
+  Thread *image_gen = NULL;
   switch (demo) {
   case 0:
-    image_gen = new RotatingBlockGenerator(canvas);
+    image_gen = new RotatingBlockGenerator(matrix);
     break;
 
   case 1:
@@ -1178,27 +1179,27 @@ int main(int argc, char *argv[]) {
     break;
 
   case 5:
-    image_gen = new GrayScaleBlock(canvas);
+    image_gen = new GrayScaleBlock(matrix);
     break;
 
   case 6:
-    image_gen = new Sandpile(canvas, scroll_ms);
+    image_gen = new Sandpile(matrix, scroll_ms);
     break;
 
   case 7:
-    image_gen = new GameLife(canvas, scroll_ms);
+    image_gen = new GameLife(matrix, scroll_ms);
     break;
 
   case 8:
-    image_gen = new Ant(canvas, scroll_ms);
+    image_gen = new Ant(matrix, scroll_ms);
     break;
 
   case 9:
-    image_gen = new VolumeBars(canvas, scroll_ms, canvas->width()/2);
+    image_gen = new VolumeBars(matrix, scroll_ms, matrix->width()/2);
     break;
 
   case 10:
-    image_gen = new GeneticColors(canvas, scroll_ms);
+    image_gen = new GeneticColors(matrix, scroll_ms);
     break;
 
   case 11:
@@ -1210,8 +1211,7 @@ int main(int argc, char *argv[]) {
     return usage(argv[0]);
 
   // Set up an interrupt handler to be able to stop animations while they go
-  // on. Note, each demo tests for while (running() && !interrupt_received) {},
-  // so they exit as soon as they get a signal.
+  // on. The main thread waits for it below, then deleting the demo stops it.
   signal(SIGTERM, InterruptHandler);
   signal(SIGINT, InterruptHandler);
 
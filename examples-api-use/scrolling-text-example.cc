@@ -7,6 +7,7 @@
 #include "led-matrix.h"
 #include "graphics.h"
 
+#include <algorithm>
 #include <string>
 
 #include <getopt.h>
@@ -178,24 +179,28 @@ int main(int argc, char *argv[]) {
   int delay_speed_usec = 1000000 / speed / font.CharacterWidth('W');
   if (delay_speed_usec < 0) delay_speed_usec = 2000;
 
-  while (!interrupt_received && loops != 0) {
-    offscreen_canvas->Clear(); // clear canvas
-
-    if (outline_font) {
-      // The outline font, we need to write with a negative (-2) text-spacing,
-      // as we want to have the same letter pitch as the regular text that
-      // we then write on top.
-      rgb_matrix::DrawText(offscreen_canvas, *outline_font,
-                           x - 1, y + font.baseline(),
-                           outline_color, &bg_color,
-                           line.c_str(), letter_spacing - 2);
-    }
+  // The text doesn't change, so draw it only once into a canvas that is
+  // wide enough for the text and a screen full of space in front of it.
+  // Each scroll step then just copies the visible part.
+  const rgb_matrix::TextLayout layout(font, line.c_str(), letter_spacing);
+  length = layout.width();
+  const int text_start = std::max(x_orig, offscreen_canvas->width());
+  WideCanvas *content
+    = canvas->CreateWideCanvas(text_start + length, offscreen_canvas->height());
+  if (outline_font) {
+    // The outline font, we need to write with a negative (-2) text-spacing,
+    // as we want to have the same letter pitch as the regular text that
+    // we then write on top.
+    rgb_matrix::DrawText(content, *outline_font,
+                         text_start - 1, y + font.baseline(),
+                         outline_color, &bg_color,
+                         line.c_str(), letter_spacing - 2);
+  }
+  layout.Draw(content, text_start, y + font.baseline(),
+              color, outline_font ? NULL : &bg_color);
 
-    // length = holds how many pixels our text takes up
-    length = rgb_matrix::DrawText(offscreen_canvas, font,
-                                  x, y + font.baseline(),
-                                  color, outline_font ? NULL : &bg_color,
-                                  line.c_str(), letter_spacing);
+  while (!interrupt_received && loops != 0) {
+    offscreen_canvas->CopyViewport(*content, text_start - x, 0);
 
     if (--x + length < 0) {
       x = x_orig;
@@ -208,6 +213,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Finished. Shut down the RGB matrix.
+  delete content;
   canvas->Clear();
   delete canvas;
 
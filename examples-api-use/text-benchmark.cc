@@ -0,0 +1,177 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Measure how long DrawText() takes on a FrameCanvas, compared to the
+// generic path that sets every pixel with Canvas::SetPixel().
+//
+// Only draws into off-screen canvases, so it doesn't need the hardware and
+// can run without root, also on a PC. The matrix flags still determine the
+// size and pixel mapping of the canvas.
+//
+// This code is public domain
+// (but note, that the led-matrix library this depends on is GPL v2)
+
+#include "led-matrix.h"
+#include "graphics.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+using namespace rgb_matrix;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] [<font-file>...]\n", progname);
+  fprintf(stderr, "Times drawing text with the given fonts "
+          "(Default: ../fonts/7x13.bdf ../fonts/9x18B.bdf).\n");
+  fprintf(stderr, "Options:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  fprintf(stderr,
+          "\t-n <iterations>   : Draw each text this often (Default: 2000).\n"
+          "\t-t <characters>   : Length of the ticker text (Default: 640).\n"
+          );
+  return 1;
+}
+
+static double GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Only forwards SetPixel(), so DrawText() can't use the bitplane shortcut
+// of the FrameCanvas behind it. That is what drawing on any other canvas
+// costs.
+class GenericCanvas : public Canvas {
+public:
+  GenericCanvas(Canvas *delegatee) : delegatee_(delegatee) {}
+  virtual int width() const { return delegatee_->width(); }
+  virtual int height() const { return delegatee_->height(); }
+  virtual void SetPixel(int x, int y, uint8_t red, uint8_t green,
+                        uint8_t blue) {
+    delegatee_->SetPixel(x, y, red, green, blue);
+  }
+  virtual void Clear() { delegatee_->Clear(); }
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {
+    delegatee_->Fill(red, green, blue);
+  }
+
+private:
+  Canvas *const delegatee_;
+};
+
+// Average time in microseconds of one DrawText() of "text" on "canvas".
+// The text is moved by a few pixels each time, like a ticker would.
+static double TimeDrawText(Canvas *canvas, const Font &font,
+                           const Color &color, const Color *background_color,
+                           const std::string &text, int iterations) {
+  const int y = (canvas->height() + font.baseline()) / 2;
+  const double start = GetMonotonicMicros();
+  for (int i = 0; i < iterations; ++i) {
+    DrawText(canvas, font, -(i % 8), y, color, background_color,
+             text.c_str());
+  }
+  return (GetMonotonicMicros() - start) / iterations;
+}
+
+static bool SameContent(const FrameCanvas *a, const FrameCanvas *b) {
+  const char *a_data, *b_data;
+  size_t a_len, b_len;
+  a->Serialize(&a_data, &a_len);
+  b->Serialize(&b_data, &b_len);
+  return a_len == b_len && memcmp(a_data, b_data, a_len) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  matrix_options.chain_length = 4;  // 128x32 unless given otherwise.
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  int iterations = 2000;
+  int ticker_length = 640;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+    switch (opt) {
+    case 'n': iterations = atoi(optarg); break;
+    case 't': ticker_length = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (iterations < 1 || ticker_length < 1)
+    return usage(argv[0]);
+
+  static const char *kDefaultFonts[] = { "../fonts/7x13.bdf",
+                                         "../fonts/9x18B.bdf" };
+  const char **fonts = kDefaultFonts;
+  int font_count = 2;
+  if (optind < argc) {
+    fonts = (const char**) argv + optind;
+    font_count = argc - optind;
+  }
+
+  // No GPIO: nothing is ever shown, we only use the canvases.
+  RGBMatrix *matrix = new RGBMatrix(NULL, matrix_options);
+  FrameCanvas *direct = matrix->CreateFrameCanvas();
+  FrameCanvas *generic_target = matrix->CreateFrameCanvas();
+  GenericCanvas generic(generic_target);
+
+  const Color color(255, 200, 0);
+  const Color background(0, 0, 40);
+  std::string on_screen_text;
+  while ((int)on_screen_text.size() < 16)
+    on_screen_text += "Hello World 0123";
+  std::string ticker_text;
+  while ((int)ticker_text.size() < ticker_length)
+    ticker_text += "Hello World 0123";
+  ticker_text.resize(ticker_length);
+
+  printf("%dx%d canvas, microseconds per DrawText():\n",
+         direct->width(), direct->height());
+  printf("%-20s %6s %5s %12s %12s %8s\n",
+         "font", "chars", "bg", "FrameCanvas", "generic", "speedup");
+  bool all_same = true;
+  for (int f = 0; f < font_count; ++f) {
+    Font font;
+    if (!font.LoadFont(fonts[f])) {
+      fprintf(stderr, "Couldn't load font '%s'\n", fonts[f]);
+      return 1;
+    }
+    const char *font_name = strrchr(fonts[f], '/');
+    font_name = font_name ? font_name + 1 : fonts[f];
+    for (int t = 0; t < 2; ++t) {
+      const std::string &text = (t == 0) ? on_screen_text : ticker_text;
+      for (int with_bg = 0; with_bg < 2; ++with_bg) {
+        const Color *bg = with_bg ? &background : NULL;
+        const double direct_us = TimeDrawText(direct, font, color, bg,
+                                              text, iterations);
+        const double generic_us = TimeDrawText(&generic, font, color, bg,
+                                               text, iterations);
+        printf("%-20s %6d %5s %12.1f %12.1f %7.1fx\n",
+               font_name, (int)text.size(), with_bg ? "yes" : "no",
+               direct_us, generic_us, generic_us / direct_us);
+
+        // Both paths have to draw exactly the same.
+        direct->Clear();
+        generic_target->Clear();
+        DrawText(direct, font, 3, font.baseline(), color, bg, text.c_str());
+        DrawText(&generic, font, 3, font.baseline(), color, bg,
+                 text.c_str());
+        all_same &= SameContent(direct, generic_target);
+      }
+    }
+  }
+  if (!all_same) {
+    fprintf(stderr, "FrameCanvas and generic output differ!\n");
+  }
+
+  // Not deleting the matrix: its destructor expects a running refresh
+  // thread, which a matrix without GPIO doesn't have.
+  return all_same ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Stacking of independently updated layers, such as a background image, a
+// clock and a news ticker, onto a FrameCanvas.
+//
+// Each layer is a Canvas of its own, so everything in graphics.h can draw
+// on it. Layers remember which of their pixels actually changed; setting a
+// pixel to the color it already has costs nothing. Compose() then only
+// re-composites the changed ("damaged") rectangles into the FrameCanvas
+// and brings the rest up to date by copying from the previously composed
+// canvas, which is a lot cheaper than drawing all layers again.
+//
+// Typical use with double buffering:
+//
+//   Compositor compositor(matrix->width(), matrix->height());
+//   Compositor::Layer *background = compositor.AddLayer(0, 0, 0, 128, 64);
+//   Compositor::Layer *clock = compositor.AddLayer(1, 0, 0, 128, 20);
+//   clock->SetTransparentColor(0, 0, 0);
+//   FrameCanvas *offscreen = matrix->CreateFrameCanvas();
+//   for (;;) {
+//     DrawText(clock, ...);   // Draw on the layers, or not at all.
+//     compositor.Compose(offscreen);
+//     offscreen = matrix->SwapOnVSync(offscreen);
+//   }
+//
+// The Compositor is not thread safe: draw on the layers from the same
+// thread that calls Compose().
+#ifndef RPI_COMPOSITOR_H
+#define RPI_COMPOSITOR_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "canvas.h"
+
+namespace rgb_matrix {
+class FrameCanvas;
+
+class Compositor {
+public:
+  struct Rect {
+    int x, y, width, height;
+  };
+
+  // A layer of the composition. Created and owned by the Compositor.
+  class Layer : public Canvas {
+  public:
+    // Position of the top left corner of the layer on the display.
+    int x() const { return x_; }
+    int y() const { return y_; }
+    void SetPosition(int x, int y);
+
+    // Layers with higher z are on top. Layers with the same z are stacked
+    // in the order they were added.
+    int z() const { return z_; }
+    void SetZ(int z);
+
+    // Opacity of the whole layer, 0 (invisible) to 255 (opaque, default).
+    uint8_t opacity() const { return opacity_; }
+    void SetOpacity(uint8_t opacity);
+
+    // Pixels of this color show the layers below. Clear() fills the layer
+    // with this color, so it empties the layer.
+    void SetTransparentColor(uint8_t red, uint8_t green, uint8_t blue);
+    void ClearTransparentColor();
+    bool has_transparent_color() const { return has_transparent_; }
+
+    // Set a block of pixels "rgb" with three bytes each, row by row, like
+    // FrameCanvas::SetPixels(). Clipped to the layer.
+    void SetPixels(int x, int y, int width, int height, const uint8_t *rgb);
+
+    // -- Canvas interface. Coordinates are relative to the layer.
+    virtual int width() const { return width_; }
+    virtual int height() const { return height_; }
+    virtual void SetPixel(int x, int y,
+                          uint8_t red, uint8_t green, uint8_t blue);
+    virtual void Clear();
+    virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+
+  private:
+    friend class Compositor;
+
+    Layer(Compositor *compositor, int z, int x, int y, int width, int height);
+    virtual ~Layer() {}
+
+    // Mark the layer pixels from "x0", "y0" up to excluding "x1", "y1".
+    void Touch(int x0, int y0, int x1, int y1) {
+      if (x0 < dirty_x0_) dirty_x0_ = x0;
+      if (y0 < dirty_y0_) dirty_y0_ = y0;
+      if (x1 > dirty_x1_) dirty_x1_ = x1;
+      if (y1 > dirty_y1_) dirty_y1_ = y1;
+    }
+    void TouchAll() { Touch(0, 0, width_, height_); }
+    bool IsTransparent(const uint8_t *pixel) const {
+      return has_transparent_ && pixel[0] == transparent_[0]
+        && pixel[1] == transparent_[1] && pixel[2] == transparent_[2];
+    }
+
+    Compositor *const compositor_;
+    const int width_, height_;
+    int x_, y_, z_;
+    int serial_;   // Order of creation, for layers with the same z.
+    uint8_t opacity_;
+    bool has_transparent_;
+    uint8_t transparent_[3];
+    std::vector<uint8_t> pixels_;   // Three bytes per pixel, row by row.
+    int dirty_x0_, dirty_y0_, dirty_x1_, dirty_y1_;   // Empty if x0 >= x1.
+  };
+
+  // Compositor for a display of "width" x "height" pixels. Everything not
+  // covered by a layer is black.
+  Compositor(int width, int height);
+  ~Compositor();
+
+  // Add a layer of "width" x "height" pixels at "x", "y" with the given
+  // "z" order. It starts out black, or fully transparent once a transparent
+  // color is set and it is cleared.
+  Layer *AddLayer(int z, int x, int y, int width, int height);
+
+  // Remove and delete "layer".
+  void RemoveLayer(Layer *layer);
+
+  // Bring "canvas" up to date with the current state of all layers. Only
+  // regions that changed since "canvas" was last composed are touched.
+  // Canvases are told apart by their address; a canvas this Compositor
+  // has not seen yet (or not for a long time) is fully recomposed.
+  //
+  // All canvases passed in have to be from the same RGBMatrix, and the
+  // canvas passed in the previous call must not have been changed by
+  // anybody else since, as regions are carried forward from it.
+  void Compose(FrameCanvas *canvas);
+
+  // The regions composited in the last call to Compose(), e.g. for
+  // statistics.
+  const std::vector<Rect> &damage() const { return last_damage_; }
+
+private:
+  // Frames for which the damage is remembered; canvases that were composed
+  // longer ago are copied in full from the previous canvas.
+  static const int kDamageHistory = 4;
+  // Above this number, damage rects are merged into their bounding box.
+  static const int kMaxRects = 8;
+
+  struct KnownCanvas {
+    FrameCanvas *canvas;
+    int frame;   // Number of the frame the canvas was last composed in.
+  };
+
+  void AddDamage(int x, int y, int width, int height);
+  void AddLayerDamage(const Layer *layer);
+  void CollectDamage();
+  void CompositeRect(const Rect &r, FrameCanvas *canvas);
+  static bool LayerBefore(const Layer *a, const Layer *b);
+
+  const int width_, height_;
+  std::vector<Layer*> layers_;   // Sorted bottom to top.
+  bool order_changed_;
+  int next_serial_;
+
+  std::vector<Rect> damage_;   // Collected for the next frame.
+  std::vector<Rect> last_damage_;
+  std::vector<Rect> history_[kDamageHistory];   // Damage of recent frames.
+  int frame_;
+  FrameCanvas *previous_;
+  std::vector<KnownCanvas> known_;
+  std::vector<uint8_t> scratch_;
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_COMPOSITOR_H
@@ -11,10 +11,22 @@
 // These abstractions are used in util/led-image-viewer.cc to read and
 // write such animations to disk. It is also used in util/video-viewer.cc
 // to write a version to disk that then can be played with the led-image-viewer.
+//
+// If you need streams that survive a change of the panel configuration, there
+// is a second flavor written by the RGBStreamWriter: it stores compact RGB
+// (palettized where possible) which is converted when read. Use
+// OpenStreamFile() to read these; it caches the converted version on disk
+// so that subsequent loads are as fast as for the raw format.
+//
+// Streams don't need to be files: they can as well be read from a pipe or
+// socket, e.g. fed by another process that renders content live. These
+// are read front to back without ever seeking.
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <map>
 #include <string>
+#include <vector>
 
 namespace rgb_matrix {
 class FrameCanvas;
@@ -27,79 +39,261 @@ public:
   // Rewind stream.
   virtual void Rewind() = 0;
 
+  // Returns true if this stream supports Rewind() and ReadAt(). Streams that
+  // can only be read front to back, such as pipes or sockets, return false.
+  virtual bool IsSeekable() const { return false; }
+
   // Read bytes into buffer. Similar to Posix behavior that allows short reads.
   virtual ssize_t Read(void *buf, size_t count) = 0;
 
   // Write bytes from buffer. Similar to Posix behavior that allows short
   // writes.
   virtual ssize_t Append(const void *buf, size_t count) = 0;
+
+  // Read bytes at absolute "offset" without changing the position of Read().
+  // Similar to Posix pread(). This is used to resolve references to earlier
+  // frames; streams that can't do random access return -1.
+  virtual ssize_t ReadAt(void *buf, size_t count, int64_t offset) {
+    return -1;
+  }
 };
 
 class FileStreamIO : public StreamIO {
 public:
+  // Takes ownership of "fd", which can also be a pipe or socket.
   explicit FileStreamIO(int fd);
   ~FileStreamIO();
 
   virtual void Rewind();
+  virtual bool IsSeekable() const { return seekable_; }
   virtual ssize_t Read(void *buf, size_t count);
   virtual ssize_t Append(const void *buf, size_t count);
+  virtual ssize_t ReadAt(void *buf, size_t count, int64_t offset);
 
-private:
+protected:
   const int fd_;
+
+private:
+  bool seekable_;
+};
+
+// A FileStreamIO for recording: appended data is collected in a buffer
+// and written in large batches instead of one write() per Append(). Data
+// that doesn't fit anymore is written together with the buffer in a single
+// writev().
+//
+// With "background_flush", full buffers are written by a separate thread,
+// so that the producer, e.g. a video decoder, doesn't wait for the disk;
+// this uses a second buffer of the same size.
+class BufferedFileStreamIO : public FileStreamIO {
+public:
+  // Takes ownership of "fd". Pending data is flushed in the destructor.
+  BufferedFileStreamIO(int fd, size_t buffer_size = (4 << 20),
+                       bool background_flush = false);
+  ~BufferedFileStreamIO();
+
+  // Fsync() the file on each Flush() to make sure the data is on disk.
+  // Default: false, just hand over to the operating system.
+  void SetSyncOnFlush(bool sync) { sync_on_flush_ = sync; }
+
+  // Write all pending data. Returns false if any write failed so far.
+  bool Flush();
+
+  virtual void Rewind();
+  virtual ssize_t Read(void *buf, size_t count);
+  virtual ssize_t Append(const void *buf, size_t count);
+  virtual ssize_t ReadAt(void *buf, size_t count, int64_t offset);
+
+private:
+  class FlushThread;
+
+  bool WriteWithBuffer(const void *buf, size_t count);
+
+  const size_t buffer_size_;
+  bool sync_on_flush_;
+  char *buffer_;
+  size_t fill_;
+  FlushThread *flusher_;
+  bool write_ok_;
 };
 
 class MemStreamIO : public StreamIO {
 public:
+  MemStreamIO() : pos_(0) {}
   virtual void Rewind();
+  virtual bool IsSeekable() const { return true; }
   virtual ssize_t Read(void *buf, size_t count);
   virtual ssize_t Append(const void *buf, size_t count);
+  virtual ssize_t ReadAt(void *buf, size_t count, int64_t offset);
+
+  // Bytes kept in memory.
+  size_t size() const { return buffer_.size(); }
 
 private:
   std::string buffer_;  // super simplistic.
   size_t pos_;
 };
 
+// Read-only stream on memory owned by someone else, e.g. a mmap()ed file
+// that contains a stream. The memory has to outlive this object.
+class MappedStreamIO : public StreamIO {
+public:
+  MappedStreamIO(const void *data, size_t size)
+    : data_((const char*)data), size_(size), pos_(0) {}
+  virtual void Rewind();
+  virtual bool IsSeekable() const { return true; }
+  virtual ssize_t Read(void *buf, size_t count);
+  virtual ssize_t Append(const void *buf, size_t count);  // Always fails.
+  virtual ssize_t ReadAt(void *buf, size_t count, int64_t offset);
+
+private:
+  const char *const data_;
+  const size_t size_;
+  size_t pos_;
+};
+
 class StreamWriter {
 public:
-  // Does not take ownership of StreamIO
-  StreamWriter(StreamIO *io);
+  // Does not take ownership of StreamIO.
+  //
+  // With "delta_frames", frames are compared with the previous one and only
+  // the changed parts are written if that is less than half of the frame.
+  // Good for mostly static content such as clocks or tickers.
+  //
+  // With "deduplicate", frames identical to an earlier one are written as a
+  // reference to that frame (see Stream()). Such streams can only be read
+  // from a seekable StreamIO, so don't use it for files that might be played
+  // through a pipe; it is meant for streams kept in memory.
+  StreamWriter(StreamIO *io, bool delta_frames = false,
+               bool deduplicate = false);
 
   // Stream out given canvas at the given time. "hold_time_us" indicates
   // for how long this frame is to be shown in microseconds.
+  //
+  // If deduplicating and the frame content is identical to a frame written
+  // earlier, only a small record referring to that frame is written. This is
+  // only done if the StreamIO IsSeekable(), as the writer reads the earlier
+  // frame back to compare. The StreamIO has to be empty when the writer is
+  // created.
   bool Stream(const FrameCanvas &frame, uint32_t hold_time_us);
 
+  // Number of bytes not written because frames were repeated or only
+  // their changes were written.
+  size_t saved_bytes() const { return saved_bytes_; }
+
 private:
   void WriteFileHeader(const FrameCanvas &frame, size_t len);
 
   StreamIO *const io_;
   bool header_written_;
+  const bool deduplicate_;
+  const bool delta_frames_;
+  std::string previous_frame_;  // Serialized; to compute delta frames.
+  std::string delta_;
+
+  struct WrittenFrame {
+    uint32_t frame_number;
+    int64_t payload_offset;  // To compare with before writing a repeat.
+  };
+
+  // Content hash of frames written so far -> first frame with that hash.
+  std::map<uint64_t, WrittenFrame> written_frames_;
+  uint32_t frame_count_;
+  int64_t write_offset_;   // Bytes written to io_ so far.
+  size_t saved_bytes_;
+};
+
+// Writes a geometry independent stream: instead of the internal
+// representation, frames are stored as RGB image data that is converted
+// to the actual panel configuration while reading. Frames with at most 256
+// colors are stored palettized with one byte per pixel.
+class RGBStreamWriter {
+public:
+  // Does not take ownership of StreamIO. All frames have the same "width"
+  // and "height".
+  RGBStreamWriter(StreamIO *io, int width, int height);
+  ~RGBStreamWriter();
+
+  // Stream out image "rgb" with width * height pixels, three bytes (red,
+  // green, blue) per pixel, stored row by row. "hold_time_us" indicates
+  // for how long this frame is to be shown in microseconds.
+  bool Stream(const uint8_t *rgb, uint32_t hold_time_us);
+
+private:
+  StreamIO *const io_;
+  const int width_;
+  const int height_;
+  bool header_written_;
+  uint8_t *palette_buffer_;
 };
 
 class StreamReader {
 public:
-  // Does not take ownership of StreamIO
+  // Does not take ownership of StreamIO. If the StreamIO is not seekable,
+  // it is read forward-only starting at its current position; streams
+  // written with deduplication fail at the first repeated frame then.
   StreamReader(StreamIO *io);
   ~StreamReader();
 
-  // Go back to the beginning.
+  // Go back to the beginning. Does nothing for streams that are not
+  // seekable: these can't go back.
   void Rewind();
 
   // Get next frame and its timestamp. Returns 'false' if there is an error
   // or end of stream reached..
   bool GetNext(FrameCanvas *frame, uint32_t* hold_time_us);
 
+  // Returns true if GetNext() returned false because the stream ended
+  // cleanly after a complete frame, not because of an error.
+  bool at_end() const { return state_ == STREAM_END; }
+
 private:
   enum State {
     STREAM_AT_BEGIN,
     STREAM_READING,
+    STREAM_END,
     STREAM_ERROR,
   };
   bool ReadFileHeader(const FrameCanvas &frame);
+  void AddFrame(int64_t record_offset);
+  ssize_t ReadBytes(void *buf, size_t count);
+  bool SkipBytes(size_t count);
+  bool ApplyDelta(size_t size);
+  ssize_t ReadPayload(size_t size, int64_t offset);
+  bool DecodeFrame(uint32_t type, size_t len, FrameCanvas *frame);
 
   StreamIO *io_;
   size_t buf_size_;
   State state_;
 
-  char *buffer_;
+  int64_t read_offset_;                 // Bytes read since Rewind()
+  uint64_t frame_count_;                // Frames read since Rewind()
+  std::vector<int64_t> frame_offsets_;  // Frame number -> record offset.
+                                        // Only kept for seekable streams.
+
+  // Set for geometry independent streams.
+  bool is_rgb_stream_;
+  int rgb_width_;
+  int rgb_height_;
+
+  char *buffer_;         // Payload of the last frame.
+  uint8_t *row_buffer_;  // Expanded palette row.
+  char *delta_buffer_;
 };
+
+// Open stream file with the given name to be played on FrameCanvases
+// with the same configuration as "scratch", which is used as temporary
+// buffer. Returns NULL if file can't be opened; ownership of the returned
+// StreamIO is passed to the caller.
+//
+// The name can also refer to a named pipe or a Unix domain socket, which
+// is connected to. These are returned as-is and read forward-only.
+//
+// Raw streams are just opened. Geometry independent streams written with
+// the RGBStreamWriter are converted to the raw format and the result is stored
+// in a cache file next to the original, keyed by FrameCanvas::ConfigHash().
+// Later calls with the same configuration use that cache file directly, as
+// long as the source has the same size and modification time. A cache is
+// only kept if the whole source could be read.
+StreamIO *OpenStreamFile(const char *filename, FrameCanvas *scratch);
 }
@@ -0,0 +1,99 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Utility base class for animations that are drawn frame by frame.
+//
+// Instead of drawing on the live canvas and pacing itself with usleep(), an
+// animation derived from FrameRenderer implements RenderFrame(), which is
+// called once for each frame that is shown. It always draws into an
+// off-screen canvas, which is then swapped in with RGBMatrix::SwapOnVSync(),
+// so there is no tearing and the animation runs in lockstep with the
+// refresh of the panel.
+//
+/*
+  class Pulse : public FrameRenderer {
+  public:
+    Pulse(RGBMatrix *m) : FrameRenderer(m, 10) {}   // At most every 10ms.
+    virtual ~Pulse() { Stop(); WaitStopped(); }     // Required, see below.
+  protected:
+    virtual void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) {
+      const uint8_t c = (frame_time_us / 10000) % 256;
+      canvas->Fill(c, c, c);
+    }
+  };
+
+  Pulse *pulse = new Pulse(matrix);
+  pulse->Start();
+  ...
+  delete pulse;   // Stops the thread.
+*/
+#ifndef RPI_FRAME_RENDERER_H
+#define RPI_FRAME_RENDERER_H
+
+#include <stdint.h>
+
+#include "thread.h"
+
+namespace rgb_matrix {
+class FrameCanvas;
+class RGBMatrix;
+
+class FrameRenderer : public Thread {
+public:
+  // Render frames for "matrix". A new frame is rendered at most every
+  // "frame_period_ms" milliseconds, rounded up to whole refresh cycles of
+  // the panel; 0 renders one for each refresh cycle.
+  //
+  // Each frame is rendered into a canvas that contains the frame before
+  // the previous one (double buffering). If "keep_content" is true, it is
+  // brought up to date with the last frame shown first, which is what
+  // animations that only draw what changed need.
+  FrameRenderer(RGBMatrix *matrix, int frame_period_ms = 0,
+                bool keep_content = false);
+
+  // Stops and waits for the thread, but that is too late: by the time this
+  // runs, the derived class is already destroyed, while the thread might
+  // still be in its RenderFrame() or about to call it (a pure virtual call).
+  // So every derived class has to call Stop() and WaitStopped() in its own
+  // destructor.
+  virtual ~FrameRenderer();
+
+  virtual void Start(int realtime_priority = 0, uint32_t affinity_mask = 0);
+
+  // Stop rendering after the current frame. Can be called from any thread,
+  // including from RenderFrame().
+  void Stop() { __atomic_store_n(&running_, false, __ATOMIC_RELEASE); }
+  bool running() const {
+    return __atomic_load_n(&running_, __ATOMIC_ACQUIRE);
+  }
+
+protected:
+  // Implement this: draw the complete frame to be shown at "frame_time_us",
+  // the estimated time in microseconds of CLOCK_MONOTONIC at which it will
+  // appear. Use it to make the speed of the animation independent of the
+  // refresh rate.
+  virtual void RenderFrame(FrameCanvas *canvas, int64_t frame_time_us) = 0;
+
+  // The time in microseconds between two frames as measured; RenderFrame()
+  // has to finish in less than that to not drop frames. 0 before the first
+  // frame was shown.
+  int64_t render_budget_us() const { return frame_interval_us_; }
+
+  // The time in microseconds the last call to RenderFrame() took.
+  int64_t last_render_us() const { return last_render_us_; }
+
+  RGBMatrix *matrix() { return matrix_; }
+
+private:
+  virtual void Run();
+
+  RGBMatrix *const matrix_;
+  const int64_t frame_period_us_;
+  const bool keep_content_;
+  bool running_;
+  int64_t refresh_interval_us_;   // Time of one refresh cycle.
+  int64_t frame_interval_us_;     // Time between two rendered frames.
+  int64_t last_render_us_;
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_FRAME_RENDERER_H
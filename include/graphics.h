@@ -9,10 +9,17 @@
 
 #include "canvas.h"
 
-#include <map>
+#include <stddef.h>
 #include <stdint.h>
 
+#include <string>
+#include <vector>
+
 namespace rgb_matrix {
+class FrameCanvas;
+class RGBMatrix;
+class WideCanvas;
+
 struct Color {
   Color(uint8_t rr, uint8_t gg, uint8_t bb) : r(rr), g(gg), b(bb) {}
   uint8_t r;
@@ -28,6 +35,10 @@ public:
   Font();
   ~Font();
 
+  // Load font from a BDF file. The parsed font is stored in a binary cache
+  // next to it ("<path>.cache") if that directory is writable; later calls
+  // map that cache into memory instead of parsing again. The cache is
+  // rebuilt whenever the BDF file changes.
   bool LoadFont(const char *path);
 
   // Return height of font in pixels. Returns -1 if font has not been loaded.
@@ -40,6 +51,11 @@ public:
   // does not exist.
   int CharacterWidth(uint32_t unicode_codepoint) const;
 
+  // Return how far DrawGlyph() advances for the given character. Like
+  // DrawGlyph(), falls back to the replacement character "�"; returns 0 if
+  // that is not available either.
+  int CharacterAdvance(uint32_t unicode_codepoint) const;
+
   // Draws the unicode character at position "x","y"
   // with "color" on "background_color" (background_color can be NULL for
   // transparency.
@@ -68,13 +84,135 @@ private:
   Font(const Font& x);  // No copy constructor. Use references or pointer instead.
 
   struct Glyph;
-  typedef std::map<uint32_t, Glyph*> CodepointGlyphMap;
+  // Codepoint outside the Basic Multilingual Plane and its glyph.
+  struct CodepointGlyph {
+    uint32_t codepoint;
+    uint32_t offset;
+  };
 
+  static bool CompareCodepoint(const CodepointGlyph &a,
+                               const CodepointGlyph &b);
   const Glyph *FindGlyph(uint32_t codepoint) const;
+  Glyph *GlyphAt(uint32_t offset);
+  // Reserve space for a glyph with "height" rows at the end of the arena
+  // and return its offset.
+  uint32_t AllocateGlyph(int height);
+  void SetGlyph(uint32_t codepoint, uint32_t offset);
+  // All codepoints that have a glyph, in ascending order.
+  void GetCodepoints(std::vector<uint32_t> *codepoints) const;
+
+  bool ParseBDF(const char *path);
+  // The cache is only valid for the BDF file with the given size and
+  // modification time in nanoseconds.
+  bool MapCache(const char *cache_path, int64_t source_size,
+                int64_t source_mtime_ns);
+  void WriteCache(const char *cache_path, int64_t source_size,
+                  int64_t source_mtime_ns) const;
+  // Copy a mapped cache into our own storage, so that glyphs can be added.
+  void UnmapCache();
+  // Point the lookup tables to our own storage.
+  void UseOwnStorage();
 
   int font_height_;
   int base_line_;
-  CodepointGlyphMap glyphs_;
+
+  // All glyphs with their bitmap rows, one after another. Glyphs are
+  // referred to by their offset in here.
+  std::vector<uint64_t> arena_;
+  // Basic Multilingual Plane: for each block of 256 codepoints the index
+  // of its page in bmp_glyphs_, which has 256 glyph offsets per page.
+  // Only blocks that have any glyph get a page.
+  std::vector<uint32_t> bmp_pages_;
+  std::vector<uint32_t> bmp_glyphs_;
+  // All other codepoints, sorted.
+  std::vector<CodepointGlyph> other_glyphs_;
+
+  // Lookups go through these, which point either to the storage above or
+  // into the mapped cache file.
+  const uint64_t *arena_data_;
+  const uint32_t *bmp_pages_data_;
+  const uint32_t *bmp_glyphs_data_;
+  const CodepointGlyph *other_glyphs_data_;
+  size_t other_glyphs_count_;
+  void *map_;
+  size_t map_size_;
+};
+
+// A line of text, decoded and measured once. Drawing it again, e.g. for
+// each step of a ticker, only draws the glyphs that are visible on the
+// canvas instead of going through the whole string.
+class TextLayout {
+public:
+  // Layout "utf8_text" with "font", with "extra_spacing" pixels between
+  // characters as in DrawText(). The font has to outlive the layout.
+  TextLayout(const Font &font, const char *utf8_text, int extra_spacing = 0);
+
+  const Font &font() const { return font_; }
+  const std::string &text() const { return text_; }
+  int extra_spacing() const { return extra_spacing_; }
+
+  // Width of the text in pixels; the same DrawText() returns.
+  int width() const { return width_; }
+
+  // Draw the text with "x" left and "y" the baseline, same as DrawText(),
+  // but skip all characters outside of the canvas. Returns width().
+  int Draw(Canvas *c, int x, int y,
+           const Color &color, const Color *background_color) const;
+
+private:
+  struct PlacedGlyph {
+    uint32_t codepoint;
+    int x;      // Relative to the start of the text.
+    int end;    // First column after the glyph.
+  };
+  static bool EndsBefore(const PlacedGlyph &glyph, int x);
+
+  const Font &font_;
+  const std::string text_;
+  const int extra_spacing_;
+  int width_;
+  std::vector<PlacedGlyph> glyphs_;
+};
+
+// A TextLayout rendered once into an off-screen canvas of its own size.
+// Showing it is then only a copy of the visible pixels into a FrameCanvas,
+// without any glyph lookup or color conversion; a good fit for scrolling
+// text that does not change.
+class RenderedText {
+public:
+  // Render "layout" with "color" on "background_color" (black if NULL).
+  // The "matrix" provides the pixel layout and color settings, so the
+  // result can only be shown on its FrameCanvases.
+  RenderedText(RGBMatrix *matrix, const TextLayout &layout,
+               const Color &color, const Color *background_color);
+
+  // Same, with "outline_font" (see Font::CreateOutlineFont()) drawn in
+  // "outline_color" around the text. The outline extends one pixel beyond
+  // the text on each side.
+  RenderedText(RGBMatrix *matrix, const TextLayout &layout,
+               const Color &color, const Color *background_color,
+               const Font &outline_font, const Color &outline_color);
+  ~RenderedText();
+
+  // Width of the text, without the outline.
+  int width() const { return width_; }
+
+  // Show the text on "frame" with "x" left and "y" the baseline, the same
+  // position DrawText() would draw it. Only the visible part is copied;
+  // that includes the background around the glyphs.
+  void Draw(FrameCanvas *frame, int x, int y) const;
+
+private:
+  RenderedText(const RenderedText&);  // Not copyable.
+
+  void Render(RGBMatrix *matrix, const TextLayout &layout,
+              const Color &color, const Color *background_color,
+              const Font *outline_font, const Color *outline_color);
+
+  WideCanvas *surface_;
+  int width_;
+  int margin_;    // Pixels around the text for the outline.
+  int baseline_;  // Baseline row in the surface.
 };
 
 // -- Some utility functions.
@@ -112,6 +250,25 @@ void DrawCircle(Canvas *c, int x, int y, int radius, const Color &color);
 // Draw a line from "x0", "y0" to "x1", "y1" and with "color"
 void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color);
 
+// Filled shapes. On a FrameCanvas or WideCanvas, these write whole spans
+// into the framebuffer with the color mapped only once, which is a lot
+// faster than setting each pixel; other canvases get SetPixel() calls.
+
+// Fill the rect with the top left corner "x", "y" and "width" x "height"
+// pixels with "color".
+void FillRect(Canvas *c, int x, int y, int width, int height,
+              const Color &color);
+
+// Draw a filled circle centered at "x", "y" with "radius"; the same pixels
+// DrawCircle() draws and everything inside.
+void FillCircle(Canvas *c, int x, int y, int radius, const Color &color);
+
+// Draw a filled polygon with "count" corners at "x[i]", "y[i]". Pixels are
+// filled if their center is inside (even-odd rule), so a rectangle from
+// 0,0 to 10,10 fills the same pixels as FillRect(c, 0, 0, 10, 10, color).
+void FillPolygon(Canvas *c, const int *x, const int *y, int count,
+                 const Color &color);
+
 }  // namespace rgb_matrix
 
 #endif  // RPI_GRAPHICS_H
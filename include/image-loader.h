@@ -0,0 +1,52 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Minimal loader for simple uncompressed image formats, so that programs
+// showing small assets don't need to pull in a full image library.
+//
+// Supported are
+//   - BMP: uncompressed with 1, 4, 8 (palettized), 24 or 32 bits per pixel.
+//   - PPM (P6) and PGM (P5), binary, with 8 or 16 bits per sample.
+//   - Raw RGB: files ending in .rgb or .raw with three bytes per pixel and no
+//     header. The size is not stored, so has to be given when loading.
+// Everything else is left to a real image library (the utils use
+// GraphicsMagick as fallback).
+//
+// Images are stored in the layout FrameCanvas::SetPixels() expects, so they
+// can be put on a canvas without any conversion.
+#ifndef RPI_IMAGE_LOADER_H
+#define RPI_IMAGE_LOADER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace rgb_matrix {
+// An image with "width" * "height" pixels with three bytes (red, green, blue)
+// each, stored row by row.
+struct RGBImage {
+  RGBImage() : width(0), height(0) {}
+  int width;
+  int height;
+  std::vector<uint8_t> pixels;
+};
+
+// Returns true if "filename" is a regular file that LoadNativeImage() can
+// read. The header is checked with the same rules as when loading, and
+// against the file size; raw files are recognized by their extension and a
+// size that is a multiple of three. Programs with an image library can use
+// it for everything this returns false for.
+bool IsNativeImage(const char *filename);
+
+// Load image from "filename" into "image". For raw RGB files, the size
+// has to be given in "raw_width" and "raw_height"; it is ignored for all
+// other formats. Returns false on failure with the reason in "err_msg".
+bool LoadNativeImage(const char *filename, int raw_width, int raw_height,
+                     RGBImage *image, std::string *err_msg);
+
+// Scale "in" to "width" x "height" and store in "out". Shrinking averages
+// all pixels that fall into an output pixel, enlarging repeats pixels.
+void ScaleImage(const RGBImage &in, int width, int height, RGBImage *out);
+}  // namespace rgb_matrix
+
+#endif  // RPI_IMAGE_LOADER_H
@@ -32,6 +32,8 @@
 namespace rgb_matrix {
 class RGBMatrix;
 class FrameCanvas;   // Canvas for Double- and Multibuffering
+class WideCanvas;    // Content larger than the display, for scrolling
+class Sprite;        // Image prepared for fast drawing
 
 namespace internal {
 class Framebuffer;
@@ -235,6 +237,26 @@ public:
   // don't have to worry about deleting them.
   FrameCanvas *CreateFrameCanvas();
 
+  // Create a canvas of "width" x "height" pixels for content that is larger
+  // than the display, such as long scrolling text. Draw the content once,
+  // then show any part of it with FrameCanvas::CopyViewport(); scrolling by
+  // one pixel is then a cheap copy instead of drawing everything again.
+  // The canvas starts with the current PWM bits, brightness and luminance
+  // correction of the matrix.
+  //
+  // Unlike FrameCanvas, the caller owns the returned canvas and has to
+  // delete it before the RGBMatrix is deleted.
+  WideCanvas *CreateWideCanvas(int width, int height);
+
+  // Create a sprite from "width" x "height" pixels "rgba" with four bytes
+  // (red, green, blue, alpha) each, row by row. Pixels that are not fully
+  // opaque are transparent. The colors are converted right away with the
+  // current brightness and luminance correction, so drawing the sprite with
+  // FrameCanvas::DrawSprite() later needs no color conversion at all.
+  //
+  // The caller owns the returned sprite.
+  Sprite *CreateSprite(int width, int height, const uint8_t *rgba);
+
   // This method waits to the next VSync and swaps the active buffer with the
   // supplied buffer. The formerly active buffer is returned.
   //
@@ -350,6 +372,92 @@ public:
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
   void CopyFrom(const FrameCanvas &other);
 
+  // Fill this canvas with the part of "content" that starts at "x_offset",
+  // "y_offset". Offsets wrap around, so the content repeats endlessly in
+  // both directions. "content" has to be created by the same RGBMatrix.
+  //
+  // Horizontal scrolling without pixel mappers copies whole bitplane spans
+  // and is very fast; other cases copy pixel by pixel, which still saves
+  // all the color conversion of drawing.
+  void CopyViewport(const WideCanvas &content, int x_offset, int y_offset);
+
+  // Copy the "width" x "height" pixels at "src_x", "src_y" of "content" to
+  // "x", "y" of this canvas, clipped to both. Like CopyViewport(), rects
+  // spanning the full height of the canvas copy whole bitplane columns
+  // if no pixel mapper is used; others go pixel by pixel.
+  void CopyRect(const WideCanvas &content, int src_x, int src_y,
+                int x, int y, int width, int height);
+
+  // Same for a rect of another FrameCanvas of the same RGBMatrix, e.g. to
+  // restore parts of a static background.
+  void CopyRect(const FrameCanvas &other, int src_x, int src_y,
+                int x, int y, int width, int height);
+
+  // Fill the rect at "x", "y" with the given color, clipped to the canvas.
+  // Writes whole spans of each bitplane at once and maps the color only
+  // once, so this is much faster than setting each pixel.
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+
+  // Fill "count" horizontal spans with the given color. "spans" has three
+  // values per span: the row, the first column and the column after the
+  // last. Spans are clipped to the canvas. This is what the filled shapes
+  // in graphics.h are drawn with.
+  void FillSpans(const int *spans, int count,
+                 uint8_t red, uint8_t green, uint8_t blue);
+
+  // Draw "sprite" with its top left corner at "x", "y", clipped to the
+  // canvas. Transparent pixels keep the current content.
+  void DrawSprite(const Sprite &sprite, int x, int y);
+
+  // Returns a hash of all settings that influence the Serialize()d
+  // representation (rows, chain, parallel, pixel mappers, pwm bits,
+  // brightness, ...). Serialized data can only be Deserialize()d into a
+  // FrameCanvas with the same hash, so this is a good key for caches.
+  uint32_t ConfigHash() const;
+
+  // Split the rows of this canvas into sets that don't share any of the
+  // internal bitplane words, so different threads can draw into rows of
+  // different sets at the same time. "row_set" gets the set of each row;
+  // returns the number of sets. Without pixel mappers, the rows of a set are
+  // the ones multiplexed together (e.g. 0, 16, 32, .. with 32 row panels);
+  // some mappers, such as a rotation by 90 degrees, leave only one set.
+  // Used by the ParallelRenderer.
+  int GetIndependentRows(std::vector<int> *row_set) const;
+
+  // Set a block of pixels at once. "rgb" points to "width" * "height" pixels
+  // with three bytes (red, green, blue) each, stored row by row. The block
+  // is placed with its top left corner at "x", "y" and clipped to the canvas.
+  // Faster than calling SetPixel() for each pixel.
+  void SetPixels(int x, int y, int width, int height, const uint8_t *rgb);
+
+  // Same as SetPixels(), but with four bytes (red, green, blue, alpha) per
+  // pixel. Only fully opaque pixels (alpha 255) are set; all others keep the
+  // current content, so images with transparent areas can be put on top.
+  void SetPixelsRGBA(int x, int y, int width, int height, const uint8_t *rgba);
+
+  // Fill the whole canvas with a YUV 4:2:0 image, as most video decoders
+  // output it: "planes" are Y, U and V, "strides" the bytes per row of each.
+  // The image of "src_width" x "src_height" is scaled to the canvas size,
+  // averaging all pixels that fall into one canvas pixel. Colors are
+  // converted as BT.601; "full_range" is for 0..255 luma (JPEG style)
+  // instead of 16..235.
+  // Does scaling, color conversion and writing the pixels in one pass, so
+  // it is a lot faster than scaling to RGB first and setting each pixel.
+  void SetPixelsYUV420(const uint8_t *const planes[3], const int strides[3],
+                       int src_width, int src_height, bool full_range);
+
+  // Set a block of one-bit pixels, as used for font glyphs: "rows" has
+  // "height" entries, of which bit 63 is the leftmost pixel; at most 64
+  // pixels "width". Set bits get the "foreground" color, cleared bits the
+  // "background" color or are left untouched if it is NULL. Colors are
+  // three bytes red, green, blue. Clipped to the canvas.
+  // The colors are mapped once per call and whole rows are written per
+  // bitplane, so this is a lot faster than SetPixel() for each bit.
+  void SetPixelsBitmap(int x, int y, int width, int height,
+                       const uint64_t *rows, const uint8_t *foreground,
+                       const uint8_t *background);
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -368,6 +476,76 @@ private:
   internal::Framebuffer *const frame_;
 };
 
+// An image converted for the framebuffer, see RGBMatrix::CreateSprite().
+// For each bitplane and pixel it keeps which colors are on, so drawing it
+// is one table lookup and masked write per pixel and plane.
+class Sprite {
+public:
+  ~Sprite();
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+private:
+  friend class RGBMatrix;
+  friend class FrameCanvas;
+
+  Sprite(int width, int height) : width_(width), height_(height) {}
+  Sprite(const Sprite&);  // Not copyable.
+
+  const int width_;
+  const int height_;
+  std::vector<uint8_t> codes_;
+};
+
+// Canvas for content larger than the display, see
+// RGBMatrix::CreateWideCanvas(). Only used as source for
+// FrameCanvas::CopyViewport(); it is never displayed itself.
+class WideCanvas : public Canvas {
+public:
+  virtual ~WideCanvas();
+
+  // Brightness in percent for newly set pixels. 1%..100%.
+  void SetBrightness(uint8_t brightness);
+  uint8_t brightness();
+
+  // Set a block of pixels at once, see FrameCanvas::SetPixels().
+  void SetPixels(int x, int y, int width, int height, const uint8_t *rgb);
+
+  // Set one-bit pixels, see FrameCanvas::SetPixelsBitmap().
+  void SetPixelsBitmap(int x, int y, int width, int height,
+                       const uint64_t *rows, const uint8_t *foreground,
+                       const uint8_t *background);
+
+  // Fill rects or spans, see FrameCanvas::FillRect() and FillSpans().
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+  void FillSpans(const int *spans, int count,
+                 uint8_t red, uint8_t green, uint8_t blue);
+
+  // -- Canvas interface.
+  virtual int width() const;
+  virtual int height() const;
+  virtual void SetPixel(int x, int y,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void Clear();
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+
+private:
+  friend class RGBMatrix;
+  friend class FrameCanvas;
+
+  WideCanvas(const RGBMatrix::Options &params, int width, int height);
+
+  // The content is cut into bands of the height of the display, which are
+  // stored next to each other in one framebuffer that is as wide as all
+  // bands together. So every band has exactly the bitplane layout of a
+  // display frame.
+  internal::PixelDesignatorMap *map_;  // Content pixel -> framebuffer bits.
+  const int band_height_;
+  internal::Framebuffer *const frame_;
+};
+
 // Runtime options to simplify doing common things for many programs such as
 // dropping privileges and becoming a daemon.
 struct RuntimeOptions {
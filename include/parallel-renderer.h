@@ -0,0 +1,104 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Drawing a frame with several threads.
+//
+// The refresh thread of the RGBMatrix keeps one CPU busy, but the other
+// cores of a multi-core Pi are idle while an effect computes its next frame.
+// The ParallelRenderer splits the rows of a FrameCanvas among a pool of
+// worker threads, which stay off the CPU used for refreshing.
+//
+// Different threads never get rows that are stored in the same internal
+// bitplane words (see FrameCanvas::GetIndependentRows()), so all drawing
+// functions can be used without any locking, as long as each call only
+// writes to the rows it was given.
+//
+//   class Plasma : public ParallelRenderer::Job {
+//   public:
+//     virtual void RenderRows(FrameCanvas *canvas, int y_begin, int y_end) {
+//       for (int y = y_begin; y < y_end; ++y)
+//         for (int x = 0; x < canvas->width(); ++x)
+//           canvas->SetPixel(x, y, ...);   // Expensive calculation.
+//     }
+//   };
+//
+//   ParallelRenderer renderer;
+//   Plasma plasma;
+//   FrameCanvas *offscreen = matrix->CreateFrameCanvas();
+//   while (running) {
+//     renderer.Render(&plasma, offscreen);   // Returns when all rows are done.
+//     offscreen = matrix->SwapOnVSync(offscreen);
+//   }
+#ifndef RPI_PARALLEL_RENDERER_H
+#define RPI_PARALLEL_RENDERER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <vector>
+
+#include "thread.h"
+
+namespace rgb_matrix {
+class FrameCanvas;
+
+class ParallelRenderer {
+public:
+  class Job {
+  public:
+    virtual ~Job() {}
+
+    // Draw rows "y_begin" up to excluding "y_end" of "canvas". Called from
+    // several threads at the same time, possibly several times per frame
+    // with different ranges of rows.
+    virtual void RenderRows(FrameCanvas *canvas, int y_begin, int y_end) = 0;
+  };
+
+  // Create a renderer with "threads" worker threads in addition to the
+  // thread calling Render(), which does its share of the work as well.
+  // The default of -1 uses all CPUs except the one of the refresh thread
+  // and the calling one; that is two workers on a Raspberry Pi 2 or 3, none
+  // on a Pi 1. Workers may run on all CPUs but the refresh CPU.
+  explicit ParallelRenderer(int threads = -1);
+
+  // Waits for the worker threads to finish.
+  ~ParallelRenderer();
+
+  int threads() const { return (int) workers_.size(); }
+
+  // Let "job" draw all rows of "canvas" and return when it is done, so the
+  // canvas is ready for RGBMatrix::SwapOnVSync().
+  //
+  // How the rows are split is determined with the first canvas rendered, so
+  // apply all pixel mappers before. All canvases have to be from the same
+  // RGBMatrix. Only call from one thread.
+  void Render(Job *job, FrameCanvas *canvas);
+
+private:
+  class Worker;
+
+  void SplitRows(const FrameCanvas *canvas);
+  void WorkerLoop();
+  void RunTasks();
+
+  std::vector<Worker*> workers_;
+
+  // Ranges of rows, two values each (first row, row after the last). The
+  // ranges of task i are ranges_[task_start_[i]] up to
+  // ranges_[task_start_[i+1]].
+  std::vector<int> ranges_;
+  std::vector<int> task_start_;
+  int split_height_;   // Height of the canvas the rows were split for.
+
+  Mutex mutex_;
+  pthread_cond_t work_cond_;   // New frame to render or shutdown.
+  pthread_cond_t done_cond_;   // All tasks of the frame are done.
+  int generation_;             // Incremented for each frame.
+  bool shutdown_;
+  Job *job_;
+  FrameCanvas *canvas_;
+  int next_task_;
+  int tasks_done_;
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_PARALLEL_RENDERER_H
@@ -58,6 +58,10 @@ public:
   void Unlock() { pthread_mutex_unlock(&mutex_); }
   void WaitOn(pthread_cond_t *cond) { pthread_cond_wait(cond, &mutex_); }
 
+  // Wait on condition for at most "timeout_ms" milliseconds.
+  // Returns 'true' if condition was signalled, 'false' if wait timed out.
+  bool WaitOn(pthread_cond_t *cond, long timeout_ms);
+
 private:
   pthread_mutex_t mutex_;
 };
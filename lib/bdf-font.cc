@@ -20,10 +20,18 @@
 #include <inttypes.h>
 
 #include "graphics.h"
+#include "led-matrix.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 // The little question-mark box "�" for unknown code.
 static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
@@ -40,17 +48,265 @@ struct Font::Glyph {
   rowbitmap_t bitmap[0];  // contains 'height' elements.
 };
 
-Font::Font() : font_height_(-1), base_line_(0) {}
+// Marks empty entries in the glyph index.
+static const uint32_t kNoGlyph = 0xffffffff;
+static const int kPageBits = 8;
+static const uint32_t kPageSize = 1 << kPageBits;
+static const uint32_t kBMPEnd = 0x10000;
+static const uint32_t kBMPPages = kBMPEnd / kPageSize;
+
+// Binary cache of a parsed font. The header is followed by the glyph arena
+// and the lookup tables exactly as Font keeps them in memory, so the file
+// can be used in place once mapped.
+static const uint32_t kCacheMagic = 0xF0A7CAC1;  // Also tells byte order.
+static const uint32_t kCacheVersion = 1;
+struct CacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  // The BDF file the cache was created from. If it changes, the cache is
+  // stale.
+  int64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  int32_t font_height;
+  int32_t base_line;
+  uint32_t arena_words;
+  uint32_t bmp_glyph_count;    // Entries, a multiple of the page size.
+  uint32_t other_glyph_count;
+  uint32_t reserved;           // Keeps the following data 8-byte aligned.
+  // Followed by
+  //   uint64_t arena[arena_words];
+  //   uint32_t bmp_pages[kBMPPages];
+  //   uint32_t bmp_glyphs[bmp_glyph_count];
+  //   CodepointGlyph other_glyphs[other_glyph_count];
+};
+
+static bool WriteFully(int fd, const void *data, size_t len) {
+  const char *pos = (const char*) data;
+  while (len > 0) {
+    const ssize_t w = write(fd, pos, len);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    pos += w;
+    len -= w;
+  }
+  return true;
+}
+
+Font::Font()
+  : font_height_(-1), base_line_(0), bmp_pages_(kBMPPages, kNoGlyph),
+    map_(NULL), map_size_(0) {
+  UseOwnStorage();
+}
 Font::~Font() {
-  for (CodepointGlyphMap::iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    free(it->second);
+  if (map_) munmap(map_, map_size_);
+}
+
+bool Font::CompareCodepoint(const CodepointGlyph &a, const CodepointGlyph &b) {
+  return a.codepoint < b.codepoint;
+}
+
+Font::Glyph *Font::GlyphAt(uint32_t offset) {
+  return reinterpret_cast<Glyph*>(&arena_[offset]);
+}
+
+uint32_t Font::AllocateGlyph(int height) {
+  const uint32_t offset = arena_.size();
+  arena_.resize(offset + (sizeof(Glyph) + height * sizeof(rowbitmap_t))
+                / sizeof(uint64_t), 0);
+  return offset;
+}
+
+void Font::SetGlyph(uint32_t codepoint, uint32_t offset) {
+  if (codepoint < kBMPEnd) {
+    uint32_t &page = bmp_pages_[codepoint >> kPageBits];
+    if (page == kNoGlyph) {
+      page = bmp_glyphs_.size() / kPageSize;
+      bmp_glyphs_.resize(bmp_glyphs_.size() + kPageSize, kNoGlyph);
+    }
+    bmp_glyphs_[page * kPageSize + (codepoint & (kPageSize - 1))] = offset;
+    return;
   }
+  const CodepointGlyph entry = { codepoint, offset };
+  std::vector<CodepointGlyph>::iterator it
+    = std::lower_bound(other_glyphs_.begin(), other_glyphs_.end(), entry,
+                       CompareCodepoint);
+  if (it != other_glyphs_.end() && it->codepoint == codepoint)
+    it->offset = offset;  // Replaces an earlier one.
+  else
+    other_glyphs_.insert(it, entry);
+}
+
+void Font::GetCodepoints(std::vector<uint32_t> *codepoints) const {
+  for (uint32_t block = 0; block < kBMPPages; ++block) {
+    const uint32_t page = bmp_pages_data_[block];
+    if (page == kNoGlyph) continue;
+    for (uint32_t i = 0; i < kPageSize; ++i) {
+      if (bmp_glyphs_data_[page * kPageSize + i] != kNoGlyph)
+        codepoints->push_back((block << kPageBits) + i);
+    }
+  }
+  for (size_t i = 0; i < other_glyphs_count_; ++i)
+    codepoints->push_back(other_glyphs_data_[i].codepoint);
+}
+
+void Font::UseOwnStorage() {
+  arena_data_ = arena_.empty() ? NULL : &arena_[0];
+  bmp_pages_data_ = &bmp_pages_[0];
+  bmp_glyphs_data_ = bmp_glyphs_.empty() ? NULL : &bmp_glyphs_[0];
+  other_glyphs_data_ = other_glyphs_.empty() ? NULL : &other_glyphs_[0];
+  other_glyphs_count_ = other_glyphs_.size();
+}
+
+static const int64_t kNanosPerSecond = 1000000000;
+
+bool Font::MapCache(const char *cache_path, int64_t source_size,
+                    int64_t source_mtime_ns) {
+  const int fd = open(cache_path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat sb;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &sb) == 0 && (size_t)sb.st_size >= sizeof(CacheHeader))
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const CacheHeader *header = (const CacheHeader*) map;
+  const uint64_t expected_size = sizeof(CacheHeader)
+    + header->arena_words * (uint64_t)sizeof(uint64_t)
+    + kBMPPages * sizeof(uint32_t)
+    + header->bmp_glyph_count * (uint64_t)sizeof(uint32_t)
+    + header->other_glyph_count * (uint64_t)sizeof(CodepointGlyph);
+  if (header->magic != kCacheMagic || header->version != kCacheVersion
+      || header->source_size != source_size
+      || header->source_mtime_sec != source_mtime_ns / kNanosPerSecond
+      || header->source_mtime_nsec != source_mtime_ns % kNanosPerSecond
+      || header->bmp_glyph_count % kPageSize != 0
+      || expected_size != (uint64_t)sb.st_size) {
+    munmap(map, sb.st_size);
+    return false;
+  }
+
+  const uint64_t *arena = (const uint64_t*) (header + 1);
+  const uint32_t *pages = (const uint32_t*) (arena + header->arena_words);
+  const uint32_t *glyphs = pages + kBMPPages;
+  const CodepointGlyph *other
+    = (const CodepointGlyph*) (glyphs + header->bmp_glyph_count);
+
+  // The file is ours, but might be broken; make sure no lookup can end up
+  // outside of it.
+  const uint32_t glyph_words = sizeof(Glyph) / sizeof(uint64_t);
+  bool valid = true;
+  for (uint32_t i = 0; valid && i < kBMPPages; ++i) {
+    valid = (pages[i] == kNoGlyph
+             || pages[i] < header->bmp_glyph_count / kPageSize);
+  }
+  const uint32_t offset_count = header->bmp_glyph_count
+    + header->other_glyph_count;
+  for (uint32_t i = 0; valid && i < offset_count; ++i) {
+    const uint32_t offset = (i < header->bmp_glyph_count)
+      ? glyphs[i] : other[i - header->bmp_glyph_count].offset;
+    if (offset == kNoGlyph) continue;
+    if (offset > header->arena_words - glyph_words
+        || header->arena_words < glyph_words) {
+      valid = false;
+      break;
+    }
+    const Glyph *g = reinterpret_cast<const Glyph*>(arena + offset);
+    valid = (g->height >= 0
+             && (uint64_t)g->height <= header->arena_words - offset
+             - glyph_words);
+  }
+  if (!valid) {
+    munmap(map, sb.st_size);
+    return false;
+  }
+
+  map_ = map;
+  map_size_ = sb.st_size;
+  font_height_ = header->font_height;
+  base_line_ = header->base_line;
+  arena_data_ = arena;
+  bmp_pages_data_ = pages;
+  bmp_glyphs_data_ = glyphs;
+  other_glyphs_data_ = other;
+  other_glyphs_count_ = header->other_glyph_count;
+  return true;
+}
+
+void Font::UnmapCache() {
+  if (map_ == NULL) return;
+  const CacheHeader *header = (const CacheHeader*) map_;
+  arena_.assign(arena_data_, arena_data_ + header->arena_words);
+  bmp_pages_.assign(bmp_pages_data_, bmp_pages_data_ + kBMPPages);
+  bmp_glyphs_.assign(bmp_glyphs_data_,
+                     bmp_glyphs_data_ + header->bmp_glyph_count);
+  other_glyphs_.assign(other_glyphs_data_,
+                       other_glyphs_data_ + header->other_glyph_count);
+  munmap(map_, map_size_);
+  map_ = NULL;
+  map_size_ = 0;
+  UseOwnStorage();
+}
+
+void Font::WriteCache(const char *cache_path, int64_t source_size,
+                      int64_t source_mtime_ns) const {
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kCacheMagic;
+  header.version = kCacheVersion;
+  header.source_size = source_size;
+  header.source_mtime_sec = source_mtime_ns / kNanosPerSecond;
+  header.source_mtime_nsec = source_mtime_ns % kNanosPerSecond;
+  header.font_height = font_height_;
+  header.base_line = base_line_;
+  header.arena_words = arena_.size();
+  header.bmp_glyph_count = bmp_glyphs_.size();
+  header.other_glyph_count = other_glyphs_.size();
+
+  // Write to a temporary file first, so that other processes loading the
+  // same font never see a partial cache.
+  char tmp_name[1024 + 16];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%d", cache_path, getpid());
+  const int fd = open(tmp_name, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+  if (fd < 0) return;  // Not writable; we just parse the BDF next time.
+  bool success = WriteFully(fd, &header, sizeof(header))
+    && WriteFully(fd, arena_data_, arena_.size() * sizeof(uint64_t))
+    && WriteFully(fd, bmp_pages_data_, kBMPPages * sizeof(uint32_t))
+    && WriteFully(fd, bmp_glyphs_data_, bmp_glyphs_.size() * sizeof(uint32_t))
+    && WriteFully(fd, other_glyphs_data_,
+                  other_glyphs_.size() * sizeof(CodepointGlyph));
+  success &= (close(fd) == 0);
+  if (!success || rename(tmp_name, cache_path) != 0)
+    unlink(tmp_name);
 }
 
-// TODO: that might not be working for all input files yet.
 bool Font::LoadFont(const char *path) {
   if (!path || !*path) return false;
+  struct stat source;
+  if (stat(path, &source) != 0)
+    return false;
+  const int64_t source_mtime_ns = source.st_mtim.tv_sec * kNanosPerSecond
+    + source.st_mtim.tv_nsec;
+  char cache_path[1024];
+  snprintf(cache_path, sizeof(cache_path), "%s.cache", path);
+
+  // Loading more fonts into one adds their glyphs; the cache can only be
+  // used for the first.
+  const bool is_empty = (map_ == NULL && arena_.empty());
+  if (is_empty && MapCache(cache_path, source.st_size, source_mtime_ns))
+    return true;
+  UnmapCache();
+  if (!ParseBDF(path))
+    return false;
+  UseOwnStorage();
+  if (is_empty)
+    WriteCache(cache_path, source.st_size, source_mtime_ns);
+  return true;
+}
+
+// TODO: that might not be working for all input files yet.
+bool Font::ParseBDF(const char *path) {
   FILE *f = fopen(path, "r");
   if (f == NULL)
     return false;
@@ -59,6 +315,7 @@ bool Font::LoadFont(const char *path) {
   int dummy;
   Glyph tmp;
   Glyph *current_glyph = NULL;
+  uint32_t current_offset = 0;
   int row = 0;
 
   int bitmap_shift = 0;
@@ -76,8 +333,10 @@ bool Font::LoadFont(const char *path) {
     }
     else if (sscanf(buffer, "BBX %d %d %d %d", &tmp.width, &tmp.height,
                     &tmp.x_offset, &tmp.y_offset) == 4) {
-      current_glyph = (Glyph*) malloc(sizeof(Glyph)
-                                      + tmp.height * sizeof(rowbitmap_t));
+      // The previous glyph was not finished, so its space can be reused.
+      if (current_glyph) arena_.resize(current_offset);
+      current_offset = AllocateGlyph(tmp.height);
+      current_glyph = GlyphAt(current_offset);
       *current_glyph = tmp;
       // We only get number of bytes large enough holding our width. We want
       // it always left-aligned.
@@ -96,12 +355,12 @@ bool Font::LoadFont(const char *path) {
     }
     else if (strncmp(buffer, "ENDCHAR", strlen("ENDCHAR")) == 0) {
       if (current_glyph && row == current_glyph->height) {
-        free(glyphs_[codepoint]);  // just in case there was one.
-        glyphs_[codepoint] = current_glyph;
+        SetGlyph(codepoint, current_offset);
         current_glyph = NULL;
       }
     }
   }
+  if (current_glyph) arena_.resize(current_offset);
   fclose(f);
   return true;
 }
@@ -111,12 +370,13 @@ Font *Font::CreateOutlineFont() const {
   const int kBorder = 1;
   r->font_height_ = font_height_ + 2*kBorder;
   r->base_line_ = base_line_ + kBorder;
-  for (CodepointGlyphMap::const_iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    const Glyph *orig = it->second;
+  std::vector<uint32_t> codepoints;
+  GetCodepoints(&codepoints);
+  for (size_t i = 0; i < codepoints.size(); ++i) {
+    const Glyph *orig = FindGlyph(codepoints[i]);
     const int height = orig->height + 2 * kBorder;
-    const size_t alloc_size = sizeof(Glyph) + height * sizeof(rowbitmap_t);
-    Glyph *const tmp_glyph = (Glyph*) calloc(1, alloc_size);
+    const uint32_t offset = r->AllocateGlyph(height);
+    Glyph *const tmp_glyph = r->GlyphAt(offset);
     tmp_glyph->width  = orig->width  + 2*kBorder;
     tmp_glyph->height = height;
     tmp_glyph->device_width  = orig->device_width + 2*kBorder;
@@ -142,16 +402,31 @@ Font *Font::CreateOutlineFont() const {
       rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
       tmp_glyph->bitmap[h+kBorder] &= ~orig_bitmap;
     }
-    r->glyphs_[it->first] = tmp_glyph;
+    r->SetGlyph(codepoints[i], offset);
   }
+  r->UseOwnStorage();
   return r;
 }
 
 const Font::Glyph *Font::FindGlyph(uint32_t unicode_codepoint) const {
-  CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
-  if (found == glyphs_.end())
+  uint32_t offset = kNoGlyph;
+  if (unicode_codepoint < kBMPEnd) {
+    const uint32_t page = bmp_pages_data_[unicode_codepoint >> kPageBits];
+    if (page == kNoGlyph)
+      return NULL;
+    offset = bmp_glyphs_data_[page * kPageSize
+                              + (unicode_codepoint & (kPageSize - 1))];
+  } else {
+    const CodepointGlyph key = { unicode_codepoint, 0 };
+    const CodepointGlyph *end = other_glyphs_data_ + other_glyphs_count_;
+    const CodepointGlyph *found
+      = std::lower_bound(other_glyphs_data_, end, key, CompareCodepoint);
+    if (found != end && found->codepoint == unicode_codepoint)
+      offset = found->offset;
+  }
+  if (offset == kNoGlyph)
     return NULL;
-  return found->second;
+  return reinterpret_cast<const Glyph*>(arena_data_ + offset);
 }
 
 int Font::CharacterWidth(uint32_t unicode_codepoint) const {
@@ -159,6 +434,12 @@ int Font::CharacterWidth(uint32_t unicode_codepoint) const {
   return g ? g->width : -1;
 }
 
+int Font::CharacterAdvance(uint32_t unicode_codepoint) const {
+  const Glyph *g = FindGlyph(unicode_codepoint);
+  if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
+  return g ? g->device_width : 0;
+}
+
 int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
                     const Color &color, const Color *bgcolor,
                     uint32_t unicode_codepoint) const {
@@ -166,6 +447,26 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
   if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
   if (g == NULL) return 0;
   y_pos = y_pos - g->height - g->y_offset;
+
+  // Canvases backed by a framebuffer can take the whole glyph at once.
+  const uint8_t fg[3] = { color.r, color.g, color.b };
+  const uint8_t *bg = NULL;
+  uint8_t bg_rgb[3];
+  if (bgcolor) {
+    bg_rgb[0] = bgcolor->r; bg_rgb[1] = bgcolor->g; bg_rgb[2] = bgcolor->b;
+    bg = bg_rgb;
+  }
+  if (FrameCanvas *fc = dynamic_cast<FrameCanvas*>(c)) {
+    fc->SetPixelsBitmap(x_pos, y_pos, g->device_width, g->height,
+                        g->bitmap, fg, bg);
+    return g->device_width;
+  }
+  if (WideCanvas *wc = dynamic_cast<WideCanvas*>(c)) {
+    wc->SetPixelsBitmap(x_pos, y_pos, g->device_width, g->height,
+                        g->bitmap, fg, bg);
+    return g->device_width;
+  }
+
   for (int y = 0; y < g->height; ++y) {
     const rowbitmap_t row = g->bitmap[y];
     rowbitmap_t x_mask = (1LL<<63);
@@ -0,0 +1,305 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "compositor.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+
+Compositor::Layer::Layer(Compositor *compositor, int z, int x, int y,
+                         int width, int height)
+  : compositor_(compositor), width_(width), height_(height),
+    x_(x), y_(y), z_(z), serial_(0), opacity_(255), has_transparent_(false),
+    pixels_(3 * width * height, 0),
+    dirty_x0_(width), dirty_y0_(height), dirty_x1_(0), dirty_y1_(0) {
+  transparent_[0] = transparent_[1] = transparent_[2] = 0;
+}
+
+void Compositor::Layer::SetPosition(int x, int y) {
+  if (x == x_ && y == y_) return;
+  compositor_->AddLayerDamage(this);
+  x_ = x;
+  y_ = y;
+  compositor_->AddLayerDamage(this);
+}
+
+void Compositor::Layer::SetZ(int z) {
+  if (z == z_) return;
+  z_ = z;
+  compositor_->order_changed_ = true;
+  compositor_->AddLayerDamage(this);
+}
+
+void Compositor::Layer::SetOpacity(uint8_t opacity) {
+  if (opacity == opacity_) return;
+  opacity_ = opacity;
+  compositor_->AddLayerDamage(this);
+}
+
+void Compositor::Layer::SetTransparentColor(uint8_t red, uint8_t green,
+                                            uint8_t blue) {
+  if (has_transparent_ && red == transparent_[0]
+      && green == transparent_[1] && blue == transparent_[2])
+    return;
+  has_transparent_ = true;
+  transparent_[0] = red;
+  transparent_[1] = green;
+  transparent_[2] = blue;
+  compositor_->AddLayerDamage(this);
+}
+
+void Compositor::Layer::ClearTransparentColor() {
+  if (!has_transparent_) return;
+  has_transparent_ = false;
+  compositor_->AddLayerDamage(this);
+}
+
+void Compositor::Layer::SetPixel(int x, int y,
+                                 uint8_t red, uint8_t green, uint8_t blue) {
+  if (x < 0 || y < 0 || x >= width_ || y >= height_) return;
+  uint8_t *p = &pixels_[3 * (y * width_ + x)];
+  if (p[0] == red && p[1] == green && p[2] == blue) return;
+  p[0] = red;
+  p[1] = green;
+  p[2] = blue;
+  Touch(x, y, x + 1, y + 1);
+}
+
+void Compositor::Layer::SetPixels(int x, int y, int width, int height,
+                                  const uint8_t *rgb) {
+  const int x0 = std::max(x, 0), x1 = std::min(x + width, width_);
+  const int y0 = std::max(y, 0), y1 = std::min(y + height, height_);
+  for (int row = y0; row < y1; ++row) {
+    const uint8_t *src = rgb + 3 * ((row - y) * width + (x0 - x));
+    uint8_t *dst = &pixels_[3 * (row * width_ + x0)];
+    const int bytes = 3 * (x1 - x0);
+    if (bytes <= 0 || memcmp(dst, src, bytes) == 0) continue;
+    memcpy(dst, src, bytes);
+    Touch(x0, row, x1, row + 1);
+  }
+}
+
+void Compositor::Layer::Clear() {
+  Fill(transparent_[0], transparent_[1], transparent_[2]);
+}
+
+void Compositor::Layer::Fill(uint8_t red, uint8_t green, uint8_t blue) {
+  // Only mark what actually changes, so refilling an unchanged layer is free.
+  for (int y = 0; y < height_; ++y) {
+    uint8_t *p = &pixels_[3 * y * width_];
+    int first = width_, last = -1;
+    for (int x = 0; x < width_; ++x, p += 3) {
+      if (p[0] == red && p[1] == green && p[2] == blue) continue;
+      p[0] = red;
+      p[1] = green;
+      p[2] = blue;
+      if (first == width_) first = x;
+      last = x;
+    }
+    if (last >= 0) Touch(first, y, last + 1, y + 1);
+  }
+}
+
+Compositor::Compositor(int width, int height)
+  : width_(width), height_(height), order_changed_(false), next_serial_(0),
+    frame_(0), previous_(NULL) {
+}
+
+Compositor::~Compositor() {
+  for (size_t i = 0; i < layers_.size(); ++i)
+    delete layers_[i];
+}
+
+Compositor::Layer *Compositor::AddLayer(int z, int x, int y,
+                                        int width, int height) {
+  Layer *layer = new Layer(this, z, x, y,
+                           std::max(width, 0), std::max(height, 0));
+  layer->serial_ = next_serial_++;
+  layers_.push_back(layer);
+  order_changed_ = true;
+  AddLayerDamage(layer);
+  return layer;
+}
+
+void Compositor::RemoveLayer(Layer *layer) {
+  std::vector<Layer*>::iterator it = std::find(layers_.begin(), layers_.end(),
+                                               layer);
+  if (it == layers_.end()) return;
+  AddLayerDamage(layer);
+  layers_.erase(it);
+  delete layer;
+}
+
+bool Compositor::LayerBefore(const Layer *a, const Layer *b) {
+  return a->z_ < b->z_ || (a->z_ == b->z_ && a->serial_ < b->serial_);
+}
+
+static bool Overlap(const Compositor::Rect &a, const Compositor::Rect &b) {
+  return a.x < b.x + b.width && b.x < a.x + a.width
+    && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+static bool Contains(const Compositor::Rect &outer,
+                     const Compositor::Rect &inner) {
+  return inner.x >= outer.x && inner.y >= outer.y
+    && inner.x + inner.width <= outer.x + outer.width
+    && inner.y + inner.height <= outer.y + outer.height;
+}
+
+static Compositor::Rect Union(const Compositor::Rect &a,
+                              const Compositor::Rect &b) {
+  const int x0 = std::min(a.x, b.x), y0 = std::min(a.y, b.y);
+  const int x1 = std::max(a.x + a.width, b.x + b.width);
+  const int y1 = std::max(a.y + a.height, b.y + b.height);
+  Compositor::Rect result = { x0, y0, x1 - x0, y1 - y0 };
+  return result;
+}
+
+void Compositor::AddDamage(int x, int y, int width, int height) {
+  const int x0 = std::max(x, 0), x1 = std::min(x + width, width_);
+  const int y0 = std::max(y, 0), y1 = std::min(y + height, height_);
+  if (x0 >= x1 || y0 >= y1) return;
+  Rect r = { x0, y0, x1 - x0, y1 - y0 };
+  // Overlapping rects are merged, so no pixel is composited twice.
+  for (size_t i = 0; i < damage_.size(); /**/) {
+    if (Overlap(r, damage_[i])) {
+      r = Union(r, damage_[i]);
+      damage_.erase(damage_.begin() + i);
+      i = 0;
+    } else {
+      ++i;
+    }
+  }
+  damage_.push_back(r);
+  if ((int)damage_.size() > kMaxRects) {
+    for (size_t i = 1; i < damage_.size(); ++i)
+      damage_[0] = Union(damage_[0], damage_[i]);
+    damage_.resize(1);
+  }
+}
+
+void Compositor::AddLayerDamage(const Layer *layer) {
+  AddDamage(layer->x_, layer->y_, layer->width_, layer->height_);
+}
+
+void Compositor::CollectDamage() {
+  for (size_t i = 0; i < layers_.size(); ++i) {
+    Layer *layer = layers_[i];
+    if (layer->dirty_x0_ >= layer->dirty_x1_) continue;
+    if (layer->opacity_ > 0) {
+      AddDamage(layer->x_ + layer->dirty_x0_, layer->y_ + layer->dirty_y0_,
+                layer->dirty_x1_ - layer->dirty_x0_,
+                layer->dirty_y1_ - layer->dirty_y0_);
+    }
+    layer->dirty_x0_ = layer->width_;
+    layer->dirty_y0_ = layer->height_;
+    layer->dirty_x1_ = layer->dirty_y1_ = 0;
+  }
+}
+
+void Compositor::CompositeRect(const Rect &r, FrameCanvas *canvas) {
+  scratch_.assign(3 * r.width * r.height, 0);
+
+  // Everything below an opaque layer covering the whole rect is hidden.
+  size_t bottom = 0;
+  for (size_t i = layers_.size(); i > 0; --i) {
+    const Layer *layer = layers_[i - 1];
+    const Rect area = { layer->x_, layer->y_, layer->width_, layer->height_ };
+    if (layer->opacity_ == 255 && !layer->has_transparent_
+        && Contains(area, r)) {
+      bottom = i - 1;
+      break;
+    }
+  }
+
+  for (size_t i = bottom; i < layers_.size(); ++i) {
+    const Layer *layer = layers_[i];
+    const int alpha = layer->opacity_;
+    if (alpha == 0) continue;
+    const int x0 = std::max(r.x, layer->x_);
+    const int x1 = std::min(r.x + r.width, layer->x_ + layer->width_);
+    const int y0 = std::max(r.y, layer->y_);
+    const int y1 = std::min(r.y + r.height, layer->y_ + layer->height_);
+    if (x0 >= x1) continue;
+    for (int y = y0; y < y1; ++y) {
+      const uint8_t *src = &layer->pixels_[3 * ((y - layer->y_) * layer->width_
+                                                + (x0 - layer->x_))];
+      uint8_t *dst = &scratch_[3 * ((y - r.y) * r.width + (x0 - r.x))];
+      if (alpha == 255 && !layer->has_transparent_) {
+        memcpy(dst, src, 3 * (x1 - x0));
+        continue;
+      }
+      for (int x = x0; x < x1; ++x, src += 3, dst += 3) {
+        if (layer->IsTransparent(src)) continue;
+        if (alpha == 255) {
+          dst[0] = src[0];
+          dst[1] = src[1];
+          dst[2] = src[2];
+        } else {
+          for (int c = 0; c < 3; ++c)
+            dst[c] = (src[c] * alpha + dst[c] * (255 - alpha) + 127) / 255;
+        }
+      }
+    }
+  }
+  canvas->SetPixels(r.x, r.y, r.width, r.height, &scratch_[0]);
+}
+
+void Compositor::Compose(FrameCanvas *canvas) {
+  if (order_changed_) {
+    std::sort(layers_.begin(), layers_.end(), &Compositor::LayerBefore);
+    order_changed_ = false;
+  }
+  CollectDamage();
+  ++frame_;
+
+  KnownCanvas *known = NULL;
+  for (size_t i = 0; i < known_.size(); ++i) {
+    if (known_[i].canvas == canvas) known = &known_[i];
+  }
+
+  // Bring the canvas to the state of the previous frame: either it is the
+  // previous canvas anyway, or copy what changed since it was last composed.
+  // Copying bitplanes is much cheaper than compositing the layers again.
+  if (previous_ == NULL) {
+    AddDamage(0, 0, width_, height_);
+  } else if (canvas != previous_) {
+    const int missing = (known == NULL)
+      ? kDamageHistory : frame_ - 1 - known->frame;
+    if (missing >= kDamageHistory) {
+      canvas->CopyFrom(*previous_);
+    } else {
+      for (int f = frame_ - missing; f < frame_; ++f) {
+        const std::vector<Rect> &rects = history_[f % kDamageHistory];
+        for (size_t i = 0; i < rects.size(); ++i) {
+          const Rect &r = rects[i];
+          bool covered = false;
+          for (size_t j = 0; j < damage_.size() && !covered; ++j)
+            covered = Contains(damage_[j], r);
+          if (covered) continue;
+          canvas->CopyRect(*previous_, r.x, r.y, r.x, r.y, r.width, r.height);
+        }
+      }
+    }
+  }
+
+  for (size_t i = 0; i < damage_.size(); ++i)
+    CompositeRect(damage_[i], canvas);
+
+  history_[frame_ % kDamageHistory] = damage_;
+  last_damage_.swap(damage_);
+  damage_.clear();
+  if (known == NULL) {
+    KnownCanvas k = { canvas, frame_ };
+    known_.push_back(k);
+  } else {
+    known->frame = frame_;
+  }
+  previous_ = canvas;
+}
+
+}  // namespace rgb_matrix
@@ -2,12 +2,18 @@
 
 #include "content-streamer.h"
 #include "led-matrix.h"
+#include "thread.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -20,13 +26,16 @@ namespace {
 // the Raspberry Pi, but also x86; so it is possible to create streams easily
 // on a different x86 Linux PC.
 static const uint32_t kFileMagicValue = 0xED0C5A48;
+static const uint32_t kRGBFileMagicValue = 0xED0C5A52;
 struct FileHeader {
-  uint32_t magic;  // kFileMagicValue
+  uint32_t magic;  // kFileMagicValue or kRGBFileMagicValue
   uint32_t buf_size;
   uint32_t width;
   uint32_t height;
-  uint64_t future_use1;
-  uint64_t future_use2;
+  // Set in conversion caches written by OpenStreamFile(): the source file
+  // they were converted from, to tell if they are stale. 0 otherwise.
+  uint64_t source_size;
+  uint64_t source_mtime_ns;
 };
 
 static const uint32_t kFrameMagicValue = 0x12345678;
@@ -34,16 +43,29 @@ struct FrameHeader {
   uint32_t magic;  // kFrameMagic
   uint32_t size;
   uint32_t hold_time_us;  // How long this frame lasts in usec.
-  uint32_t future_use1;
-  uint64_t future_use2;
+  uint32_t type;          // One of FrameType. Was unused, so old streams: 0
+  uint64_t reference;     // kFrameRepeat: number of the frame repeated.
   uint64_t future_use3;
 };
+
+enum FrameType {
+  kFrameRaw     = 0,  // Serialized FrameCanvas.
+  kFrameRGB     = 1,  // width * height * 3 bytes RGB.
+  kFramePalette = 2,  // uint32_t count, count * 3 bytes RGB, 1 byte per pixel
+  kFrameRepeat  = 3,  // No payload; same content as frame number 'reference'
+  kFrameDelta   = 4,  // Changed byte spans relative to frame 'reference', the
+                      // previous frame. See EncodeDelta().
+};
 }
 
-FileStreamIO::FileStreamIO(int fd) : fd_(fd) {}
+FileStreamIO::FileStreamIO(int fd) : fd_(fd), seekable_(false) {
+  struct stat sb;
+  if (fstat(fd, &sb) == 0)
+    seekable_ = S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode);
+}
 FileStreamIO::~FileStreamIO() { close(fd_); }
 
-void FileStreamIO::Rewind() { lseek(fd_, 0, SEEK_SET); }
+void FileStreamIO::Rewind() { if (seekable_) lseek(fd_, 0, SEEK_SET); }
 
 ssize_t FileStreamIO::Read(void *buf, const size_t count) {
   return read(fd_, buf, count);
@@ -53,6 +75,179 @@ ssize_t FileStreamIO::Append(const void *buf, const size_t count) {
   return write(fd_, buf, count);
 }
 
+ssize_t FileStreamIO::ReadAt(void *buf, size_t count, int64_t offset) {
+  if (!seekable_) return -1;
+  return pread(fd_, buf, count, offset);
+}
+
+// Write all of "iov", resuming after short writes.
+static bool FullWriteV(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t w = writev(fd, iov, iovcnt);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0) return false;
+    while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      ++iov; --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return true;
+}
+
+// Writes full buffers handed over by the BufferedFileStreamIO to its file
+// while the other buffer is being filled.
+class BufferedFileStreamIO::FlushThread : public Thread {
+public:
+  FlushThread(const BufferedFileStreamIO *io, size_t buffer_size)
+    : io_(io), running_(true), write_ok_(true),
+      pending_(NULL), pending_len_(0), spare_(new char [ buffer_size ]) {
+    pthread_cond_init(&cond_, NULL);
+  }
+  virtual ~FlushThread() {
+    {
+      MutexLock l(&mutex_);
+      running_ = false;
+      pthread_cond_broadcast(&cond_);
+    }
+    WaitStopped();  // Finishes the pending buffer first.
+    pthread_cond_destroy(&cond_);
+    delete [] spare_;
+  }
+
+  // Hand over "buffer" with "len" bytes to be written. Returns a free buffer
+  // to continue with. Blocks while the previously handed over buffer is
+  // still being written.
+  char *Submit(char *buffer, size_t len) {
+    MutexLock l(&mutex_);
+    while (pending_ != NULL) mutex_.WaitOn(&cond_);
+    char *const result = spare_;
+    spare_ = NULL;
+    pending_ = buffer;
+    pending_len_ = len;
+    pthread_cond_broadcast(&cond_);
+    return result;
+  }
+
+  // Wait until everything handed over is written. Returns false if any
+  // write failed.
+  bool WaitIdle() {
+    MutexLock l(&mutex_);
+    while (pending_ != NULL) mutex_.WaitOn(&cond_);
+    return write_ok_;
+  }
+
+  virtual void Run() {
+    MutexLock l(&mutex_);
+    for (;;) {
+      while (running_ && pending_ == NULL) mutex_.WaitOn(&cond_);
+      if (pending_ == NULL) break;  // Not running anymore and all written.
+      char *const buffer = pending_;
+      struct iovec iov = { buffer, pending_len_ };
+      mutex_.Unlock();
+      const bool success = FullWriteV(io_->fd_, &iov, 1);
+      mutex_.Lock();
+      write_ok_ &= success;
+      spare_ = buffer;
+      pending_ = NULL;
+      pthread_cond_broadcast(&cond_);
+    }
+  }
+
+private:
+  const BufferedFileStreamIO *const io_;
+  Mutex mutex_;
+  pthread_cond_t cond_;
+  bool running_;
+  bool write_ok_;
+  char *pending_;       // Buffer being written, NULL if idle.
+  size_t pending_len_;
+  char *spare_;         // Free buffer, NULL while handed out.
+};
+
+BufferedFileStreamIO::BufferedFileStreamIO(int fd, size_t buffer_size,
+                                           bool background_flush)
+  : FileStreamIO(fd), buffer_size_(buffer_size),
+    sync_on_flush_(false), buffer_(new char [ buffer_size ]), fill_(0),
+    flusher_(NULL), write_ok_(true) {
+  if (background_flush) {
+    flusher_ = new FlushThread(this, buffer_size);
+    flusher_->Start();
+  }
+}
+
+BufferedFileStreamIO::~BufferedFileStreamIO() {
+  Flush();
+  delete flusher_;
+  delete [] buffer_;
+}
+
+bool BufferedFileStreamIO::Flush() {
+  if (flusher_) {
+    if (fill_ > 0) buffer_ = flusher_->Submit(buffer_, fill_);
+    write_ok_ &= flusher_->WaitIdle();
+  } else if (fill_ > 0) {
+    struct iovec iov = { buffer_, fill_ };
+    write_ok_ &= FullWriteV(fd_, &iov, 1);
+  }
+  fill_ = 0;
+  if (sync_on_flush_ && fsync(fd_) != 0) write_ok_ = false;
+  return write_ok_;
+}
+
+// Write what is in the buffer plus "count" bytes from "buf" in one go.
+bool BufferedFileStreamIO::WriteWithBuffer(const void *buf, size_t count) {
+  struct iovec iov[2] = { { buffer_, fill_ }, { (void*)buf, count } };
+  fill_ = 0;
+  return FullWriteV(fd_, iov, 2);
+}
+
+ssize_t BufferedFileStreamIO::Append(const void *buf, size_t count) {
+  if (!write_ok_) return -1;
+  if (fill_ + count <= buffer_size_) {
+    memcpy(buffer_ + fill_, buf, count);
+    fill_ += count;
+    return count;
+  }
+  if (!flusher_) {
+    write_ok_ = WriteWithBuffer(buf, count);
+    return write_ok_ ? (ssize_t)count : -1;
+  }
+  // Background: we have to copy, as the caller might reuse "buf".
+  const char *data = (const char*) buf;
+  size_t remaining = count;
+  while (remaining > 0) {
+    const size_t chunk = std::min(remaining, buffer_size_ - fill_);
+    memcpy(buffer_ + fill_, data, chunk);
+    fill_ += chunk; data += chunk; remaining -= chunk;
+    if (fill_ == buffer_size_) {
+      buffer_ = flusher_->Submit(buffer_, fill_);
+      fill_ = 0;
+    }
+  }
+  return count;
+}
+
+// Reading or seeking needs to see everything written so far.
+void BufferedFileStreamIO::Rewind() {
+  Flush();
+  FileStreamIO::Rewind();
+}
+
+ssize_t BufferedFileStreamIO::Read(void *buf, size_t count) {
+  Flush();
+  return FileStreamIO::Read(buf, count);
+}
+
+ssize_t BufferedFileStreamIO::ReadAt(void *buf, size_t count,
+                                     int64_t offset) {
+  Flush();
+  return FileStreamIO::ReadAt(buf, count, offset);
+}
+
 void MemStreamIO::Rewind() { pos_ = 0; }
 ssize_t MemStreamIO::Read(void *buf, size_t count) {
   const size_t amount = std::min(count, buffer_.size() - pos_);
@@ -64,12 +259,39 @@ ssize_t MemStreamIO::Append(const void *buf, size_t count) {
   buffer_.append((const char*)buf, count);
   return count;
 }
+ssize_t MemStreamIO::ReadAt(void *buf, size_t count, int64_t offset) {
+  if (offset < 0 || (size_t)offset > buffer_.size()) return -1;
+  const size_t amount = std::min(count, buffer_.size() - (size_t)offset);
+  memcpy(buf, buffer_.data() + offset, amount);
+  return amount;
+}
+
+void MappedStreamIO::Rewind() { pos_ = 0; }
+ssize_t MappedStreamIO::Read(void *buf, size_t count) {
+  const size_t amount = std::min(count, size_ - pos_);
+  memcpy(buf, data_ + pos_, amount);
+  pos_ += amount;
+  return amount;
+}
+ssize_t MappedStreamIO::Append(const void *buf, size_t count) {
+  errno = EBADF;
+  return -1;
+}
+ssize_t MappedStreamIO::ReadAt(void *buf, size_t count, int64_t offset) {
+  if (offset < 0 || (size_t)offset > size_) return -1;
+  const size_t amount = std::min(count, size_ - (size_t)offset);
+  memcpy(buf, data_ + offset, amount);
+  return amount;
+}
 
+// Pipes and sockets return short reads whenever the other side is slower
+// than us, so we keep reading until we have everything or reach the end.
 static ssize_t FullRead(StreamIO *io, void *buf, const size_t count) {
-  int remaining = count;
+  size_t remaining = count;
   char *char_buffer = (char*)buf;
   while (remaining > 0) {
-    int r = io->Read(char_buffer, remaining);
+    ssize_t r = io->Read(char_buffer, remaining);
+    if (r < 0 && errno == EINTR) continue;
     if (r < 0) return r;
     if (r == 0) break;  // EOF.
     char_buffer += r; remaining -= r;
@@ -77,18 +299,113 @@ static ssize_t FullRead(StreamIO *io, void *buf, const size_t count) {
   return count - remaining;
 }
 
+static ssize_t FullReadAt(StreamIO *io, void *buf, const size_t count,
+                          int64_t offset) {
+  size_t remaining = count;
+  char *char_buffer = (char*)buf;
+  while (remaining > 0) {
+    ssize_t r = io->ReadAt(char_buffer, remaining, offset);
+    if (r < 0) return r;
+    if (r == 0) break;  // EOF.
+    char_buffer += r; remaining -= r; offset += r;
+  }
+  return count - remaining;
+}
+
 static ssize_t FullAppend(StreamIO *io, const void *buf, const size_t count) {
-  int remaining = count;
+  size_t remaining = count;
   const char *char_buffer = (const char*) buf;
   while (remaining > 0) {
-    int w = io->Append(char_buffer, remaining);
+    ssize_t w = io->Append(char_buffer, remaining);
+    if (w < 0 && errno == EINTR) continue;
     if (w < 0) return w;
     char_buffer += w; remaining -= w;
   }
   return count;
 }
 
-StreamWriter::StreamWriter(StreamIO *io) : io_(io), header_written_(false) {}
+// Returns true if the "len" bytes at "offset" in the stream equal "data".
+static bool SameAsWritten(StreamIO *io, int64_t offset,
+                          const char *data, size_t len) {
+  char buffer[4096];
+  while (len > 0) {
+    const size_t chunk = std::min(len, sizeof(buffer));
+    if (FullReadAt(io, buffer, chunk, offset) != (ssize_t)chunk
+        || memcmp(buffer, data, chunk) != 0)
+      return false;
+    data += chunk; len -= chunk; offset += chunk;
+  }
+  return true;
+}
+
+static void WriteFileHeader(StreamIO *io, uint32_t magic,
+                            int width, int height, size_t len) {
+  FileHeader header = {};
+  header.magic = magic;
+  header.width = width;
+  header.height = height;
+  header.buf_size = len;
+  FullAppend(io, &header, sizeof(header));
+}
+
+// 64 bit content hash to find candidates for repeated frames. Different
+// frames can have the same hash, so matches are compared byte by byte.
+static uint64_t HashFrame(const char *data, size_t len) {
+  uint64_t hash = len;
+  uint64_t word;
+  for (/**/; len >= sizeof(word); len -= sizeof(word), data += sizeof(word)) {
+    memcpy(&word, data, sizeof(word));
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 32;
+  }
+  for (/**/; len > 0; --len, ++data) {
+    hash = (hash ^ (uint8_t)*data) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+// Encode the differences of "current" to "previous" (both "len" bytes) as
+// delta payload into "out": uint32_t count, then "count" times uint32_t
+// offset, uint32_t length, followed by the changed bytes. Returns false if
+// that is not worthwhile, because more than half of the frame changed.
+static bool EncodeDelta(const char *previous, const char *current, size_t len,
+                        std::string *out) {
+  // Every span costs 8 bytes, so we merge spans with small gaps in between.
+  static const size_t kMergeGapWords = 2;
+  typedef uint32_t word_t;  // Comparing words, as a bitplane entry is one.
+  if (len % sizeof(word_t) != 0) return false;
+  const size_t words = len / sizeof(word_t);
+  const size_t limit = len / 2;
+  uint32_t span_count = 0;
+  out->assign((const char*)&span_count, sizeof(span_count));
+  word_t a, b;
+  for (size_t i = 0; i < words; /**/) {
+    memcpy(&a, previous + i * sizeof(word_t), sizeof(word_t));
+    memcpy(&b, current + i * sizeof(word_t), sizeof(word_t));
+    if (a == b) { ++i; continue; }
+    size_t end = i + 1;   // One past the last differing word.
+    for (size_t j = end; j < words && j - end < kMergeGapWords; ++j) {
+      memcpy(&a, previous + j * sizeof(word_t), sizeof(word_t));
+      memcpy(&b, current + j * sizeof(word_t), sizeof(word_t));
+      if (a != b) end = j + 1;
+    }
+    const uint32_t span[2] = { (uint32_t)(i * sizeof(word_t)),
+                               (uint32_t)((end - i) * sizeof(word_t)) };
+    out->append((const char*)span, sizeof(span));
+    out->append(current + span[0], span[1]);
+    if (out->size() > limit) return false;
+    ++span_count;
+    i = end;
+  }
+  memcpy(&(*out)[0], &span_count, sizeof(span_count));
+  return true;
+}
+
+StreamWriter::StreamWriter(StreamIO *io, bool delta_frames, bool deduplicate)
+  : io_(io), header_written_(false),
+    deduplicate_(deduplicate && io->IsSeekable()),
+    delta_frames_(delta_frames), frame_count_(0), write_offset_(0),
+    saved_bytes_(0) {}
 bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   const char *data;
   size_t len;
@@ -99,38 +416,166 @@ bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   }
   FrameHeader h = {};
   h.magic = kFrameMagicValue;
-  h.size = len;
   h.hold_time_us = hold_time_us;
+  const uint32_t frame_number = frame_count_++;
+
+  const char *payload = data;
+  uint64_t hash = 0;
+  bool is_repeat = false;
+  if (deduplicate_) {
+    hash = HashFrame(data, len);
+    std::map<uint64_t, WrittenFrame>::const_iterator found
+      = written_frames_.find(hash);
+    if (found != written_frames_.end()
+        && SameAsWritten(io_, found->second.payload_offset, data, len)) {
+      is_repeat = true;
+      h.reference = found->second.frame_number;
+    }
+  }
+  if (is_repeat) {
+    h.type = kFrameRepeat;
+    h.size = 0;
+  } else if (delta_frames_ && frame_number > 0
+             && EncodeDelta(previous_frame_.data(), data, len, &delta_)) {
+    // Delta frames are not registered for deduplication: repeats always
+    // refer to frames that can be read by themselves.
+    h.type = kFrameDelta;
+    h.size = delta_.size();
+    h.reference = frame_number - 1;
+    payload = delta_.data();
+  } else {
+    if (deduplicate_ && written_frames_.find(hash) == written_frames_.end()) {
+      const WrittenFrame written = { frame_number,
+                                     write_offset_ + (int64_t)sizeof(h) };
+      written_frames_[hash] = written;
+    }
+    h.type = kFrameRaw;
+    h.size = len;
+  }
+  if (delta_frames_) previous_frame_.assign(data, len);
+  saved_bytes_ += len - h.size;
+
+  write_offset_ += sizeof(h) + h.size;
   FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  return FullAppend(io_, payload, h.size) == (ssize_t)h.size;
 }
 
 void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
-  FileHeader header = {};
-  header.magic = kFileMagicValue;
-  header.width = frame.width();
-  header.height = frame.height();
-  header.buf_size = len;
-  FullAppend(io_, &header, sizeof(header));
+  rgb_matrix::WriteFileHeader(io_, kFileMagicValue,
+                              frame.width(), frame.height(), len);
+  write_offset_ += sizeof(FileHeader);
   header_written_ = true;
 }
 
+RGBStreamWriter::RGBStreamWriter(StreamIO *io, int width, int height)
+  : io_(io), width_(width), height_(height), header_written_(false),
+    palette_buffer_(new uint8_t[4 + 3 * 256 + width * height]) {}
+
+RGBStreamWriter::~RGBStreamWriter() { delete [] palette_buffer_; }
+
+// Attempt to palettize the "rgb" image with "pixels" into "out". Returns
+// the number of bytes used or 0 if there are more than 256 colors.
+static size_t Palettize(const uint8_t *rgb, int pixels, uint8_t *out) {
+  // Small open-addressing hash-table color -> index.
+  static const int kSlots = 1024;  // Power of two, sufficiently > 256
+  static const uint32_t kEmpty = 0xffffffff;
+  uint32_t slot_color[kSlots];
+  uint8_t slot_index[kSlots];
+  for (int i = 0; i < kSlots; ++i) slot_color[i] = kEmpty;
+
+  uint8_t *const palette = out + sizeof(uint32_t);
+  uint8_t *index = palette + 3 * 256;
+  uint32_t colors = 0;
+  for (int i = 0; i < pixels; ++i, rgb += 3) {
+    const uint32_t color = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+    int slot = (color * 2654435761u) >> 22;  // top 10 bits: kSlots
+    while (slot_color[slot] != kEmpty && slot_color[slot] != color)
+      slot = (slot + 1) & (kSlots - 1);
+    if (slot_color[slot] == kEmpty) {
+      if (colors == 256) return 0;
+      slot_color[slot] = color;
+      slot_index[slot] = colors;
+      memcpy(palette + 3 * colors, rgb, 3);
+      ++colors;
+    }
+    *index++ = slot_index[slot];
+  }
+  memcpy(out, &colors, sizeof(colors));
+  // Move indices right after the used palette entries.
+  memmove(palette + 3 * colors, palette + 3 * 256, pixels);
+  return sizeof(colors) + 3 * colors + pixels;
+}
+
+bool RGBStreamWriter::Stream(const uint8_t *rgb, uint32_t hold_time_us) {
+  const size_t rgb_len = 3 * width_ * height_;
+  if (!header_written_) {
+    WriteFileHeader(io_, kRGBFileMagicValue, width_, height_, rgb_len);
+    header_written_ = true;
+  }
+  const uint8_t *data = rgb;
+  FrameHeader h = {};
+  h.magic = kFrameMagicValue;
+  h.type = kFrameRGB;
+  h.size = rgb_len;
+  h.hold_time_us = hold_time_us;
+  const size_t palette_len = Palettize(rgb, width_ * height_, palette_buffer_);
+  if (palette_len > 0 && palette_len < rgb_len) {
+    data = palette_buffer_;
+    h.type = kFramePalette;
+    h.size = palette_len;
+  }
+  FullAppend(io_, &h, sizeof(h));
+  return FullAppend(io_, data, h.size) == (ssize_t)h.size;
+}
+
 StreamReader::StreamReader(StreamIO *io)
-  : io_(io), state_(STREAM_AT_BEGIN), buffer_(NULL) {
-  io_->Rewind();
+  : io_(io), state_(STREAM_AT_BEGIN), read_offset_(0), frame_count_(0),
+    is_rgb_stream_(false),
+    buffer_(NULL), row_buffer_(NULL), delta_buffer_(NULL) {
+  if (io_->IsSeekable()) io_->Rewind();
+}
+StreamReader::~StreamReader() {
+  delete [] buffer_;
+  delete [] row_buffer_;
+  delete [] delta_buffer_;
 }
-StreamReader::~StreamReader() { delete [] buffer_; }
 
 void StreamReader::Rewind() {
+  if (!io_->IsSeekable()) return;  // Forward only; header is already read.
   io_->Rewind();
   state_ = STREAM_AT_BEGIN;
+  read_offset_ = 0;
+  frame_count_ = 0;
+  frame_offsets_.clear();
+}
+
+ssize_t StreamReader::ReadBytes(void *buf, size_t count) {
+  const ssize_t r = FullRead(io_, buf, count);
+  if (r > 0) read_offset_ += r;
+  return r;
+}
+
+// Read over "count" bytes we're not interested in. We can't seek in pipes.
+bool StreamReader::SkipBytes(size_t count) {
+  char discard[4096];
+  while (count > 0) {
+    const size_t chunk = std::min(count, sizeof(discard));
+    if (ReadBytes(discard, chunk) != (ssize_t)chunk) return false;
+    count -= chunk;
+  }
+  return true;
 }
 
 bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
   if (state_ == STREAM_AT_BEGIN && !ReadFileHeader(*frame)) return false;
   if (state_ != STREAM_READING) return false;
+  const int64_t record_offset = read_offset_;
   FrameHeader h;
-  if (FullRead(io_, &h, sizeof(h)) != sizeof(h)) return false;
+  const ssize_t header_len = ReadBytes(&h, sizeof(h));
+  if (header_len != sizeof(h)) {
+    state_ = (header_len == 0) ? STREAM_END : STREAM_ERROR;
+    return false;
+  }
 
   // TODO: we might allow for this to be a kFileMagicValue, to allow people
   // to just concatenate streams. In that case, we just would need to read
@@ -139,17 +584,185 @@ bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
     state_ = STREAM_ERROR;
     return false;
   }
-  // In the future, we might allow larger buffers (audio?), but never smaller.
-  if (h.size < buf_size_)
-    return false;
   if (hold_time_us) *hold_time_us = h.hold_time_us;
-  if (FullRead(io_, buffer_, buf_size_) != (ssize_t)buf_size_) return false;
-  return frame->Deserialize(buffer_, buf_size_);
+
+  if (h.type == kFrameRepeat) {
+    // Same content as an earlier frame: read it again from there.
+    if (h.reference >= frame_offsets_.size()) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    const int64_t original_offset = frame_offsets_[h.reference];
+    AddFrame(original_offset);
+    if (FullReadAt(io_, &h, sizeof(h), original_offset) != sizeof(h)
+        || h.magic != kFrameMagicValue || h.type == kFrameRepeat) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    const ssize_t len = ReadPayload(h.size, original_offset + sizeof(h));
+    return len >= 0 && DecodeFrame(h.type, len, frame);
+  }
+
+  if (h.type == kFrameDelta) {
+    // Changes relative to the previous frame, whose content is in buffer_.
+    if (is_rgb_stream_ || frame_count_ == 0
+        || h.reference != frame_count_ - 1) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    AddFrame(record_offset);
+    return ApplyDelta(h.size) && frame->Deserialize(buffer_, buf_size_);
+  }
+
+  AddFrame(record_offset);
+  const ssize_t len = ReadPayload(h.size, -1);
+  return len >= 0 && DecodeFrame(h.type, len, frame);
+}
+
+// Count frame read from "record_offset". The offsets are only needed to
+// resolve repeat records, which is only possible on seekable streams; on
+// others they'd just accumulate.
+void StreamReader::AddFrame(int64_t record_offset) {
+  ++frame_count_;
+  if (io_->IsSeekable()) frame_offsets_.push_back(record_offset);
+}
+
+// Read payload of a frame record into buffer_. If "offset" is given (>= 0),
+// read from that absolute position, otherwise continue reading the stream.
+// Returns number of bytes read or -1 on error.
+ssize_t StreamReader::ReadPayload(size_t size, int64_t offset) {
+  size_t len = size;
+  if (is_rgb_stream_) {
+    if (size > buf_size_) {
+      state_ = STREAM_ERROR;
+      return -1;
+    }
+  } else {
+    // In the future, we might allow larger buffers (audio?), but never smaller.
+    if (size < buf_size_) {
+      state_ = STREAM_ERROR;
+      return -1;
+    }
+    len = buf_size_;
+  }
+  const ssize_t r = (offset < 0)
+    ? ReadBytes(buffer_, len)
+    : FullReadAt(io_, buffer_, len, offset);
+  if (r != (ssize_t)len) {
+    state_ = STREAM_ERROR;  // Truncated frame.
+    return -1;
+  }
+  if (offset < 0 && size > len && !SkipBytes(size - len)) {
+    state_ = STREAM_ERROR;
+    return -1;
+  }
+  return r;
+}
+
+// Read delta payload of "size" bytes and apply it to buffer_.
+bool StreamReader::ApplyDelta(size_t size) {
+  uint32_t span_count;
+  if (size < sizeof(span_count) || size > buf_size_) {
+    state_ = STREAM_ERROR;
+    return false;
+  }
+  if (!delta_buffer_) delta_buffer_ = new char [ buf_size_ ];
+  if (ReadBytes(delta_buffer_, size) != (ssize_t)size) {
+    state_ = STREAM_ERROR;
+    return false;
+  }
+  const char *pos = delta_buffer_;
+  const char *const end = delta_buffer_ + size;
+  memcpy(&span_count, pos, sizeof(span_count));
+  pos += sizeof(span_count);
+  for (uint32_t i = 0; i < span_count; ++i) {
+    uint32_t span[2];  // offset, length
+    if ((size_t)(end - pos) < sizeof(span)) break;
+    memcpy(span, pos, sizeof(span));
+    pos += sizeof(span);
+    if (span[1] > (size_t)(end - pos) || span[0] > buf_size_
+        || span[1] > buf_size_ - span[0])
+      break;
+    memcpy(buffer_ + span[0], pos, span[1]);
+    pos += span[1];
+  }
+  if (pos != end) {
+    state_ = STREAM_ERROR;  // Broken span list.
+    return false;
+  }
+  return true;
+}
+
+bool StreamReader::DecodeFrame(uint32_t type, size_t len,
+                               FrameCanvas *frame) {
+  if (type == kFrameRaw) {
+    return !is_rgb_stream_ && frame->Deserialize(buffer_, len);
+  }
+
+  if (!is_rgb_stream_) {
+    state_ = STREAM_ERROR;
+    return false;
+  }
+  const int x_offset = (frame->width() - rgb_width_) / 2;
+  const int y_offset = (frame->height() - rgb_height_) / 2;
+  if (x_offset > 0 || y_offset > 0) frame->Clear();
+  const size_t pixels = rgb_width_ * rgb_height_;
+  const uint8_t *data = (const uint8_t*) buffer_;
+
+  if (type == kFrameRGB) {
+    if (len != 3 * pixels) return false;
+    frame->SetPixels(x_offset, y_offset, rgb_width_, rgb_height_, data);
+    return true;
+  }
+
+  if (type == kFramePalette) {
+    uint32_t colors;
+    memcpy(&colors, data, sizeof(colors));
+    if (colors > 256 || len != sizeof(colors) + 3 * colors + pixels)
+      return false;
+    const uint8_t *palette = data + sizeof(colors);
+    const uint8_t *index = palette + 3 * colors;
+    for (int y = 0; y < rgb_height_; ++y) {
+      uint8_t *out = row_buffer_;
+      for (int x = 0; x < rgb_width_; ++x, ++index, out += 3) {
+        if (*index < colors) {
+          memcpy(out, palette + 3 * *index, 3);
+        } else {
+          out[0] = out[1] = out[2] = 0;
+        }
+      }
+      frame->SetPixels(x_offset, y_offset + y, rgb_width_, 1, row_buffer_);
+    }
+    return true;
+  }
+
+  state_ = STREAM_ERROR;
+  return false;
 }
 
 bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
   FileHeader header;
-  FullRead(io_, &header, sizeof(header));
+  const ssize_t header_len = ReadBytes(&header, sizeof(header));
+  if (header_len != sizeof(header)) {
+    state_ = (header_len == 0) ? STREAM_END : STREAM_ERROR;
+    return false;
+  }
+  if (header.magic == kRGBFileMagicValue) {
+    // Geometry independent: we can play that on any canvas.
+    if (header.width == 0 || header.height == 0
+        || header.buf_size != 3 * header.width * header.height) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    is_rgb_stream_ = true;
+    rgb_width_ = header.width;
+    rgb_height_ = header.height;
+    state_ = STREAM_READING;
+    buf_size_ = header.buf_size;
+    if (!buffer_) buffer_ = new char [ header.buf_size ];
+    if (!row_buffer_) row_buffer_ = new uint8_t [ 3 * header.width ];
+    return true;
+  }
   if (header.magic != kFileMagicValue) {
     state_ = STREAM_ERROR;
     return false;
@@ -167,4 +780,104 @@ bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
   if (!buffer_) buffer_ = new char [ header.buf_size ];
   return true;
 }
+
+// Connect to Unix domain socket at "path". Returns file descriptor or -1.
+static int ConnectUnixSocket(const char *path) {
+  struct sockaddr_un addr = {};
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+StreamIO *OpenStreamFile(const char *filename, FrameCanvas *scratch) {
+  struct stat sb;
+  if (stat(filename, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+    const int fd = ConnectUnixSocket(filename);
+    return fd < 0 ? NULL : new FileStreamIO(fd);
+  }
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &sb) == 0 && !S_ISREG(sb.st_mode)) {
+    // Pipe or similar. Nothing to cache; the header is still to be read by
+    // the StreamReader, which can decode RGB streams on the fly as well.
+    return new FileStreamIO(fd);
+  }
+  FileHeader header;
+  if (read(fd, &header, sizeof(header)) != sizeof(header)
+      || header.magic != kRGBFileMagicValue) {
+    return new FileStreamIO(fd);  // Raw or unknown; let StreamReader decide.
+  }
+
+  // Geometry independent stream. See if we already converted it before.
+  // Like the font cache, the cache is only valid for a source of the same
+  // size and modification time; a newer timestamp alone proves nothing.
+  struct stat source_stat;
+  fstat(fd, &source_stat);
+  const uint64_t source_mtime_ns
+    = (uint64_t)source_stat.st_mtim.tv_sec * 1000000000
+    + source_stat.st_mtim.tv_nsec;
+  char cache_name[1024];
+  snprintf(cache_name, sizeof(cache_name), "%s.%08x.cache",
+           filename, scratch->ConfigHash());
+  const int existing_fd = open(cache_name, O_RDONLY);
+  if (existing_fd >= 0) {
+    FileHeader cache_header;
+    if (read(existing_fd, &cache_header, sizeof(cache_header))
+        == sizeof(cache_header)
+        && cache_header.magic == kFileMagicValue
+        && cache_header.source_size == (uint64_t)source_stat.st_size
+        && cache_header.source_mtime_ns == source_mtime_ns) {
+      close(fd);
+      lseek(existing_fd, 0, SEEK_SET);
+      return new FileStreamIO(existing_fd);
+    }
+    close(existing_fd);
+  }
+
+  // Convert to the raw format into memory for immediate use and, if we can
+  // write next to the file, into the cache.
+  FileStreamIO source(fd);
+  StreamReader reader(&source);
+  MemStreamIO *result = new MemStreamIO();
+  StreamWriter mem_writer(result);
+  char tmp_name[1024 + 16];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%d", cache_name, getpid());
+  const int cache_fd = open(tmp_name, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+  FileStreamIO *cache_io = cache_fd >= 0 ? new FileStreamIO(cache_fd) : NULL;
+  StreamWriter *cache_writer = cache_io ? new StreamWriter(cache_io) : NULL;
+  uint32_t hold_time_us;
+  bool write_ok = true;
+  while (reader.GetNext(scratch, &hold_time_us)) {
+    mem_writer.Stream(*scratch, hold_time_us);
+    if (cache_writer)
+      write_ok &= cache_writer->Stream(*scratch, hold_time_us);
+  }
+  delete cache_writer;
+  if (cache_io) {
+    // Only now the cache is complete: stamp it with the source it is for.
+    const uint64_t source[2] = { (uint64_t)source_stat.st_size,
+                                 source_mtime_ns };
+    write_ok &= (pwrite(cache_fd, source, sizeof(source),
+                        offsetof(FileHeader, source_size))
+                 == sizeof(source));
+  }
+  delete cache_io;
+  if (cache_fd >= 0) {
+    // A truncated or broken source, e.g. one still being copied, must not
+    // leave a cache behind that would be used from then on.
+    if (write_ok && reader.at_end() && rename(tmp_name, cache_name) == 0) {
+      fprintf(stderr, "Cached converted stream in %s\n", cache_name);
+    } else {
+      unlink(tmp_name);
+    }
+  }
+  return result;
+}
 }  // namespace rgb_matrix
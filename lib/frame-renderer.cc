@@ -0,0 +1,74 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "frame-renderer.h"
+
+#include <time.h>
+
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+static int64_t GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+FrameRenderer::FrameRenderer(RGBMatrix *matrix, int frame_period_ms,
+                             bool keep_content)
+  : matrix_(matrix), frame_period_us_((int64_t)frame_period_ms * 1000),
+    keep_content_(keep_content), running_(false),
+    refresh_interval_us_(0), frame_interval_us_(0), last_render_us_(0) {
+}
+
+FrameRenderer::~FrameRenderer() {
+  Stop();
+  WaitStopped();
+}
+
+void FrameRenderer::Start(int realtime_priority, uint32_t affinity_mask) {
+  __atomic_store_n(&running_, true, __ATOMIC_RELEASE);
+  Thread::Start(realtime_priority, affinity_mask);
+}
+
+void FrameRenderer::Run() {
+  FrameCanvas *offscreen = matrix_->CreateFrameCanvas();
+
+  // Measure one refresh cycle to start with; it is refined with every frame.
+  FrameCanvas *shown = matrix_->SwapOnVSync(NULL);
+  int64_t vsync_us = GetMonotonicMicros();
+  matrix_->SwapOnVSync(NULL);
+  int64_t now_us = GetMonotonicMicros();
+  refresh_interval_us_ = now_us - vsync_us;
+  if (refresh_interval_us_ < 1) refresh_interval_us_ = 1;
+  vsync_us = now_us;
+
+  while (running()) {
+    int64_t cycles = 1;
+    if (frame_period_us_ > refresh_interval_us_) {
+      cycles = (frame_period_us_ + refresh_interval_us_ - 1)
+        / refresh_interval_us_;
+    }
+    frame_interval_us_ = cycles * refresh_interval_us_;
+
+    if (keep_content_) offscreen->CopyFrom(*shown);
+    const int64_t start_us = GetMonotonicMicros();
+    RenderFrame(offscreen, vsync_us + frame_interval_us_);
+    last_render_us_ = GetMonotonicMicros() - start_us;
+
+    FrameCanvas *next = matrix_->SwapOnVSync(offscreen, cycles);
+    shown = offscreen;
+    offscreen = next;
+
+    now_us = GetMonotonicMicros();
+    // If rendering took too long, the swap waited for later cycles, which
+    // says nothing about the length of one.
+    if (last_render_us_ < frame_interval_us_) {
+      const int64_t cycle_us = (now_us - vsync_us) / cycles;
+      refresh_interval_us_ = (7 * refresh_interval_us_ + cycle_us) / 8;
+      if (refresh_interval_us_ < 1) refresh_interval_us_ = 1;
+    }
+    vsync_us = now_us;
+  }
+}
+
+}  // namespace rgb_matrix
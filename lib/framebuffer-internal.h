@@ -18,6 +18,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <vector>
+
 #include "hardware-mapping.h"
 
 namespace rgb_matrix {
@@ -26,6 +28,10 @@ class PinPulser;
 namespace internal {
 class RowAddressSetter;
 
+// The CPU the refresh thread is bound to by RGBMatrix::StartRefresh(): the
+// last one of a Raspberry Pi 2 or 3. Other busy threads better stay off it.
+static const int kRefreshCpu = 3;
+
 // An opaque type used within the framebuffer that can be used
 // to copy between PixelMappers.
 struct PixelDesignator {
@@ -49,10 +55,16 @@ public:
   inline int width() const { return width_; }
   inline int height() const { return height_; }
 
+  // True for the map the first Framebuffer creates, in which every pixel
+  // is at its natural place. Maps created by pixel mappers are not.
+  inline bool is_default_layout() const { return is_default_layout_; }
+  void set_default_layout(bool value) { is_default_layout_ = value; }
+
 private:
   const int width_;
   const int height_;
   PixelDesignator *const buffer_;
+  bool is_default_layout_;
 };
 
 // Internal representation of the frame-buffer that as well can
@@ -98,11 +110,61 @@ public:
   bool Deserialize(const char *data, size_t len);
   void CopyFrom(const Framebuffer *other);
 
+  // Copy "count" columns of all rows from "src_column" in "src" to "column".
+  // This copies the bitplanes as they are, so "src" needs the same rows and
+  // parallel chains and both need a pixel layout in which the columns
+  // correspond.
+  void CopyColumns(const Framebuffer *src, int src_column,
+                   int column, int count);
+
+  // Copy "count" pixels of a row, starting at "src_x", "src_y" in "src" to
+  // "x", "y". Goes through the pixel designators of both, so works with any
+  // pixel mapping, but is slower than CopyColumns().
+  void CopyPixels(const Framebuffer *src, int src_x, int src_y,
+                  int x, int y, int count);
+
+  // Returns true if no pixel mapper changed the pixel layout.
+  bool has_default_layout() const {
+    return (*shared_mapper_)->is_default_layout();
+  }
+
+  // A hash over everything that determines the serialized representation:
+  // geometry, pixel mapping, pwm bits, brightness and color settings.
+  uint32_t ConfigHash() const;
+
+  // Split the rows into sets that share no gpio words and return the number
+  // of sets; "row_set" gets the set of each row.
+  int GetIndependentRows(std::vector<int> *row_set) const;
+
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
   int width() const;
   int height() const;
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  void SetPixels(int x, int y, int width, int height, const uint8_t *rgb);
+  void SetPixelsRGBA(int x, int y, int width, int height, const uint8_t *rgba);
+  void SetPixelsYUV420(const uint8_t *const planes[3], const int strides[3],
+                       int src_width, int src_height, bool full_range);
+  void SetPixelsBitmap(int x, int y, int width, int height,
+                       const uint64_t *rows, const uint8_t *foreground,
+                       const uint8_t *background);
+  // Convert "count" RGBA pixels for DrawSprite() with the current color
+  // settings. For each bitplane, "codes" gets one byte per pixel with the
+  // red, green and blue bit of that plane, or kSpriteTransparent for pixels
+  // that are not fully opaque.
+  static const uint8_t kSpriteTransparent = 0x08;
+  void ConvertSprite(const uint8_t *rgba, int count,
+                     std::vector<uint8_t> *codes);
+  // Draw "width" x "height" pixels converted with ConvertSprite() at "x",
+  // "y", leaving transparent pixels alone.
+  void DrawSprite(const uint8_t *codes, int width, int height, int x, int y);
+
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+  // Fill "count" horizontal spans with one color. "spans" has three values
+  // for each: row, first column and the column after the last.
+  void FillSpans(const int *spans, int count,
+                 uint8_t red, uint8_t green, uint8_t blue);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
@@ -120,6 +182,14 @@ private:
   void InitDefaultDesignator(int x, int y, PixelDesignator *designator);
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+  inline void SetDesignatorBits(const PixelDesignator *designator,
+                                uint16_t red, uint16_t green, uint16_t blue);
+  // Fill columns "x_start" up to "x_end" of row "y" with a mapped color.
+  void FillMappedSpan(int y, int x_start, int x_end,
+                      uint16_t red, uint16_t green, uint16_t blue);
+  // SetPixels() with "bytes_per_pixel" 3 (RGB) or 4 (RGBA).
+  void SetPixelBlock(int x, int y, int width, int height,
+                     const uint8_t *pixels, int bytes_per_pixel);
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
@@ -28,6 +28,7 @@
 #include <string.h>
 
 #include <algorithm>
+#include <vector>
 
 #include "gpio.h"
 
@@ -55,7 +56,7 @@ PixelDesignator *PixelDesignatorMap::get(int x, int y) {
 
 PixelDesignatorMap::PixelDesignatorMap(int width, int height)
   : width_(width), height_(height),
-    buffer_(new PixelDesignator[width * height]) {
+    buffer_(new PixelDesignator[width * height]), is_default_layout_(false) {
 }
 
 PixelDesignatorMap::~PixelDesignatorMap() {
@@ -235,6 +236,7 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
         InitDefaultDesignator(x, y, (*shared_mapper_)->get(x, y));
       }
     }
+    (*shared_mapper_)->set_default_layout(true);
   }
 
   Clear();
@@ -448,13 +450,156 @@ int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
   if (designator == NULL) return;
-  const int pos = designator->gpio_word;
-  if (pos < 0) return;  // non-used pixel marker.
+  if (designator->gpio_word < 0) return;  // non-used pixel marker.
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
+  SetDesignatorBits(designator, red, green, blue);
+}
+
+// Bulk version of SetPixel(): "rgb" contains width*height pixels with three
+// bytes each, row by row. Clipping happens once per call and the color
+// mapping is only re-done if the color changes from one pixel to the next,
+// which is the common case for images with larger uniform areas.
+void Framebuffer::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb) {
+  SetPixelBlock(x, y, width, height, rgb, 3);
+}
+
+// Same with a fourth alpha byte per pixel; pixels that are not fully opaque
+// are skipped, so transparent parts of an image keep the canvas content.
+void Framebuffer::SetPixelsRGBA(int x, int y, int width, int height,
+                                const uint8_t *rgba) {
+  SetPixelBlock(x, y, width, height, rgba, 4);
+}
+
+void Framebuffer::SetPixelBlock(int x, int y, int width, int height,
+                                const uint8_t *pixels, int bytes_per_pixel) {
+  const int stride = bytes_per_pixel * width;
+  const bool has_alpha = (bytes_per_pixel == 4);
+  int x_start = 0, x_end = width;
+  int y_start = 0, y_end = height;
+  if (x < 0) x_start = -x;
+  if (y < 0) y_start = -y;
+  if (x + x_end > this->width()) x_end = this->width() - x;
+  if (y + y_end > this->height()) y_end = this->height() - y;
+  if (x_start >= x_end || y_start >= y_end) return;
+
+  uint16_t red = 0, green = 0, blue = 0;
+  MapColors(0, 0, 0, &red, &green, &blue);
+  uint8_t last_r = 0, last_g = 0, last_b = 0;
+  for (int row = y_start; row < y_end; ++row) {
+    const uint8_t *pixel = pixels + row * stride + bytes_per_pixel * x_start;
+    const PixelDesignator *designator
+      = (*shared_mapper_)->get(x + x_start, y + row);
+    for (int col = x_start; col < x_end;
+         ++col, pixel += bytes_per_pixel, ++designator) {
+      if (designator->gpio_word < 0) continue;
+      if (has_alpha && pixel[3] != 0xff) continue;
+      if (pixel[0] != last_r || pixel[1] != last_g || pixel[2] != last_b) {
+        last_r = pixel[0]; last_g = pixel[1]; last_b = pixel[2];
+        MapColors(last_r, last_g, last_b, &red, &green, &blue);
+      }
+      SetDesignatorBits(designator, red, green, blue);
+    }
+  }
+}
+
+// Adds "count" bytes of "row" to "sum". Simple enough for the compiler to
+// vectorize.
+static void AddRow(const uint8_t *row, int count, uint32_t *sum) {
+  for (int i = 0; i < count; ++i) sum[i] += row[i];
+}
+
+// Sum of "column_sum" in [start, max(start + 1, end)); returns the count.
+static inline int SumRange(const uint32_t *column_sum, int start, int end,
+                           uint32_t *sum) {
+  if (end <= start) end = start + 1;
+  uint32_t result = 0;
+  for (int i = start; i < end; ++i) result += column_sum[i];
+  *sum = result;
+  return end - start;
+}
 
-  uint32_t *bits = bitplane_buffer_ + pos;
+// Scales the source to the full canvas, averaging all source pixels that
+// fall into an output pixel, converts to RGB and writes the bitplanes, all
+// in one pass. Output rows are done one after another: the source rows an
+// output row covers are first added up column by column, which reads the
+// source sequentially and only once, then the column sums are combined
+// for each output pixel.
+void Framebuffer::SetPixelsYUV420(const uint8_t *const planes[3],
+                                  const int strides[3],
+                                  int src_width, int src_height,
+                                  bool full_range) {
+  const int width = this->width();
+  const int height = this->height();
+  if (src_width <= 0 || src_height <= 0) return;
+  const int chroma_width = (src_width + 1) / 2;
+  const int chroma_height = (src_height + 1) / 2;
+
+  // Range of source columns for each output column, luma and chroma.
+  std::vector<int> x_start(width + 1), cx_start(width + 1);
+  for (int x = 0; x <= width; ++x) {
+    x_start[x] = x * src_width / width;
+    cx_start[x] = x * chroma_width / width;
+  }
+  std::vector<uint32_t> sum_y(src_width), sum_u(chroma_width),
+    sum_v(chroma_width);
+
+  // BT.601 in 8.8 fixed point, as libswscale uses by default.
+  const int y_offset = full_range ? 0 : 16;
+  const int y_factor = full_range ? 256 : 298;
+  const int v_to_r = full_range ? 359 : 409;
+  const int u_to_g = full_range ? 88 : 100;
+  const int v_to_g = full_range ? 183 : 208;
+  const int u_to_b = full_range ? 454 : 516;
+
+  for (int y = 0; y < height; ++y) {
+    const int y0 = y * src_height / height;
+    const int y1 = std::max(y0 + 1, (y + 1) * src_height / height);
+    const int cy0 = y * chroma_height / height;
+    const int cy1 = std::max(cy0 + 1, (y + 1) * chroma_height / height);
+    std::fill(sum_y.begin(), sum_y.end(), 0);
+    std::fill(sum_u.begin(), sum_u.end(), 0);
+    std::fill(sum_v.begin(), sum_v.end(), 0);
+    for (int sy = y0; sy < y1; ++sy) {
+      AddRow(planes[0] + sy * strides[0], src_width, &sum_y[0]);
+    }
+    for (int sy = cy0; sy < cy1; ++sy) {
+      AddRow(planes[1] + sy * strides[1], chroma_width, &sum_u[0]);
+      AddRow(planes[2] + sy * strides[2], chroma_width, &sum_v[0]);
+    }
+
+    const PixelDesignator *designator = (*shared_mapper_)->get(0, y);
+    for (int x = 0; x < width; ++x, ++designator) {
+      if (designator->gpio_word < 0) continue;
+      uint32_t luma, u, v;
+      const int luma_count = (y1 - y0)
+        * SumRange(&sum_y[0], x_start[x], x_start[x + 1], &luma);
+      const int chroma_count = (cy1 - cy0)
+        * SumRange(&sum_u[0], cx_start[x], cx_start[x + 1], &u);
+      SumRange(&sum_v[0], cx_start[x], cx_start[x + 1], &v);
+      // Rounded averages.
+      const int c = y_factor * ((int)((luma + luma_count / 2) / luma_count)
+                                - y_offset);
+      const int d = (int)((u + chroma_count / 2) / chroma_count) - 128;
+      const int e = (int)((v + chroma_count / 2) / chroma_count) - 128;
+      const int r = (c + v_to_r * e + 128) >> 8;
+      const int g = (c - u_to_g * d - v_to_g * e + 128) >> 8;
+      const int b = (c + u_to_b * d + 128) >> 8;
+      uint16_t red, green, blue;
+      MapColors(std::min(std::max(r, 0), 255),
+                std::min(std::max(g, 0), 255),
+                std::min(std::max(b, 0), 255), &red, &green, &blue);
+      SetDesignatorBits(designator, red, green, blue);
+    }
+  }
+}
+
+inline void Framebuffer::SetDesignatorBits(const PixelDesignator *designator,
+                                           uint16_t red, uint16_t green,
+                                           uint16_t blue) {
+  uint32_t *bits = bitplane_buffer_ + designator->gpio_word;
   const int min_bit_plane = kBitPlanes - pwm_bits_;
   bits += (columns_ * min_bit_plane);
   const uint32_t r_bits = designator->r_bit;
@@ -471,6 +616,227 @@ void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   }
 }
 
+// Returns true if the "count" pixels starting at "first" are in consecutive
+// columns of the same rows and colors, so that each bitplane of them is a
+// run of consecutive words with the same bits. Without pixel mapper, this
+// is the case for any pixels within one row.
+static bool IsRun(const PixelDesignator *first, int count) {
+  if (first->gpio_word < 0) return false;
+  for (int i = 1; i < count; ++i) {
+    const PixelDesignator *d = first + i;
+    if (d->gpio_word != first->gpio_word + i
+        || d->r_bit != first->r_bit || d->g_bit != first->g_bit
+        || d->b_bit != first->b_bit || d->mask != first->mask)
+      return false;
+  }
+  return true;
+}
+
+const uint8_t Framebuffer::kSpriteTransparent;
+
+void Framebuffer::ConvertSprite(const uint8_t *rgba, int count,
+                                std::vector<uint8_t> *codes) {
+  codes->assign(kBitPlanes * count, kSpriteTransparent);
+  for (int i = 0; i < count; ++i, rgba += 4) {
+    if (rgba[3] != 0xff) continue;
+    uint16_t red, green, blue;
+    MapColors(rgba[0], rgba[1], rgba[2], &red, &green, &blue);
+    for (int b = 0; b < kBitPlanes; ++b) {
+      const uint16_t mask = 1 << b;
+      (*codes)[b * count + i] = ((red & mask) ? 1 : 0)
+        | ((green & mask) ? 2 : 0) | ((blue & mask) ? 4 : 0);
+    }
+  }
+}
+
+// For each code, the bits of a pixel word to keep and the color bits to
+// set, so that drawing a sprite pixel is one table lookup per plane.
+static void SpriteTables(const PixelDesignator *d,
+                         gpio_bits_t keep[16], gpio_bits_t value[16]) {
+  for (int code = 0; code < 16; ++code) {
+    if (code & Framebuffer::kSpriteTransparent) {
+      keep[code] = ~0u;
+      value[code] = 0;
+    } else {
+      keep[code] = d->mask;
+      value[code] = ((code & 1) ? d->r_bit : 0) | ((code & 2) ? d->g_bit : 0)
+        | ((code & 4) ? d->b_bit : 0);
+    }
+  }
+}
+
+void Framebuffer::DrawSprite(const uint8_t *codes, int width, int height,
+                             int x, int y) {
+  PixelDesignatorMap *map = *shared_mapper_;
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + width, map->width());
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, map->height());
+  if (x_start >= x_end || y_start >= y_end) return;
+  const int count = x_end - x_start;
+  const int plane_size = width * height;
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  gpio_bits_t keep[16], value[16];
+  for (int row = y_start; row < y_end; ++row) {
+    const uint8_t *const row_codes = codes + (row - y) * width
+      + (x_start - x);
+    const PixelDesignator *const first = map->get(x_start, row);
+    if (!map->is_default_layout() && !IsRun(first, count)) {
+      for (int i = 0; i < count; ++i) {
+        const PixelDesignator *d = first + i;
+        if (d->gpio_word < 0) continue;
+        SpriteTables(d, keep, value);
+        gpio_bits_t *word = bitplane_buffer_ + d->gpio_word
+          + columns_ * min_bit_plane;
+        for (int b = min_bit_plane; b < kBitPlanes; ++b, word += columns_) {
+          const uint8_t code = row_codes[b * plane_size + i];
+          *word = (*word & keep[code]) | value[code];
+        }
+      }
+      continue;
+    }
+    // All pixels of the row share the same bits; one table for the row.
+    SpriteTables(first, keep, value);
+    gpio_bits_t *plane = bitplane_buffer_ + first->gpio_word
+      + columns_ * min_bit_plane;
+    for (int b = min_bit_plane; b < kBitPlanes; ++b, plane += columns_) {
+      const uint8_t *plane_codes = row_codes + b * plane_size;
+      for (int i = 0; i < count; ++i)
+        plane[i] = (plane[i] & keep[plane_codes[i]]) | value[plane_codes[i]];
+    }
+  }
+}
+
+// Spans are filled plane by plane: in a row without pixel mapper, the
+// pixels are consecutive words with the same color bits.
+void Framebuffer::FillMappedSpan(int y, int x_start, int x_end,
+                                 uint16_t red, uint16_t green, uint16_t blue) {
+  PixelDesignatorMap *map = *shared_mapper_;
+  x_start = std::max(x_start, 0);
+  x_end = std::min(x_end, map->width());
+  if (y < 0 || y >= map->height() || x_start >= x_end) return;
+  const int length = x_end - x_start;
+  const PixelDesignator *const first = map->get(x_start, y);
+  if (!map->is_default_layout() && !IsRun(first, length)) {
+    for (const PixelDesignator *d = first; d < first + length; ++d) {
+      if (d->gpio_word >= 0) SetDesignatorBits(d, red, green, blue);
+    }
+    return;
+  }
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  gpio_bits_t *plane = bitplane_buffer_ + first->gpio_word
+    + columns_ * min_bit_plane;
+  const gpio_bits_t mask = first->mask;
+  for (int b = min_bit_plane; b < kBitPlanes; ++b, plane += columns_) {
+    const uint16_t plane_mask = 1 << b;
+    const gpio_bits_t color_bits = ((red & plane_mask) ? first->r_bit : 0)
+      | ((green & plane_mask) ? first->g_bit : 0)
+      | ((blue & plane_mask) ? first->b_bit : 0);
+    for (int x = 0; x < length; ++x)
+      plane[x] = (plane[x] & mask) | color_bits;
+  }
+}
+
+void Framebuffer::FillRect(int x, int y, int width, int height,
+                           uint8_t r, uint8_t g, uint8_t b) {
+  uint16_t red, green, blue;
+  MapColors(r, g, b, &red, &green, &blue);
+  const int y_end = std::min(y + height, this->height());
+  for (int row = std::max(y, 0); row < y_end; ++row)
+    FillMappedSpan(row, x, x + width, red, green, blue);
+}
+
+void Framebuffer::FillSpans(const int *spans, int count,
+                            uint8_t r, uint8_t g, uint8_t b) {
+  uint16_t red, green, blue;
+  MapColors(r, g, b, &red, &green, &blue);
+  for (int i = 0; i < count; ++i, spans += 3)
+    FillMappedSpan(spans[0], spans[1], spans[2], red, green, blue);
+}
+
+// Glyph rows are written per bitplane: as long as the pixels of a row are
+// in consecutive columns with the same color bits, which is the case
+// without pixel mapper, every plane only needs one pass over a few
+// consecutive words. Other layouts go pixel by pixel.
+void Framebuffer::SetPixelsBitmap(int x, int y, int width, int height,
+                                  const uint64_t *rows,
+                                  const uint8_t *foreground,
+                                  const uint8_t *background) {
+  PixelDesignatorMap *map = *shared_mapper_;
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + std::min(width, 64), map->width());
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, map->height());
+  if (x_start >= x_end || y_start >= y_end) return;
+  const int count = x_end - x_start;
+  const int shift = 63 - (x_start - x);  // Bit of the first column.
+
+  uint16_t fg[3], bg[3] = { 0, 0, 0 };
+  MapColors(foreground[0], foreground[1], foreground[2],
+            &fg[0], &fg[1], &fg[2]);
+  if (background) {
+    MapColors(background[0], background[1], background[2],
+              &bg[0], &bg[1], &bg[2]);
+  }
+
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  for (int row = y_start; row < y_end; ++row) {
+    const uint64_t bits = rows[row - y];
+    if (bits == 0 && background == NULL) continue;
+    const PixelDesignator *const first = map->get(x_start, row);
+    if (!IsRun(first, count)) {
+      for (int i = 0; i < count; ++i) {
+        const PixelDesignator *d = first + i;
+        if (d->gpio_word < 0) continue;
+        if (bits & (1ULL << (shift - i)))
+          SetDesignatorBits(d, fg[0], fg[1], fg[2]);
+        else if (background)
+          SetDesignatorBits(d, bg[0], bg[1], bg[2]);
+      }
+      continue;
+    }
+
+    gpio_bits_t fg_bits[kBitPlanes], bg_bits[kBitPlanes];
+    for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+      const uint16_t plane_mask = 1 << b;
+      fg_bits[b] = ((fg[0] & plane_mask) ? first->r_bit : 0)
+        | ((fg[1] & plane_mask) ? first->g_bit : 0)
+        | ((fg[2] & plane_mask) ? first->b_bit : 0);
+      bg_bits[b] = ((bg[0] & plane_mask) ? first->r_bit : 0)
+        | ((bg[1] & plane_mask) ? first->g_bit : 0)
+        | ((bg[2] & plane_mask) ? first->b_bit : 0);
+    }
+    const gpio_bits_t mask = first->mask;
+    gpio_bits_t *const start = bitplane_buffer_ + first->gpio_word
+      + columns_ * min_bit_plane;
+
+    if (background == NULL) {
+      // Glyphs are mostly empty; only touch the set pixels.
+      for (int i = 0; i < count; ++i) {
+        if ((bits & (1ULL << (shift - i))) == 0) continue;
+        gpio_bits_t *word = start + i;
+        for (int b = min_bit_plane; b < kBitPlanes; ++b, word += columns_)
+          *word = (*word & mask) | fg_bits[b];
+      }
+      continue;
+    }
+
+    // All pixels are written, so go plane by plane over consecutive words,
+    // with one all-ones or all-zero word per pixel to select the color.
+    gpio_bits_t is_set[64];
+    for (int i = 0; i < count; ++i)
+      is_set[i] = -(gpio_bits_t)((bits >> (shift - i)) & 1);
+    gpio_bits_t *plane = start;
+    for (int b = min_bit_plane; b < kBitPlanes; ++b, plane += columns_) {
+      const gpio_bits_t fg_word = fg_bits[b], bg_word = bg_bits[b];
+      for (int i = 0; i < count; ++i) {
+        plane[i] = (plane[i] & mask)
+          | (fg_word & is_set[i]) | (bg_word & ~is_set[i]);
+      }
+    }
+  }
+}
+
 // Strange LED-mappings such as RBG or so are handled here.
 gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
                                                 gpio_bits_t default_r,
@@ -549,6 +915,163 @@ void Framebuffer::CopyFrom(const Framebuffer *other) {
   memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
 }
 
+void Framebuffer::CopyColumns(const Framebuffer *src, int src_column,
+                              int column, int count) {
+  assert(src->rows_ == rows_ && src->parallel_ == parallel_);
+  if (src_column < 0 || column < 0 || count <= 0
+      || src_column + count > src->columns_ || column + count > columns_)
+    return;
+  // Within a double row, each bitplane stores its columns next to each
+  // other, so this is one memcpy() per bitplane.
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const size_t bytes = count * sizeof(gpio_bits_t);
+  for (int row = 0; row < double_rows_; ++row) {
+    for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+      memcpy(ValueAt(row, column, b),
+             src->bitplane_buffer_ + row * (src->columns_ * kBitPlanes)
+             + b * src->columns_ + src_column,
+             bytes);
+    }
+  }
+}
+
+void Framebuffer::CopyPixels(const Framebuffer *src, int src_x, int src_y,
+                             int x, int y, int count) {
+  const PixelDesignatorMap *src_map = *src->shared_mapper_;
+  if (src_x < 0 || x < 0 || count <= 0
+      || src_x + count > src_map->width() || x + count > width())
+    return;
+  const PixelDesignator *from = (*src->shared_mapper_)->get(src_x, src_y);
+  const PixelDesignator *to = (*shared_mapper_)->get(x, y);
+  if (from == NULL || to == NULL) return;
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  if (IsRun(from, count) && IsRun(to, count)) {
+    // Whole runs of words per plane. The bits only need translating if the
+    // rows are in different halves or parallel chains.
+    const gpio_bits_t *in = src->bitplane_buffer_ + from->gpio_word
+      + src->columns_ * min_bit_plane;
+    gpio_bits_t *out = bitplane_buffer_ + to->gpio_word
+      + columns_ * min_bit_plane;
+    const gpio_bits_t mask = to->mask;
+    const bool same_bits = (from->r_bit == to->r_bit
+                            && from->g_bit == to->g_bit
+                            && from->b_bit == to->b_bit);
+    for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+      if (same_bits) {
+        for (int i = 0; i < count; ++i)
+          out[i] = (out[i] & mask) | (in[i] & ~mask);
+      } else {
+        for (int i = 0; i < count; ++i) {
+          out[i] = (out[i] & mask)
+            | (-(gpio_bits_t)((in[i] & from->r_bit) != 0) & to->r_bit)
+            | (-(gpio_bits_t)((in[i] & from->g_bit) != 0) & to->g_bit)
+            | (-(gpio_bits_t)((in[i] & from->b_bit) != 0) & to->b_bit);
+        }
+      }
+      in += src->columns_;
+      out += columns_;
+    }
+    return;
+  }
+  for (int i = 0; i < count; ++i, ++from, ++to) {
+    if (to->gpio_word < 0 || from->gpio_word < 0) continue;
+    const gpio_bits_t *in = src->bitplane_buffer_ + from->gpio_word
+      + src->columns_ * min_bit_plane;
+    gpio_bits_t *out = bitplane_buffer_ + to->gpio_word
+      + columns_ * min_bit_plane;
+    // Without branches: the bits of image content are hard to predict.
+    for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+      const gpio_bits_t color_bits
+        = (-(gpio_bits_t)((*in & from->r_bit) != 0) & to->r_bit)
+        | (-(gpio_bits_t)((*in & from->g_bit) != 0) & to->g_bit)
+        | (-(gpio_bits_t)((*in & from->b_bit) != 0) & to->b_bit);
+      *out = (*out & to->mask) | color_bits;
+      in += src->columns_;
+      out += columns_;
+    }
+  }
+}
+
+// FNV-1a; good enough to tell configurations apart.
+static uint32_t HashBytes(uint32_t hash, const void *data, size_t len) {
+  const uint8_t *bytes = (const uint8_t*) data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+uint32_t Framebuffer::ConfigHash() const {
+  uint32_t hash = 2166136261u;
+  const int32_t geometry[] = { rows_, columns_, parallel_, scan_mode_,
+                               inverse_color_, pwm_bits_,
+                               do_luminance_correct_, brightness_ };
+  hash = HashBytes(hash, geometry, sizeof(geometry));
+  hash = HashBytes(hash, led_sequence_, strlen(led_sequence_));
+  hash = HashBytes(hash, hardware_mapping_->name,
+                   strlen(hardware_mapping_->name));
+
+  // The pixel mapping contains the result of all multiplexers and pixel
+  // mappers, so this is where the panel arrangement is reflected.
+  const PixelDesignatorMap *mapper = *shared_mapper_;
+  const int32_t size[] = { mapper->width(), mapper->height() };
+  hash = HashBytes(hash, size, sizeof(size));
+  for (int y = 0; y < mapper->height(); ++y) {
+    const PixelDesignator *row = (*shared_mapper_)->get(0, y);
+    hash = HashBytes(hash, row, mapper->width() * sizeof(*row));
+  }
+  return hash;
+}
+
+// Union-find root of "node", compressing the path on the way.
+static int FindRoot(std::vector<int> *parent, int node) {
+  while ((*parent)[node] != node) {
+    (*parent)[node] = (*parent)[(*parent)[node]];
+    node = (*parent)[node];
+  }
+  return node;
+}
+
+int Framebuffer::GetIndependentRows(std::vector<int> *row_set) const {
+  const PixelDesignatorMap *mapper = *shared_mapper_;
+  const int height = mapper->height();
+  row_set->resize(height);
+  if (mapper->is_default_layout()) {
+    for (int y = 0; y < height; ++y) (*row_set)[y] = y % double_rows_;
+    return std::min(height, double_rows_);
+  }
+
+  // Rows are nodes 0..height-1, double rows follow. Every row is joined with
+  // the double rows its pixels are stored in.
+  std::vector<int> parent(height + double_rows_);
+  for (size_t i = 0; i < parent.size(); ++i) parent[i] = i;
+  const int double_row_size = columns_ * kBitPlanes;
+  for (int y = 0; y < height; ++y) {
+    const PixelDesignator *row = (*shared_mapper_)->get(0, y);
+    int last_double_row = -1;
+    for (int x = 0; x < mapper->width(); ++x) {
+      if (row[x].gpio_word < 0) continue;
+      const int double_row = row[x].gpio_word / double_row_size;
+      if (double_row == last_double_row) continue;
+      last_double_row = double_row;
+      const int a = FindRoot(&parent, y);
+      const int b = FindRoot(&parent, height + double_row);
+      if (a != b) parent[b] = a;
+    }
+  }
+
+  // Number the sets in the order of their first row.
+  std::vector<int> set_of_root(parent.size(), -1);
+  int sets = 0;
+  for (int y = 0; y < height; ++y) {
+    int &set = set_of_root[FindRoot(&parent, y)];
+    if (set < 0) set = sets++;
+    (*row_set)[y] = set;
+  }
+  return sets;
+}
+
 void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
   const struct HardwareMapping &h = *hardware_mapping_;
   gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
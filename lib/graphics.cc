@@ -14,9 +14,13 @@
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
 #include "graphics.h"
+#include "led-matrix.h"
 #include "utf8-internal.h"
+#include <math.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <functional>
+#include <vector>
 
 namespace rgb_matrix {
 int DrawText(Canvas *c, const Font &font,
@@ -47,6 +51,83 @@ int DrawText(Canvas *c, const Font &font,
   return DrawText(c, font, x, y, color, background_color, utf8_text, 0);
 }
 
+TextLayout::TextLayout(const Font &font, const char *utf8_text,
+                       int extra_spacing)
+  : font_(font), text_(utf8_text), extra_spacing_(extra_spacing), width_(0) {
+  int x = 0;
+  while (*utf8_text) {
+    const uint32_t cp = utf8_next_codepoint(utf8_text);
+    const int advance = font.CharacterAdvance(cp);
+    const PlacedGlyph glyph = { cp, x, x + advance };
+    glyphs_.push_back(glyph);
+    x += advance + extra_spacing;
+  }
+  width_ = x;
+}
+
+bool TextLayout::EndsBefore(const PlacedGlyph &glyph, int x) {
+  return glyph.end <= x;
+}
+
+int TextLayout::Draw(Canvas *c, int x, int y,
+                     const Color &color, const Color *background_color) const {
+  // With negative spacing, glyph ends are not necessarily ascending; then
+  // just start at the beginning.
+  std::vector<PlacedGlyph>::const_iterator it = glyphs_.begin();
+  if (extra_spacing_ >= 0)
+    it = std::lower_bound(glyphs_.begin(), glyphs_.end(), -x, EndsBefore);
+  const int canvas_width = c->width();
+  for (/**/; it != glyphs_.end() && x + it->x < canvas_width; ++it) {
+    font_.DrawGlyph(c, x + it->x, y, color, background_color, it->codepoint);
+  }
+  return width_;
+}
+
+RenderedText::RenderedText(RGBMatrix *matrix, const TextLayout &layout,
+                           const Color &color, const Color *background_color) {
+  Render(matrix, layout, color, background_color, NULL, NULL);
+}
+
+RenderedText::RenderedText(RGBMatrix *matrix, const TextLayout &layout,
+                           const Color &color, const Color *background_color,
+                           const Font &outline_font,
+                           const Color &outline_color) {
+  Render(matrix, layout, color, background_color,
+         &outline_font, &outline_color);
+}
+
+RenderedText::~RenderedText() {
+  delete surface_;
+}
+
+void RenderedText::Render(RGBMatrix *matrix, const TextLayout &layout,
+                          const Color &color, const Color *background_color,
+                          const Font *outline_font,
+                          const Color *outline_color) {
+  width_ = layout.width();
+  margin_ = outline_font ? 1 : 0;
+  baseline_ = layout.font().baseline() + margin_;
+  surface_ = matrix->CreateWideCanvas(width_ + 2 * margin_,
+                                      layout.font().height() + 2 * margin_);
+  if (background_color) {
+    surface_->Fill(background_color->r, background_color->g,
+                   background_color->b);
+  }
+  if (outline_font) {
+    // Same pitch as the regular text, which is then drawn on top; see
+    // CreateOutlineFont(). With the background, as the text-examples do.
+    TextLayout outline(*outline_font, layout.text().c_str(),
+                       layout.extra_spacing() - 2);
+    outline.Draw(surface_, 0, baseline_, *outline_color, background_color);
+  }
+  layout.Draw(surface_, margin_, baseline_, color, NULL);
+}
+
+void RenderedText::Draw(FrameCanvas *frame, int x, int y) const {
+  frame->CopyRect(*surface_, 0, 0, x - margin_, y - baseline_,
+                  surface_->width(), surface_->height());
+}
+
 int VerticalDrawText(Canvas *c, const Font &font, int x, int y,
                      const Color &color, const Color *background_color,
                      const char *utf8_text, int extra_spacing) {
@@ -82,9 +163,119 @@ void DrawCircle(Canvas *c, int x0, int y0, int radius, const Color &color) {
   }
 }
 
+// Fill spans of three values each: row, first column, column after the last.
+static void FillSpans(Canvas *c, const std::vector<int> &spans,
+                      const Color &color) {
+  if (spans.empty()) return;
+  const int count = spans.size() / 3;
+  if (FrameCanvas *fc = dynamic_cast<FrameCanvas*>(c)) {
+    fc->FillSpans(&spans[0], count, color.r, color.g, color.b);
+    return;
+  }
+  if (WideCanvas *wc = dynamic_cast<WideCanvas*>(c)) {
+    wc->FillSpans(&spans[0], count, color.r, color.g, color.b);
+    return;
+  }
+  const int width = c->width();
+  for (int i = 0; i < count; ++i) {
+    const int *span = &spans[3 * i];
+    const int x_end = std::min(span[2], width);
+    for (int x = std::max(span[1], 0); x < x_end; ++x)
+      c->SetPixel(x, span[0], color.r, color.g, color.b);
+  }
+}
+
+void FillRect(Canvas *c, int x, int y, int width, int height,
+              const Color &color) {
+  if (FrameCanvas *fc = dynamic_cast<FrameCanvas*>(c)) {
+    fc->FillRect(x, y, width, height, color.r, color.g, color.b);
+    return;
+  }
+  if (WideCanvas *wc = dynamic_cast<WideCanvas*>(c)) {
+    wc->FillRect(x, y, width, height, color.r, color.g, color.b);
+    return;
+  }
+  const int x_end = std::min(x + width, c->width());
+  const int y_end = std::min(y + height, c->height());
+  for (int row = std::max(y, 0); row < y_end; ++row) {
+    for (int col = std::max(x, 0); col < x_end; ++col)
+      c->SetPixel(col, row, color.r, color.g, color.b);
+  }
+}
+
+void FillCircle(Canvas *c, int x0, int y0, int radius, const Color &color) {
+  if (radius < 0) return;
+  // Half width of each row from the center, walking the same midpoint
+  // circle as DrawCircle().
+  std::vector<int> extent(radius + 1, 0);
+  int x = radius, y = 0;
+  int radiusError = 1 - x;
+  while (y <= x) {
+    extent[y] = std::max(extent[y], x);
+    extent[x] = std::max(extent[x], y);
+    y++;
+    if (radiusError < 0) {
+      radiusError += 2 * y + 1;
+    } else {
+      x--;
+      radiusError += 2 * (y - x + 1);
+    }
+  }
+  std::vector<int> spans;
+  spans.reserve(3 * (2 * radius + 1));
+  for (int dy = -radius; dy <= radius; ++dy) {
+    const int half_width = extent[abs(dy)];
+    spans.push_back(y0 + dy);
+    spans.push_back(x0 - half_width);
+    spans.push_back(x0 + half_width + 1);
+  }
+  FillSpans(c, spans, color);
+}
+
+void FillPolygon(Canvas *c, const int *x, const int *y, int count,
+                 const Color &color) {
+  if (count < 3) return;
+  const int y_min = std::max(*std::min_element(y, y + count), 0);
+  const int y_max = std::min(*std::max_element(y, y + count), c->height());
+  std::vector<int> spans;
+  std::vector<double> crossings;
+  for (int row = y_min; row < y_max; ++row) {
+    // Where the edges cross the horizontal line through the pixel centers.
+    const double center_y = row + 0.5;
+    crossings.clear();
+    for (int i = 0, j = count - 1; i < count; j = i++) {
+      if ((y[i] <= center_y) == (y[j] <= center_y))
+        continue;  // Does not cross (also skips horizontal edges).
+      crossings.push_back(x[j] + (center_y - y[j]) * (x[i] - x[j])
+                          / (y[i] - y[j]));
+    }
+    std::sort(crossings.begin(), crossings.end());
+    // Between pairs of crossings is inside; fill pixels whose center is.
+    for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+      const int x_start = (int)ceil(crossings[i] - 0.5);
+      const int x_end = (int)ceil(crossings[i + 1] - 0.5);
+      if (x_start >= x_end) continue;
+      spans.push_back(row);
+      spans.push_back(x_start);
+      spans.push_back(x_end);
+    }
+  }
+  FillSpans(c, spans, color);
+}
+
 void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color) {
   int dy = y1 - y0, dx = x1 - x0, gradient, x, y, shift = 0x10;
 
+  // Horizontal and vertical lines are just spans; common in dashboards.
+  if (dy == 0) {
+    FillRect(c, std::min(x0, x1), y0, abs(dx) + 1, 1, color);
+    return;
+  }
+  if (dx == 0) {
+    FillRect(c, x0, std::min(y0, y1), 1, abs(dy) + 1, color);
+    return;
+  }
+
   if (abs(dx) > abs(dy)) {
     // x variation is bigger than y variation
     if (x1 < x0) {
@@ -0,0 +1,348 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "image-loader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace rgb_matrix {
+
+namespace {
+// Larger images are certainly not meant for LED panels; this also keeps
+// all size calculations well within range.
+static const int kMaxDimension = 16384;
+
+static uint16_t Get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t Get32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool Fail(std::string *err_msg, const char *msg) {
+  if (err_msg) *err_msg = msg;
+  return false;
+}
+
+static bool ReadFile(const char *filename, std::vector<uint8_t> *data,
+                     std::string *err_msg) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return Fail(err_msg, strerror(errno));
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+    close(fd);
+    return Fail(err_msg, "Not a regular file");
+  }
+  data->resize(sb.st_size);
+  size_t pos = 0;
+  while (pos < data->size()) {
+    const ssize_t r = read(fd, &(*data)[pos], data->size() - pos);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    pos += r;
+  }
+  close(fd);
+  if (pos != data->size()) return Fail(err_msg, "Short read");
+  return true;
+}
+
+static bool HasRawExtension(const char *filename) {
+  const char *ext = strrchr(filename, '.');
+  return ext && (strcasecmp(ext, ".rgb") == 0 || strcasecmp(ext, ".raw") == 0);
+}
+
+// What we need to know from a BMP header. All values are checked to be
+// usable with a file of the given size.
+struct BMPInfo {
+  uint32_t pixel_offset;
+  int width;
+  int height;
+  bool top_down;
+  int bpp;
+  uint64_t palette_start;  // Only for palettized images.
+  uint32_t palette_size;
+  size_t stride;
+};
+
+// Parse the BMP header in the first "len" bytes "d" of a file with
+// "file_size" bytes. Returns false if we can't decode that file.
+static bool ParseBMPHeader(const uint8_t *d, size_t len, uint64_t file_size,
+                           BMPInfo *info, std::string *err_msg) {
+  if (len < 54) return Fail(err_msg, "BMP: file too short");
+  info->pixel_offset = Get32(d + 10);
+  const uint32_t header_size = Get32(d + 14);
+  const int32_t width = (int32_t)Get32(d + 18);
+  int32_t height = (int32_t)Get32(d + 22);
+  const int bpp = Get16(d + 28);
+  const uint32_t compression = Get32(d + 30);
+  const uint32_t colors_used = Get32(d + 46);
+  if (header_size < 40) return Fail(err_msg, "BMP: unsupported header");
+
+  info->top_down = height < 0;
+  if (info->top_down) height = -height;
+  if (width <= 0 || height <= 0
+      || width > kMaxDimension || height > kMaxDimension) {
+    return Fail(err_msg, "BMP: invalid size");
+  }
+  info->width = width;
+  info->height = height;
+  info->bpp = bpp;
+
+  // 32 bit images are often stored as bitfields. We only deal with the
+  // common layout that is identical to the uncompressed one.
+  const uint32_t kBI_RGB = 0, kBI_BITFIELDS = 3;
+  if (compression == kBI_BITFIELDS && bpp == 32) {
+    if (len < 66 || Get32(d + 54) != 0xff0000
+        || Get32(d + 58) != 0xff00 || Get32(d + 62) != 0xff) {
+      return Fail(err_msg, "BMP: unsupported bitfields");
+    }
+  } else if (compression != kBI_RGB) {
+    return Fail(err_msg, "BMP: compressed files are not supported");
+  }
+
+  info->palette_start = 0;
+  info->palette_size = 0;
+  if (bpp == 1 || bpp == 4 || bpp == 8) {
+    info->palette_size = colors_used ? colors_used : (1U << bpp);
+    info->palette_start = 14 + (uint64_t)header_size;
+    if (info->palette_size > 256
+        || info->palette_start + 4 * info->palette_size > file_size) {
+      return Fail(err_msg, "BMP: invalid palette");
+    }
+  } else if (bpp != 24 && bpp != 32) {
+    return Fail(err_msg, "BMP: unsupported bits per pixel");
+  }
+
+  info->stride = ((size_t)width * bpp + 31) / 32 * 4;
+  if (info->pixel_offset + (uint64_t)info->stride * height > file_size)
+    return Fail(err_msg, "BMP: file too short");
+  return true;
+}
+
+static bool DecodeBMP(const std::vector<uint8_t> &data, RGBImage *image,
+                      std::string *err_msg) {
+  BMPInfo info;
+  if (!ParseBMPHeader(&data[0], data.size(), data.size(), &info, err_msg))
+    return false;
+  const uint8_t *const d = &data[0];
+  const int width = info.width, height = info.height, bpp = info.bpp;
+  const uint8_t *const palette = info.palette_size
+    ? d + info.palette_start : NULL;
+
+  image->width = width;
+  image->height = height;
+  image->pixels.resize(3 * width * height);
+  for (int y = 0; y < height; ++y) {
+    const uint8_t *src = d + info.pixel_offset
+      + info.stride * (info.top_down ? y : height - 1 - y);
+    uint8_t *dst = &image->pixels[3 * width * y];
+    if (palette == NULL) {
+      const int step = bpp / 8;
+      for (int x = 0; x < width; ++x, src += step, dst += 3) {
+        dst[0] = src[2];  // Stored as blue, green, red.
+        dst[1] = src[1];
+        dst[2] = src[0];
+      }
+      continue;
+    }
+    for (int x = 0; x < width; ++x, dst += 3) {
+      uint32_t index;
+      switch (bpp) {
+      case 8: index = src[x]; break;
+      case 4: index = (src[x >> 1] >> ((x & 1) ? 0 : 4)) & 0x0f; break;
+      default: index = (src[x >> 3] >> (7 - (x & 7))) & 0x01; break;
+      }
+      if (index >= info.palette_size) {
+        dst[0] = dst[1] = dst[2] = 0;
+        continue;
+      }
+      const uint8_t *color = palette + 4 * index;  // blue, green, red, unused
+      dst[0] = color[2];
+      dst[1] = color[1];
+      dst[2] = color[0];
+    }
+  }
+  return true;
+}
+
+// Read next number of the PNM header at "*pos", skipping whitespace and
+// comments.
+static bool ReadPNMNumber(const std::vector<uint8_t> &data, size_t *pos,
+                          int *value) {
+  while (*pos < data.size()) {
+    const uint8_t c = data[*pos];
+    if (c == '#') {
+      while (*pos < data.size() && data[*pos] != '\n') ++*pos;
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      ++*pos;
+    } else {
+      break;
+    }
+  }
+  if (*pos >= data.size() || data[*pos] < '0' || data[*pos] > '9')
+    return false;
+  *value = 0;
+  while (*pos < data.size() && data[*pos] >= '0' && data[*pos] <= '9') {
+    *value = *value * 10 + (data[*pos] - '0');
+    if (*value > 65535) return false;
+    ++*pos;
+  }
+  return true;
+}
+
+struct PNMInfo {
+  bool is_gray;
+  int width;
+  int height;
+  int maxval;
+  int sample_bytes;
+  size_t data_offset;
+};
+
+// Parse the PNM header at the start of "data", which is the beginning of a
+// file with "file_size" bytes. Returns false if we can't decode that file.
+static bool ParsePNMHeader(const std::vector<uint8_t> &data, uint64_t file_size,
+                           PNMInfo *info, std::string *err_msg) {
+  if (data.size() < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6'))
+    return Fail(err_msg, "PNM: unsupported format");
+  info->is_gray = (data[1] == '5');
+  size_t pos = 2;
+  if (!ReadPNMNumber(data, &pos, &info->width)
+      || !ReadPNMNumber(data, &pos, &info->height)
+      || !ReadPNMNumber(data, &pos, &info->maxval)
+      || pos >= data.size()) {
+    return Fail(err_msg, "PNM: invalid header");
+  }
+  info->data_offset = pos + 1;  // Exactly one whitespace before the data.
+  if (info->width <= 0 || info->height <= 0 || info->width > kMaxDimension
+      || info->height > kMaxDimension || info->maxval <= 0) {
+    return Fail(err_msg, "PNM: invalid size");
+  }
+  info->sample_bytes = (info->maxval > 255) ? 2 : 1;
+  const uint64_t samples = (uint64_t)info->width * info->height
+    * (info->is_gray ? 1 : 3);
+  if (info->data_offset + samples * info->sample_bytes > file_size)
+    return Fail(err_msg, "PNM: file too short");
+  return true;
+}
+
+static bool DecodePNM(const std::vector<uint8_t> &data, RGBImage *image,
+                      std::string *err_msg) {
+  PNMInfo info;
+  if (!ParsePNMHeader(data, data.size(), &info, err_msg))
+    return false;
+  const int maxval = info.maxval, sample_bytes = info.sample_bytes;
+  const bool is_gray = info.is_gray;
+  const size_t samples = (size_t)info.width * info.height * (is_gray ? 1 : 3);
+
+  image->width = info.width;
+  image->height = info.height;
+  image->pixels.resize(3 * info.width * info.height);
+  const uint8_t *src = &data[info.data_offset];
+  uint8_t *dst = &image->pixels[0];
+  if (sample_bytes == 1 && maxval == 255 && !is_gray) {
+    memcpy(dst, src, samples);  // The common case: exactly our layout.
+    return true;
+  }
+  for (size_t i = 0; i < samples; ++i, src += sample_bytes) {
+    const int value = (sample_bytes == 2) ? (src[0] << 8) | src[1] : src[0];
+    const uint8_t c = (std::min(value, maxval) * 255 + maxval / 2) / maxval;
+    if (is_gray) {
+      *dst++ = c;
+      *dst++ = c;
+      *dst++ = c;
+    } else {
+      *dst++ = c;
+    }
+  }
+  return true;
+}
+}  // namespace
+
+bool IsNativeImage(const char *filename) {
+  // Never open pipes or sockets here: that would consume their data.
+  struct stat sb;
+  if (stat(filename, &sb) != 0 || !S_ISREG(sb.st_mode)) return false;
+  if (HasRawExtension(filename))
+    return sb.st_size > 0 && sb.st_size % 3 == 0;
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  // Enough for any BMP header we decode and for PNM headers with short
+  // comments; files with longer ones are left to the image library.
+  std::vector<uint8_t> header(1024);
+  const ssize_t len = read(fd, &header[0], header.size());
+  close(fd);
+  if (len < 2) return false;
+  header.resize(len);
+  // Same checks as when decoding, so that we don't claim files that would
+  // fail to load.
+  if (header[0] == 'B' && header[1] == 'M') {
+    BMPInfo info;
+    return ParseBMPHeader(&header[0], len, sb.st_size, &info, NULL);
+  }
+  PNMInfo info;
+  return ParsePNMHeader(header, sb.st_size, &info, NULL);
+}
+
+bool LoadNativeImage(const char *filename, int raw_width, int raw_height,
+                     RGBImage *image, std::string *err_msg) {
+  std::vector<uint8_t> data;
+  if (!ReadFile(filename, &data, err_msg))
+    return false;
+  if (HasRawExtension(filename)) {
+    if (raw_width <= 0 || raw_height <= 0
+        || data.size() != 3 * (size_t)raw_width * raw_height) {
+      return Fail(err_msg, "Raw RGB: size does not match");
+    }
+    image->width = raw_width;
+    image->height = raw_height;
+    image->pixels.swap(data);
+    return true;
+  }
+  if (data.size() >= 2 && data[0] == 'B' && data[1] == 'M')
+    return DecodeBMP(data, image, err_msg);
+  if (data.size() >= 2 && data[0] == 'P' && (data[1] == '5' || data[1] == '6'))
+    return DecodePNM(data, image, err_msg);
+  return Fail(err_msg, "Unknown image format");
+}
+
+void ScaleImage(const RGBImage &in, int width, int height, RGBImage *out) {
+  std::vector<uint8_t> pixels(3 * width * height, 0);
+  if (in.width > 0 && in.height > 0) {
+    // Range of source columns for each output column.
+    std::vector<int> x_start(width + 1);
+    for (int x = 0; x <= width; ++x) x_start[x] = x * in.width / width;
+    uint8_t *dst = pixels.empty() ? NULL : &pixels[0];
+    for (int y = 0; y < height; ++y) {
+      const int y0 = y * in.height / height;
+      const int y1 = std::max(y0 + 1, (y + 1) * in.height / height);
+      for (int x = 0; x < width; ++x, dst += 3) {
+        const int x0 = x_start[x];
+        const int x1 = std::max(x0 + 1, x_start[x + 1]);
+        uint32_t r = 0, g = 0, b = 0;
+        for (int sy = y0; sy < y1; ++sy) {
+          const uint8_t *src = &in.pixels[3 * (sy * in.width + x0)];
+          for (int sx = x0; sx < x1; ++sx, src += 3) {
+            r += src[0];
+            g += src[1];
+            b += src[2];
+          }
+        }
+        const uint32_t count = (y1 - y0) * (x1 - x0);
+        dst[0] = (r + count / 2) / count;
+        dst[1] = (g + count / 2) / count;
+        dst[2] = (b + count / 2) / count;
+      }
+    }
+  }
+  out->width = width;
+  out->height = height;
+  out->pixels.swap(pixels);
+}
+
+}  // namespace rgb_matrix
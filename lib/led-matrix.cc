@@ -25,6 +25,8 @@
 #include <stdio.h>
 #include <sys/time.h>
 
+#include <algorithm>
+
 #include "gpio.h"
 #include "thread.h"
 #include "framebuffer-internal.h"
@@ -329,7 +331,7 @@ bool RGBMatrix::StartRefresh() {
     //   core #3 will succeed.
     // The Raspberry Pi1 only has one core, so this affinity
     //   call will simply fail and we keep using the only core.
-    updater_->Start(99, (1<<3));  // Prio: high. Also: put on last CPU.
+    updater_->Start(99, (1 << kRefreshCpu));  // Prio: high. Put on last CPU.
   }
   return updater_ != NULL;
 }
@@ -356,6 +358,21 @@ FrameCanvas *RGBMatrix::CreateFrameCanvas() {
   return result;
 }
 
+WideCanvas *RGBMatrix::CreateWideCanvas(int width, int height) {
+  WideCanvas *result = new WideCanvas(params_, width, height);
+  result->frame_->SetPWMBits(params_.pwm_bits);
+  result->frame_->set_luminance_correct(do_luminance_correct_);
+  result->frame_->SetBrightness(params_.brightness);
+  return result;
+}
+
+Sprite *RGBMatrix::CreateSprite(int width, int height, const uint8_t *rgba) {
+  Sprite *result = new Sprite(std::max(width, 0), std::max(height, 0));
+  active_->framebuffer()->ConvertSprite(rgba, result->width_ * result->height_,
+                                        &result->codes_);
+  return result;
+}
+
 FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
                                     unsigned frame_fraction) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
@@ -551,4 +568,201 @@ bool FrameCanvas::Deserialize(const char *data, size_t len) {
 void FrameCanvas::CopyFrom(const FrameCanvas &other) {
   frame_->CopyFrom(other.frame_);
 }
+uint32_t FrameCanvas::ConfigHash() const { return frame_->ConfigHash(); }
+int FrameCanvas::GetIndependentRows(std::vector<int> *row_set) const {
+  return frame_->GetIndependentRows(row_set);
+}
+void FrameCanvas::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb) {
+  frame_->SetPixels(x, y, width, height, rgb);
+}
+void FrameCanvas::SetPixelsRGBA(int x, int y, int width, int height,
+                                const uint8_t *rgba) {
+  frame_->SetPixelsRGBA(x, y, width, height, rgba);
+}
+void FrameCanvas::SetPixelsYUV420(const uint8_t *const planes[3],
+                                  const int strides[3],
+                                  int src_width, int src_height,
+                                  bool full_range) {
+  frame_->SetPixelsYUV420(planes, strides, src_width, src_height, full_range);
+}
+void FrameCanvas::SetPixelsBitmap(int x, int y, int width, int height,
+                                  const uint64_t *rows,
+                                  const uint8_t *foreground,
+                                  const uint8_t *background) {
+  frame_->SetPixelsBitmap(x, y, width, height, rows, foreground, background);
+}
+
+void FrameCanvas::CopyViewport(const WideCanvas &content,
+                               int x_offset, int y_offset) {
+  const int content_width = content.width();
+  const int content_height = content.height();
+  x_offset %= content_width;
+  if (x_offset < 0) x_offset += content_width;
+  y_offset %= content_height;
+  if (y_offset < 0) y_offset += content_height;
+
+  // If all visible rows come from one band of the content and pixels are
+  // where the framebuffer has them naturally, the bitplanes of the band can
+  // be copied column-wise as they are.
+  const int band_height = content.band_height_;
+  if (frame_->has_default_layout() && y_offset % band_height == 0
+      && y_offset + band_height <= content_height) {
+    const int band_start = (y_offset / band_height) * content_width;
+    for (int x = 0; x < width(); /**/) {
+      const int src_x = (x_offset + x) % content_width;
+      const int count = std::min(width() - x, content_width - src_x);
+      frame_->CopyColumns(content.frame_, band_start + src_x, x, count);
+      x += count;
+    }
+    return;
+  }
+
+  for (int y = 0; y < height(); ++y) {
+    const int src_y = (y_offset + y) % content_height;
+    for (int x = 0; x < width(); /**/) {
+      const int src_x = (x_offset + x) % content_width;
+      const int count = std::min(width() - x, content_width - src_x);
+      frame_->CopyPixels(content.frame_, src_x, src_y, x, y, count);
+      x += count;
+    }
+  }
+}
+
+// Copy a rect between framebuffers with the same pixel layout in bands of
+// "band_height" rows; for a WideCanvas the bands are side by side, each
+// "band_width" columns wide.
+static void CopyFramebufferRect(internal::Framebuffer *to,
+                                const internal::Framebuffer *from,
+                                int band_width, int band_height,
+                                int src_x, int src_y,
+                                int x, int y, int width, int height) {
+  if (to->has_default_layout() && y == 0 && height == to->height()
+      && src_y % band_height == 0) {
+    const int band_start = (src_y / band_height) * band_width;
+    to->CopyColumns(from, band_start + src_x, x, width);
+    return;
+  }
+  for (int row = 0; row < height; ++row) {
+    to->CopyPixels(from, src_x, src_y + row, x, y + row, width);
+  }
+}
+
+// Clip the rect to copy to a destination and source canvas size.
+static bool ClipCopyRect(int dest_width, int dest_height,
+                         int src_width, int src_height,
+                         int *src_x, int *src_y, int *x, int *y,
+                         int *width, int *height) {
+  if (*x < 0) { *src_x -= *x; *width += *x; *x = 0; }
+  if (*y < 0) { *src_y -= *y; *height += *y; *y = 0; }
+  if (*src_x < 0) { *x -= *src_x; *width += *src_x; *src_x = 0; }
+  if (*src_y < 0) { *y -= *src_y; *height += *src_y; *src_y = 0; }
+  *width = std::min(*width, std::min(dest_width - *x, src_width - *src_x));
+  *height = std::min(*height, std::min(dest_height - *y,
+                                       src_height - *src_y));
+  return *width > 0 && *height > 0;
+}
+
+void FrameCanvas::CopyRect(const WideCanvas &content, int src_x, int src_y,
+                           int x, int y, int width, int height) {
+  if (!ClipCopyRect(this->width(), this->height(),
+                    content.width(), content.height(),
+                    &src_x, &src_y, &x, &y, &width, &height))
+    return;
+  CopyFramebufferRect(frame_, content.frame_,
+                      content.width(), content.band_height_,
+                      src_x, src_y, x, y, width, height);
+}
+
+void FrameCanvas::CopyRect(const FrameCanvas &other, int src_x, int src_y,
+                           int x, int y, int width, int height) {
+  if (!ClipCopyRect(this->width(), this->height(),
+                    other.width(), other.height(),
+                    &src_x, &src_y, &x, &y, &width, &height))
+    return;
+  CopyFramebufferRect(frame_, other.frame_, 0, other.height(),
+                      src_x, src_y, x, y, width, height);
+}
+
+void FrameCanvas::DrawSprite(const Sprite &sprite, int x, int y) {
+  if (sprite.codes_.empty()) return;
+  frame_->DrawSprite(&sprite.codes_[0], sprite.width_, sprite.height_, x, y);
+}
+
+Sprite::~Sprite() {}
+
+void FrameCanvas::FillRect(int x, int y, int width, int height,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, height, red, green, blue);
+}
+void FrameCanvas::FillSpans(const int *spans, int count,
+                            uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillSpans(spans, count, red, green, blue);
+}
+
+// WideCanvas
+WideCanvas::WideCanvas(const RGBMatrix::Options &params,
+                       int width, int height)
+  : map_(NULL), band_height_(params.rows * params.parallel),
+    frame_(new Framebuffer(params.rows,
+                           std::max(width, 1)
+                           * ((std::max(height, 1) + band_height_ - 1)
+                              / band_height_),
+                           params.parallel,
+                           params.scan_mode,
+                           params.led_rgb_sequence,
+                           params.inverse_colors,
+                           &map_)) {
+  // The Framebuffer created the map for its bands side by side; re-arrange
+  // them below each other, like ApplyPixelMapper() does.
+  width = std::max(width, 1);
+  height = std::max(height, 1);
+  internal::PixelDesignatorMap *const content_map
+    = new internal::PixelDesignatorMap(width, height);
+  for (int y = 0; y < height; ++y) {
+    const int band = y / band_height_;
+    for (int x = 0; x < width; ++x) {
+      *content_map->get(x, y) = *map_->get(band * width + x,
+                                           y % band_height_);
+    }
+  }
+  delete map_;
+  map_ = content_map;
+}
+WideCanvas::~WideCanvas() {
+  delete frame_;
+  delete map_;
+}
+void WideCanvas::SetBrightness(uint8_t brightness) {
+  frame_->SetBrightness(brightness);
+}
+uint8_t WideCanvas::brightness() { return frame_->brightness(); }
+void WideCanvas::SetPixels(int x, int y, int width, int height,
+                           const uint8_t *rgb) {
+  frame_->SetPixels(x, y, width, height, rgb);
+}
+void WideCanvas::SetPixelsBitmap(int x, int y, int width, int height,
+                                 const uint64_t *rows,
+                                 const uint8_t *foreground,
+                                 const uint8_t *background) {
+  frame_->SetPixelsBitmap(x, y, width, height, rows, foreground, background);
+}
+void WideCanvas::FillRect(int x, int y, int width, int height,
+                          uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, height, red, green, blue);
+}
+void WideCanvas::FillSpans(const int *spans, int count,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillSpans(spans, count, red, green, blue);
+}
+int WideCanvas::width() const { return frame_->width(); }
+int WideCanvas::height() const { return frame_->height(); }
+void WideCanvas::SetPixel(int x, int y,
+                          uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->SetPixel(x, y, red, green, blue);
+}
+void WideCanvas::Clear() { frame_->Clear(); }
+void WideCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->Fill(red, green, blue);
+}
 }  // end namespace rgb_matrix
@@ -0,0 +1,156 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "parallel-renderer.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "framebuffer-internal.h"
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+using internal::kRefreshCpu;
+
+namespace {
+// Tasks per thread; more than one, so that threads finishing early can
+// take over work from slower ones.
+static const int kTasksPerThread = 4;
+}  // namespace
+
+class ParallelRenderer::Worker : public Thread {
+public:
+  Worker(ParallelRenderer *renderer) : renderer_(renderer) {}
+  virtual void Run() { renderer_->WorkerLoop(); }
+
+private:
+  ParallelRenderer *const renderer_;
+};
+
+ParallelRenderer::ParallelRenderer(int threads)
+  : split_height_(-1), generation_(0), shutdown_(false),
+    job_(NULL), canvas_(NULL), next_task_(0), tasks_done_(0) {
+  pthread_cond_init(&work_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+  const int cpus = std::max(1, (int) sysconf(_SC_NPROCESSORS_ONLN));
+  if (threads < 0) {
+    threads = std::max(0, cpus - (cpus > kRefreshCpu ? 2 : 1));
+  }
+  uint32_t affinity_mask = 0;
+  if (cpus > kRefreshCpu) {
+    for (int i = 0; i < cpus && i < 32; ++i) {
+      if (i != kRefreshCpu) affinity_mask |= (1 << i);
+    }
+  }
+  for (int i = 0; i < threads; ++i) {
+    Worker *worker = new Worker(this);
+    worker->Start(0, affinity_mask);
+    workers_.push_back(worker);
+  }
+}
+
+ParallelRenderer::~ParallelRenderer() {
+  {
+    MutexLock l(&mutex_);
+    shutdown_ = true;
+    pthread_cond_broadcast(&work_cond_);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i]->WaitStopped();
+    delete workers_[i];
+  }
+  pthread_cond_destroy(&work_cond_);
+  pthread_cond_destroy(&done_cond_);
+}
+
+void ParallelRenderer::SplitRows(const FrameCanvas *canvas) {
+  std::vector<int> row_set;
+  const int sets = canvas->GetIndependentRows(&row_set);
+  const int height = row_set.size();
+  split_height_ = height;
+  ranges_.clear();
+  task_start_.clear();
+  if (height == 0) {
+    task_start_.push_back(0);
+    return;
+  }
+
+  std::vector<int> set_rows(sets, 0);
+  for (int y = 0; y < height; ++y) ++set_rows[row_set[y]];
+
+  // Put consecutive sets into one task until it has its share of the rows.
+  const int tasks = std::min(sets, kTasksPerThread * (threads() + 1));
+  std::vector<int> task_of_set(sets);
+  int task = 0, rows = 0;
+  for (int s = 0; s < sets; ++s) {
+    task_of_set[s] = task;
+    rows += set_rows[s];
+    if (rows * tasks >= (task + 1) * height) ++task;
+  }
+
+  // Collect the rows of each task into ranges of adjacent rows.
+  for (int t = 0; t < tasks; ++t) {
+    task_start_.push_back(ranges_.size());
+    for (int y = 0; y < height; ++y) {
+      if (task_of_set[row_set[y]] != t) continue;
+      if (ranges_.size() > (size_t) task_start_.back() && ranges_.back() == y) {
+        ranges_.back() = y + 1;
+      } else {
+        ranges_.push_back(y);
+        ranges_.push_back(y + 1);
+      }
+    }
+  }
+  task_start_.push_back(ranges_.size());
+}
+
+void ParallelRenderer::RunTasks() {
+  const int tasks = task_start_.size() - 1;
+  for (;;) {
+    int task;
+    {
+      MutexLock l(&mutex_);
+      if (next_task_ >= tasks) return;
+      task = next_task_++;
+    }
+    for (int i = task_start_[task]; i < task_start_[task + 1]; i += 2)
+      job_->RenderRows(canvas_, ranges_[i], ranges_[i + 1]);
+    MutexLock l(&mutex_);
+    if (++tasks_done_ == tasks) pthread_cond_signal(&done_cond_);
+  }
+}
+
+void ParallelRenderer::WorkerLoop() {
+  int seen_generation = 0;
+  for (;;) {
+    {
+      MutexLock l(&mutex_);
+      while (generation_ == seen_generation && !shutdown_)
+        mutex_.WaitOn(&work_cond_);
+      if (shutdown_) return;
+      seen_generation = generation_;
+    }
+    RunTasks();
+  }
+}
+
+void ParallelRenderer::Render(Job *job, FrameCanvas *canvas) {
+  if (split_height_ < 0) SplitRows(canvas);
+  const int tasks = task_start_.size() - 1;
+  if (tasks <= 0) return;
+  {
+    MutexLock l(&mutex_);
+    job_ = job;
+    canvas_ = canvas;
+    next_task_ = 0;
+    tasks_done_ = 0;
+    ++generation_;
+    pthread_cond_broadcast(&work_cond_);
+  }
+  RunTasks();   // Do our share.
+  MutexLock l(&mutex_);
+  while (tasks_done_ < tasks)
+    mutex_.WaitOn(&done_cond_);
+}
+
+}  // namespace rgb_matrix
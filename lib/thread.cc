@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
 namespace rgb_matrix {
 void *Thread::PthreadCallRun(void *tobject) {
@@ -40,6 +41,18 @@ void Thread::WaitStopped() {
   started_ = false;
 }
 
+bool Mutex::WaitOn(pthread_cond_t *cond, long timeout_ms) {
+  struct timespec abs_time;
+  clock_gettime(CLOCK_REALTIME, &abs_time);
+  abs_time.tv_sec += timeout_ms / 1000;
+  abs_time.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if (abs_time.tv_nsec >= 1000000000) {
+    abs_time.tv_sec += 1;
+    abs_time.tv_nsec -= 1000000000;
+  }
+  return pthread_cond_timedwait(cond, &mutex_, &abs_time) == 0;
+}
+
 void Thread::Start(int priority, uint32_t affinity_mask) {
   assert(!started_);  // Did you call WaitStopped() ?
   pthread_create(&thread_, NULL, &PthreadCallRun, this);
@@ -10,13 +10,17 @@
 #include "led-matrix.h"			// Llamada a bibliotecas necesarias
 #include "pixel-mapper.h"
 #include "content-streamer.h"
+#include "image-loader.h"
+#include "thread.h"
 
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -52,6 +56,7 @@ struct FileInfo {		// Estructura que define el tipo de archivo que maneja
   ImageParams params;      // Declara una variable de tipo estructura (ImageParams)
   bool is_multi_frame;	   // Variable booleana que contendra la informacion de si el archivo se trata de una animacion o una imagen
   rgb_matrix::StreamIO *content_stream;	// Declara una variable (content_stream), del tipo clase (StreamIO) biblioteca content-streamer.h
+  size_t memory;           // Bytes en memoria de content_stream (modo -M).
 };
 
 volatile bool interrupt_received = false;	// Declara una variable volatil global que rige la interrupcion de la funcion main
@@ -74,6 +79,24 @@ static void SleepMillis(tmillis_t milli_seconds) {	// Toma como entrada una vari
   nanosleep(&ts, NULL);		// Toma el tiempo calculado en ts como estructura y sera el que utilice para la detencion del programa
 }
 
+// Exporta todos los pixeles de "img" de una vez a "rgba", cuatro bytes por
+// pixel (rojo, verde, azul, alfa), fila a fila. Mucho mas rapido que pedir
+// cada pixel con pixelColor(), que crea un Magick::Color cada vez.
+static void ExportRGBA(const Magick::Image &img, std::vector<uint8_t> *rgba) {
+  const size_t count = img.columns() * img.rows();
+  rgba->resize(4 * count);
+  if (count == 0) return;
+  const Magick::PixelPacket *pixel
+    = img.getConstPixels(0, 0, img.columns(), img.rows());
+  uint8_t *out = &(*rgba)[0];
+  for (size_t i = 0; i < count; ++i, ++pixel, out += 4) {
+    out[0] = ScaleQuantumToChar(pixel->red);
+    out[1] = ScaleQuantumToChar(pixel->green);
+    out[2] = ScaleQuantumToChar(pixel->blue);
+    out[3] = 255 - ScaleQuantumToChar(pixel->opacity);  // 0: opaco
+  }
+}
+
 static void StoreInStream(const Magick::Image &img, int delay_time_us,	// Carga de ficheros y tiempo de retraso entre los mismos
                           bool do_center,	// Centrado de la imagen
                           rgb_matrix::FrameCanvas *scratch,		// Instruccion para exportar el fichero a una fuente externa
@@ -81,20 +104,43 @@ static void StoreInStream(const Magick::Image &img, int delay_time_us,	// Carga
   scratch->Clear();
   const int x_offset = do_center ? (scratch->width() - img.columns()) / 2 : 0;	// En caso de que se pida centrar la imagen,
   const int y_offset = do_center ? (scratch->height() - img.rows()) / 2 : 0;	// se modifica la posicion en x e y
-  for (size_t y = 0; y < img.rows(); ++y) {		// Barrido en el eje y
-    for (size_t x = 0; x < img.columns(); ++x) {	// Barrido en el eje x
-      const Magick::Color &c = img.pixelColor(x, y);	// Obtencion del color (c), x e y son variables de tamaño de la matriz
-      if (c.alphaQuantum() < 256) {								// Establece el color de cada pixel
-        scratch->SetPixel(x + x_offset, y + y_offset,	// Posicion del pixel a colorear
-                          ScaleQuantumToChar(c.redQuantum()),		// Rojo, conversion de cantidad a cadena
-                          ScaleQuantumToChar(c.greenQuantum()),		// Verde, ""
-                          ScaleQuantumToChar(c.blueQuantum()));		// Azul, ""
-      }
-    }
+  std::vector<uint8_t> rgba;
+  ExportRGBA(img, &rgba);	// Todos los pixeles de una vez
+  if (!rgba.empty()) {	// Los pixeles transparentes no se pintan
+    scratch->SetPixelsRGBA(x_offset, y_offset, img.columns(), img.rows(),
+                           &rgba[0]);
   }
   output->Stream(*scratch, delay_time_us);
 }
 
+// Igual que StoreInStream, pero guarda la imagen como RGB independiente de la
+// configuracion del panel (ver RGBStreamWriter en content-streamer.h).
+static void StoreInRGBStream(const Magick::Image &img, int delay_time_us,
+                             bool do_center, int width, int height,
+                             rgb_matrix::RGBStreamWriter *output) {
+  std::vector<uint8_t> rgb(3 * width * height, 0);
+  std::vector<uint8_t> rgba;
+  ExportRGBA(img, &rgba);
+  const int img_width = img.columns();
+  const int x_offset = do_center ? (width - img_width) / 2 : 0;
+  const int y_offset = do_center ? (height - (int)img.rows()) / 2 : 0;
+  const int x_start = std::max(0, -x_offset);
+  const int x_end = std::min(img_width, width - x_offset);
+  for (int y = 0; y < (int)img.rows() && x_end > x_start; ++y) {
+    const int out_y = y + y_offset;
+    if (out_y < 0 || out_y >= height) continue;
+    const uint8_t *in = &rgba[4 * (y * img_width + x_start)];
+    uint8_t *pixel = &rgb[3 * (out_y * width + x_start + x_offset)];
+    for (int x = x_start; x < x_end; ++x, in += 4, pixel += 3) {
+      if (in[3] != 0xff) continue;  // Transparente
+      pixel[0] = in[0];
+      pixel[1] = in[1];
+      pixel[2] = in[2];
+    }
+  }
+  output->Stream(&rgb[0], delay_time_us);
+}
+
 static void CopyStream(rgb_matrix::StreamReader *r,
                        rgb_matrix::StreamWriter *w,
                        rgb_matrix::FrameCanvas *scratch) {
@@ -104,6 +150,37 @@ static void CopyStream(rgb_matrix::StreamReader *r,
   }
 }
 
+// Tamaño al que escalar una imagen de "img_width" x "img_height", dado el
+// espacio disponible en "target_width" y "target_height".
+static void ComputeTargetSize(int img_width, int img_height,
+                              bool fill_width, bool fill_height,
+                              int *target_width, int *target_height) {
+  const float width_fraction = (float)*target_width / img_width;	// Escalado horizontal
+  const float height_fraction = (float)*target_height / img_height;	// Escalado vertical
+  if (fill_width && fill_height) {	// En caso de que se pida, la imagen se adapta en eje x e y al maximo de su capacidad
+    const float larger_fraction = (width_fraction > height_fraction)	// Condicion ancho > largo
+      ? width_fraction		// En caso de que se cumpla, larger_fraction toma el valor de width_fraction
+      : height_fraction;	// En caso contrario, toma el valor de height_fraction
+    *target_width = (int) roundf(larger_fraction * img_width);	// Redondeo del escalado de la imagen horizontal
+    *target_height = (int) roundf(larger_fraction * img_height);	// Redondeo del escalado de la imagen vertical
+  }
+  else if (fill_height) {
+    // Escalado de la imagen horizontal
+    *target_width = (int) roundf(height_fraction * img_width);	// Calculo de ancho como el redondeo del producto de ancho y escala unitaria
+  }
+  else if (fill_width) {
+    // Escalado de la imagen vertical
+    *target_height = (int) roundf(width_fraction * img_height);	// Calculo de alto "" alto y escala unitaria
+  }
+}
+
+// GraphicsMagick se inicializa la primera vez que hace falta, que puede ser
+// en cualquiera de los hilos de carga.
+static const char *magick_path = NULL;
+static pthread_once_t magick_once = PTHREAD_ONCE_INIT;
+static void InitMagick() { Magick::InitializeMagick(magick_path); }
+static void InitMagickOnce() { pthread_once(&magick_once, InitMagick); }
+
 // Carga la imagen actual
 // La escala, de forma que encaje en ancho y largo, guarda el valor en result.
 static bool LoadImageAndScale(const char *filename,		// Nombre del archivo
@@ -111,6 +188,7 @@ static bool LoadImageAndScale(const char *filename,		// Nombre del archivo
                               bool fill_width, bool fill_height,	// Llenado vertical/horizontal
                               std::vector<Magick::Image> *result,	// Toma los valores del fichero y lo almacena en *result (vector)
                               std::string *err_msg) {	// Error como cadena de caracteres
+  InitMagickOnce();
   std::vector<Magick::Image> frames;	// Genera un vector (frames) que contiene las imagenes cargadas
   try {									// Estructura de excepcion. El programa leera imagenes hasta que se produzca una excepcion.
     readImages(&frames, filename);		
@@ -130,31 +208,213 @@ static bool LoadImageAndScale(const char *filename,		// Nombre del archivo
     result->push_back(frames[0]);   // En caso de ser una imagen unica, result toma el valor 0
   }
 
-  const int img_width = (*result)[0].columns();	// Ancho de la imagen almacenada en result
-  const int img_height = (*result)[0].rows();	// Altura de la imagen almacenada en result
-  const float width_fraction = (float)target_width / img_width;	// Escalado horizontal
-  const float height_fraction = (float)target_height / img_height;	// Escalado vertical
-  if (fill_width && fill_height) {	// En caso de que se pida, la imagen se adapta en eje x e y al maximo de su capacidad
-    const float larger_fraction = (width_fraction > height_fraction)	// Condicion ancho > largo
-      ? width_fraction		// En caso de que se cumpla, larger_fraction toma el valor de width_fraction
-      : height_fraction;	// En caso contrario, toma el valor de height_fraction
-    target_width = (int) roundf(larger_fraction * img_width);	// Redondeo del escalado de la imagen horizontal
-    target_height = (int) roundf(larger_fraction * img_height);	// Redondeo del escalado de la imagen vertical
+  ComputeTargetSize((*result)[0].columns(), (*result)[0].rows(),
+                    fill_width, fill_height, &target_width, &target_height);
+  for (size_t i = 0; i < result->size(); ++i) {	// Asigna a cada elemento de result de tipo imagen el tamaño obtenido previamente
+    (*result)[i].scale(Magick::Geometry(target_width, target_height));	// como target_height y target_width
   }
-  else if (fill_height) {
-    // Escalado de la imagen horizontal
-    target_width = (int) roundf(height_fraction * img_width);	// Calculo de ancho como el redondeo del producto de ancho y escala unitaria
+
+  return true;
+}
+
+// Igual que LoadImageAndScale(), para los formatos sencillos que se leen sin
+// GraphicsMagick (ver image-loader.h). Mucho mas rapido con imagenes pequeñas.
+static bool LoadNativeImageAndScale(const char *filename,
+                                    int target_width, int target_height,
+                                    bool fill_width, bool fill_height,
+                                    rgb_matrix::RGBImage *result,
+                                    std::string *err_msg) {
+  rgb_matrix::RGBImage img;
+  // Los ficheros raw no tienen cabecera; se espera el tamaño del panel.
+  if (!rgb_matrix::LoadNativeImage(filename, target_width, target_height,
+                                   &img, err_msg)) {
+    return false;
   }
-  else if (fill_width) {
-    // Escalado de la imagen vertical
-    target_height = (int) roundf(width_fraction * img_height);	// Calculo de alto "" alto y escala unitaria
+  ComputeTargetSize(img.width, img.height, fill_width, fill_height,
+                    &target_width, &target_height);
+  // Como Magick::Geometry, se mantiene la proporcion dentro de ese tamaño.
+  const float fraction = std::min((float)target_width / img.width,
+                                  (float)target_height / img.height);
+  const int width = std::max(1, (int) roundf(fraction * img.width));
+  const int height = std::max(1, (int) roundf(fraction * img.height));
+  if (width == img.width && height == img.height) {
+    result->width = width;
+    result->height = height;
+    result->pixels.swap(img.pixels);
+  } else {
+    rgb_matrix::ScaleImage(img, width, height, result);
   }
+  return true;
+}
 
-  for (size_t i = 0; i < result->size(); ++i) {	// Asigna a cada elemento de result de tipo imagen el tamaño obtenido previamente
-    (*result)[i].scale(Magick::Geometry(target_width, target_height));	// como target_height y target_width
+// Guarda todos los frames de "image_sequence" en "out" o, si se da,
+// como RGB en "rgb_out".
+static void StoreImageSequence(const std::vector<Magick::Image> &image_sequence,
+                               const ImageParams &params, bool do_center,
+                               rgb_matrix::FrameCanvas *scratch,
+                               rgb_matrix::StreamWriter *out,
+                               rgb_matrix::RGBStreamWriter *rgb_out) {
+  const bool is_multi_frame = image_sequence.size() > 1;
+  for (size_t i = 0; i < image_sequence.size(); ++i) {
+    const Magick::Image &img = image_sequence[i];
+    int64_t delay_time_us;		// Declara el tiempo entre muestra de archivos en us
+    if (is_multi_frame) {	// Comprobacion de si el archivo se trata de una animacion
+      delay_time_us = img.animationDelay() * 10000; // En caso de tratarse de un gif, lo muestra 10000 us
+    } else {
+      delay_time_us = params.wait_ms * 1000;  // En caso de ser una imagen, lo muestra 1500*1000 us
+    }
+    if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // Si el tiempo entre muestra de archivos es inferior a 0.1s, lo fija a este valor
+    if (rgb_out) {
+      StoreInRGBStream(img, delay_time_us, do_center,
+                       scratch->width(), scratch->height(), rgb_out);
+    } else {
+      StoreInStream(img, delay_time_us, do_center, scratch, out);
+    }
   }
+}
 
-  return true;
+// Igual que StoreImageSequence(), para una imagen leida con LoadNativeImage().
+// Los pixeles ya estan en el formato del canvas, se copian de una vez.
+static void StoreNativeImage(const rgb_matrix::RGBImage &img,
+                             const ImageParams &params, bool do_center,
+                             rgb_matrix::FrameCanvas *scratch,
+                             rgb_matrix::StreamWriter *out,
+                             rgb_matrix::RGBStreamWriter *rgb_out) {
+  int64_t delay_time_us = params.wait_ms * 1000;
+  if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // Minimo 0.1s
+  const int width = scratch->width();
+  const int height = scratch->height();
+  const int x_offset = do_center ? (width - img.width) / 2 : 0;
+  const int y_offset = do_center ? (height - img.height) / 2 : 0;
+  if (rgb_out) {
+    std::vector<uint8_t> rgb(3 * width * height, 0);
+    const int x_start = std::max(0, -x_offset);
+    const int x_end = std::min(img.width, width - x_offset);
+    for (int y = 0; y < img.height && x_end > x_start; ++y) {
+      const int out_y = y + y_offset;
+      if (out_y < 0 || out_y >= height) continue;
+      memcpy(&rgb[3 * (out_y * width + x_start + x_offset)],
+             &img.pixels[3 * (y * img.width + x_start)],
+             3 * (x_end - x_start));
+    }
+    rgb_out->Stream(&rgb[0], delay_time_us);
+  } else {
+    scratch->Clear();
+    scratch->SetPixels(x_offset, y_offset, img.width, img.height,
+                       &img.pixels[0]);
+    out->Stream(*scratch, delay_time_us);
+  }
+}
+
+// Resultado de preparar un fichero; se hace en paralelo para todos.
+struct PreloadedFile {
+  PreloadedFile() : filename(NULL), loaded(false), is_multi_frame(false),
+                    is_native(false), content_stream(NULL), saved_bytes(0),
+                    memory(0) {}
+  const char *filename;
+  ImageParams params;
+  bool loaded;                 // LoadImageAndScale() ha funcionado.
+  bool is_multi_frame;
+  bool is_native;              // Cargado en native_image, no en image_sequence.
+  std::string err_msg;
+  std::vector<Magick::Image> image_sequence;  // Si aun no esta convertido.
+  rgb_matrix::RGBImage native_image;          // Si aun no esta convertido.
+  rgb_matrix::StreamIO *content_stream;       // Convertido, si no es NULL.
+  size_t saved_bytes;
+  size_t memory;               // Bytes que ocupa content_stream en memoria.
+};
+
+static void StoreLoadedFile(PreloadedFile *file, bool do_center,
+                            rgb_matrix::FrameCanvas *scratch,
+                            rgb_matrix::StreamWriter *out,
+                            rgb_matrix::RGBStreamWriter *rgb_out) {
+  if (file->is_native) {
+    StoreNativeImage(file->native_image, file->params, do_center,
+                     scratch, out, rgb_out);
+  } else {
+    StoreImageSequence(file->image_sequence, file->params, do_center,
+                       scratch, out, rgb_out);
+  }
+  // Ya no hacen falta.
+  file->image_sequence.clear();
+  std::vector<uint8_t>().swap(file->native_image.pixels);
+}
+
+static bool IsLiveStream(const char *filename);
+
+// Carga y escala "file" y, con "convert", lo convierte a un MemStreamIO.
+static void PreloadFile(PreloadedFile *file, rgb_matrix::FrameCanvas *scratch,
+                        bool fill_width, bool fill_height, bool do_center,
+                        bool convert) {
+  if (IsLiveStream(file->filename)) return;  // Se lee en directo.
+  file->is_native = rgb_matrix::IsNativeImage(file->filename)
+    && LoadNativeImageAndScale(file->filename,
+                               scratch->width(), scratch->height(),
+                               fill_width, fill_height,
+                               &file->native_image, &file->err_msg);
+  if (file->is_native) {
+    file->loaded = true;
+  } else {
+    // Lo que no se puede leer directamente se intenta con GraphicsMagick.
+    file->loaded = LoadImageAndScale(file->filename,
+                                     scratch->width(), scratch->height(),
+                                     fill_width, fill_height,
+                                     &file->image_sequence, &file->err_msg);
+  }
+  file->is_multi_frame = file->image_sequence.size() > 1;
+  if (!file->loaded || !convert) return;
+  rgb_matrix::MemStreamIO *stream = new rgb_matrix::MemStreamIO();
+  // Solo en memoria, asi que los frames repetidos se guardan una vez.
+  rgb_matrix::StreamWriter out(stream, false, true);
+  StoreLoadedFile(file, do_center, scratch, &out, NULL);
+  file->content_stream = stream;
+  file->saved_bytes = out.saved_bytes();
+  file->memory = stream->size();
+}
+
+// Hilo que carga, escala y convierte ficheros hasta que no quede ninguno.
+// Cada hilo coge el siguiente fichero de la lista; los resultados quedan en
+// su sitio, asi que el orden no cambia.
+class PreloadThread : public rgb_matrix::Thread {
+public:
+  PreloadThread(std::vector<PreloadedFile> *files, size_t *next_file,
+                rgb_matrix::Mutex *mutex, rgb_matrix::FrameCanvas *scratch,
+                bool fill_width, bool fill_height, bool do_center,
+                bool convert)
+    : files_(files), next_file_(next_file), mutex_(mutex), scratch_(scratch),
+      fill_width_(fill_width), fill_height_(fill_height),
+      do_center_(do_center), convert_(convert) {}
+
+  virtual void Run() {
+    for (;;) {
+      PreloadedFile *file;
+      {
+        rgb_matrix::MutexLock l(mutex_);
+        if (*next_file_ >= files_->size()) return;
+        file = &(*files_)[(*next_file_)++];
+      }
+      PreloadFile(file, scratch_, fill_width_, fill_height_, do_center_,
+                  convert_);
+    }
+  }
+
+private:
+  std::vector<PreloadedFile> *const files_;
+  size_t *const next_file_;
+  rgb_matrix::Mutex *const mutex_;
+  rgb_matrix::FrameCanvas *const scratch_;
+  const bool fill_width_;
+  const bool fill_height_;
+  const bool do_center_;
+  const bool convert_;
+};
+
+// Tuberias con nombre y sockets se leen directamente como stream, sin
+// intentar cargarlos antes como imagen (eso consumiria los datos).
+static bool IsLiveStream(const char *filename) {
+  struct stat sb;
+  return stat(filename, &sb) == 0
+    && (S_ISFIFO(sb.st_mode) || S_ISSOCK(sb.st_mode));
 }
 
 // Funcion para la muestra de animaciones Gif
@@ -184,16 +444,306 @@ void DisplayAnimation(const FileInfo *file,		// Declara la variable file, de tip
       const tmillis_t time_already_spent = GetTimeInMillis() - start_wait_ms;	// Tiempo pasado desde la ejecucion se calcula como tiempo actual - tiempo de inicio
       SleepMillis(anim_delay_ms - time_already_spent);	// Tiempo de parada de la funcion main establecido como tiempo de retraso menos tiempo de ejecucion
     }
+    if (!file->content_stream->IsSeekable())
+      break;  // Stream en directo: no se puede volver a empezar.
     reader.Rewind();
   }
 }
 
+// Muestra el maximo de memoria usada por el proceso, para comparar la carga
+// completa al principio con la carga perezosa (-M).
+static void PrintPeakMemory() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    fprintf(stderr, "Pico de memoria (RSS): %.1f MiB\n",
+            usage.ru_maxrss / 1024.0);
+  }
+}
+
+// Abre "filename", que no es una imagen, como stream: fichero, tuberia o
+// socket. Los streams RGB se convierten a la configuracion actual (con
+// cache). Si se da "out", se copia ahi su contenido. Devuelve NULL si no es
+// posible, con el motivo en "err_msg" (si no lo dice ya).
+static FileInfo *OpenStreamEntry(const char *filename,
+                                 const ImageParams &params,
+                                 FrameCanvas *scratch,
+                                 rgb_matrix::StreamWriter *out,
+                                 rgb_matrix::RGBStreamWriter *rgb_out,
+                                 std::string *err_msg) {
+  rgb_matrix::StreamIO *content_stream
+    = rgb_matrix::OpenStreamFile(filename, scratch);
+  if (content_stream == NULL)
+    return NULL;
+  FileInfo *file_info = new FileInfo();
+  file_info->params = params;
+  file_info->content_stream = content_stream;
+  if (!content_stream->IsSeekable()) {
+    // Tuberia o socket: no se puede leer por adelantado, solo en directo.
+    file_info->is_multi_frame = true;
+    if (out) {
+      StreamReader reader(file_info->content_stream);
+      CopyStream(&reader, out, scratch);
+    }
+    return file_info;
+  }
+  StreamReader reader(file_info->content_stream);
+  if (!reader.GetNext(scratch, NULL)) {  // header+size no validos
+    *err_msg = "No se puede leer como una imagen compatible";
+    delete file_info->content_stream;
+    delete file_info;
+    return NULL;
+  }
+  file_info->is_multi_frame = reader.GetNext(scratch, NULL);
+  reader.Rewind();
+  // Los streams RGB se convierten en memoria; eso cuenta para el limite de -M.
+  if (rgb_matrix::MemStreamIO *mem
+      = dynamic_cast<rgb_matrix::MemStreamIO*>(content_stream)) {
+    file_info->memory = mem->size();
+  }
+  if (out) {
+    CopyStream(&reader, out, scratch);
+  } else if (rgb_out) {
+    fprintf(stderr, "%s: los streams no se pueden convertir a RGB\n",
+            filename);
+  }
+  return file_info;
+}
+
+// Una entrada de la lista de reproduccion en el modo de carga perezosa.
+struct PlaylistEntry {
+  const char *filename;
+  ImageParams params;
+};
+
+// Modo de carga perezosa (-M): en vez de cargar todo al principio, un hilo
+// prepara en segundo plano las entradas que se van a mostrar a continuacion.
+// Las ya convertidas se guardan en una cache LRU; si se supera el limite de
+// memoria, se liberan las que hace mas tiempo que se usaron.
+class PlaylistLoader : public rgb_matrix::Thread {
+public:
+  PlaylistLoader(const std::vector<PlaylistEntry> &entries,
+                 size_t memory_budget, FrameCanvas *scratch,
+                 bool fill_width, bool fill_height, bool do_center)
+    : entries_(entries), slots_(entries.size()),
+      memory_budget_(memory_budget), scratch_(scratch),
+      fill_width_(fill_width), fill_height_(fill_height),
+      do_center_(do_center), running_(true), use_count_(0),
+      memory_used_(0), peak_memory_(0) {
+    pthread_cond_init(&changed_, NULL);
+  }
+
+  virtual ~PlaylistLoader() {
+    mutex_.Lock();
+    running_ = false;
+    pthread_cond_broadcast(&changed_);
+    mutex_.Unlock();
+    WaitStopped();
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      if (slots_[i].file) delete slots_[i].file->content_stream;
+      delete slots_[i].file;
+    }
+    pthread_cond_destroy(&changed_);
+  }
+
+  // Las siguientes entradas en mostrarse, empezando por la actual. Se
+  // cargan en ese orden y no se liberan mientras esten en esta lista.
+  void SetUpcoming(const std::vector<int> &upcoming) {
+    rgb_matrix::MutexLock l(&mutex_);
+    upcoming_ = upcoming;
+    pthread_cond_broadcast(&changed_);
+  }
+
+  // Devuelve la entrada "index", esperando si aun no esta lista. Devuelve
+  // NULL si no se ha podido cargar. Debe estar en la lista de SetUpcoming().
+  FileInfo *Get(int index) {
+    rgb_matrix::MutexLock l(&mutex_);
+    while (!slots_[index].loaded)
+      mutex_.WaitOn(&changed_);
+    slots_[index].last_use = ++use_count_;
+    return slots_[index].file;
+  }
+
+  size_t peak_memory() {
+    rgb_matrix::MutexLock l(&mutex_);
+    return peak_memory_;
+  }
+
+  virtual void Run() {
+    mutex_.Lock();
+    while (running_) {
+      const int index = NextToLoad();
+      if (index < 0) {
+        mutex_.WaitOn(&changed_);
+        continue;
+      }
+      mutex_.Unlock();
+      // La carga se hace sin bloquear; la entrada no se usa mientras tanto.
+      FileInfo *file = Load(entries_[index]);
+      mutex_.Lock();
+      Slot &slot = slots_[index];
+      slot.loaded = true;
+      slot.file = file;
+      slot.memory = file ? file->memory : 0;
+      slot.last_use = ++use_count_;
+      memory_used_ += slot.memory;
+      peak_memory_ = std::max(peak_memory_, memory_used_);
+      EvictOverBudget();
+      pthread_cond_broadcast(&changed_);
+    }
+    mutex_.Unlock();
+  }
+
+private:
+  struct Slot {
+    Slot() : loaded(false), file(NULL), memory(0), last_use(0) {}
+    bool loaded;
+    FileInfo *file;     // NULL si no se ha podido cargar.
+    size_t memory;
+    uint64_t last_use;
+  };
+
+  // Siguiente entrada a cargar o -1. La actual siempre; las siguientes
+  // solo mientras quede memoria.
+  int NextToLoad() {
+    for (size_t i = 0; i < upcoming_.size(); ++i) {
+      if (i > 0 && memory_used_ >= memory_budget_) return -1;
+      if (!slots_[upcoming_[i]].loaded) return upcoming_[i];
+    }
+    return -1;
+  }
+
+  void EvictOverBudget() {
+    while (memory_used_ > memory_budget_) {
+      int oldest = -1;
+      for (size_t i = 0; i < slots_.size(); ++i) {
+        const Slot &slot = slots_[i];
+        if (!slot.loaded || slot.memory == 0) continue;
+        if (std::find(upcoming_.begin(), upcoming_.end(), (int)i)
+            != upcoming_.end()) {
+          continue;
+        }
+        if (oldest < 0 || slot.last_use < slots_[oldest].last_use)
+          oldest = i;
+      }
+      if (oldest < 0) return;  // Todo lo que queda se va a usar ahora.
+      Slot &slot = slots_[oldest];
+      delete slot.file->content_stream;
+      delete slot.file;
+      memory_used_ -= slot.memory;
+      slot = Slot();
+    }
+  }
+
+  FileInfo *Load(const PlaylistEntry &entry) {
+    PreloadedFile loaded;
+    loaded.filename = entry.filename;
+    loaded.params = entry.params;
+    PreloadFile(&loaded, scratch_, fill_width_, fill_height_, do_center_,
+                true);
+    std::string err_msg = loaded.err_msg;
+    FileInfo *file = NULL;
+    if (loaded.loaded) {
+      file = new FileInfo();
+      file->params = entry.params;
+      file->is_multi_frame = loaded.is_multi_frame;
+      file->content_stream = loaded.content_stream;
+      file->memory = loaded.memory;
+    } else {
+      file = OpenStreamEntry(entry.filename, entry.params, scratch_,
+                             NULL, NULL, &err_msg);
+    }
+    if (file == NULL) {
+      fprintf(stderr, "%s saltado: No se ha podido abrir (%s)\n",
+              entry.filename, err_msg.c_str());
+    }
+    return file;
+  }
+
+  const std::vector<PlaylistEntry> entries_;
+  std::vector<Slot> slots_;
+  const size_t memory_budget_;
+  FrameCanvas *const scratch_;
+  const bool fill_width_;
+  const bool fill_height_;
+  const bool do_center_;
+
+  rgb_matrix::Mutex mutex_;
+  pthread_cond_t changed_;
+  bool running_;
+  std::vector<int> upcoming_;
+  uint64_t use_count_;
+  size_t memory_used_;
+  size_t peak_memory_;
+};
+
+// Muestra "entries" con carga perezosa: cada entrada se convierte cuando
+// toca (o antes, con las "prefetch" siguientes) y se guarda en una cache de
+// como mucho "memory_budget" bytes.
+static void DisplayPlaylistLazily(const std::vector<PlaylistEntry> &entries,
+                                  size_t memory_budget, int prefetch,
+                                  bool do_forever, bool do_shuffle,
+                                  bool fill_width, bool fill_height,
+                                  bool do_center, uint32_t loader_affinity,
+                                  RGBMatrix *matrix,
+                                  FrameCanvas *offscreen_canvas,
+                                  int vsync_multiple) {
+  const tmillis_t start_ms = GetTimeInMillis();
+  PlaylistLoader loader(entries, memory_budget, matrix->CreateFrameCanvas(),
+                        fill_width, fill_height, do_center);
+  loader.Start(0, loader_affinity);
+
+  std::vector<int> order(entries.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  bool first_frame = true;
+  int gaps = 0;
+  tmillis_t max_gap_ms = 0;
+  do {
+    if (do_shuffle) {
+      std::random_shuffle(order.begin(), order.end());
+    }
+    for (size_t i = 0; i < order.size() && !interrupt_received; ++i) {
+      // Con -s el orden de la siguiente vuelta aun no se conoce.
+      std::vector<int> upcoming;
+      for (size_t k = i; k <= i + (size_t)prefetch; ++k) {
+        if (k >= order.size() && (!do_forever || do_shuffle)) break;
+        const int index = order[k % order.size()];
+        if (std::find(upcoming.begin(), upcoming.end(), index)
+            == upcoming.end()) {
+          upcoming.push_back(index);
+        }
+      }
+      loader.SetUpcoming(upcoming);
+      const tmillis_t wait_start_ms = GetTimeInMillis();
+      const FileInfo *file = loader.Get(order[i]);
+      const tmillis_t waited_ms = GetTimeInMillis() - wait_start_ms;
+      if (file == NULL) continue;
+      if (first_frame) {
+        fprintf(stderr, "Primer frame tras %.3fs.\n",
+                (GetTimeInMillis() - start_ms) / 1000.0);
+        first_frame = false;
+      } else if (waited_ms > 0) {
+        // La entrada no estaba lista a tiempo: hueco visible.
+        ++gaps;
+        max_gap_ms = std::max(max_gap_ms, waited_ms);
+      }
+      DisplayAnimation(file, matrix, offscreen_canvas, vsync_multiple);
+    }
+  } while (do_forever && !interrupt_received);
+
+  fprintf(stderr, "Carga perezosa: pico de cache %.1f MiB (limite %.1f MiB); "
+          "%d huecos entre entradas (max %lld ms).\n",
+          loader.peak_memory() / 1048576.0, memory_budget / 1048576.0,
+          gaps, (long long)max_gap_ms);
+}
+
 static int usage(const char *progname) {
   fprintf(stderr, "usage: %s [options] <image> [option] [<image> ...]\n",
           progname);
 
   fprintf(stderr, "Opciones:\n"
           "\t-O<streamfile>            : Output to stream-file instead of matrix (Don't need to be root).\n"
+          "\t-G                        : Con -O: genera un stream RGB independiente de la configuracion del panel.\n"
+          "\t-d                        : Con -O: guarda solo los cambios entre frames (relojes, rotulos).\n"
           "\t-C                        : Centra imagenes.\n"
 
           "\nEstas opciones afectan a las imagenes siguientes en la linea de comandos:\n"
@@ -211,6 +761,9 @@ static int usage(const char *progname) {
           "\t-f                        : "
           "Ciclo perpetuo entre todos los ficheros de la linea de comandos.\n"
           "\t-s                        : Si se aportan varias imagenes, se mezclan al mostrarse.\n"
+          "\t-M<MiB>                   : Carga perezosa: no carga todo al principio, sino cada fichero\n"
+          "\t                            cuando toca, guardando los ya convertidos hasta este limite.\n"
+          "\t-N<count>                 : Con -M: ficheros a preparar por adelantado (por defecto: 2).\n"
           "\nDisplay Options:\n"
           "\t-V<vsync-multiple>        : Expert: Only do frame vsync-swaps on multiples of refresh (default: 1)\n"
           );
@@ -232,8 +785,6 @@ static int usage(const char *progname) {
 }
 
 int main(int argc, char *argv[]) {	// Programa principal, argumentos de entrada representan la cantidad de argumentos que pretendemos pasarle a main
-  Magick::InitializeMagick(*argv);	// Inicializacion de la biblioteca Magick
-
   RGBMatrix::Options matrix_options;	// Carga las opciones de matriz de led-matrix.h
   rgb_matrix::RuntimeOptions runtime_opt;	// Carga las opciones de inicializacion de matriz de led-matrix.h
   if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,	// La funcion ParseOptionsFromFlags devuelve True si detecta un fallo en los argumentos
@@ -256,9 +807,13 @@ int main(int argc, char *argv[]) {	// Programa principal, argumentos de entrada
   }
 
   const char *stream_output = NULL;
+  bool rgb_stream_output = false;
+  bool delta_stream_output = false;
+  int memory_budget_mb = 0;	// Con -M: carga perezosa con este limite
+  int prefetch = 2;	// Entradas que se preparan por adelantado con -M
 
   int opt;	// Declaracion de la variable opt
-  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:V:D:")) != -1) {	// Parametros para la muestra de ficheros
+  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:GdV:D:M:N:")) != -1) {	// Parametros para la muestra de ficheros
     switch (opt) {	// Estructura de posibles casos para cada argumento de entrada para opt
     case 'w':	// Tiempo de espera entre imagenes
       img_param.wait_ms = roundf(atof(optarg) * 1000.0f); // Conversion a ms, cadena a doble y redondeo
@@ -306,6 +861,18 @@ int main(int argc, char *argv[]) {	// Programa principal, argumentos de entrada
     case 'O':	// Caso de que se pretenda exportar el fichero fuera de la matriz led
       stream_output = strdup(optarg);	
       break;
+    case 'G':	// Salida externa en formato RGB, independiente del panel
+      rgb_stream_output = true;
+      break;
+    case 'd':	// Salida externa guardando solo los cambios entre frames
+      delta_stream_output = true;
+      break;
+    case 'M':	// Carga perezosa con limite de memoria en MiB
+      memory_budget_mb = atoi(optarg);
+      break;
+    case 'N':	// Numero de entradas a preparar por adelantado
+      prefetch = std::max(0, atoi(optarg));
+      break;
     case 'V':
       vsync_multiple = atoi(optarg);	// Convierte cadena a entero
       if (vsync_multiple < 1) vsync_multiple = 1;	// Opcion de VSync
@@ -327,6 +894,16 @@ int main(int argc, char *argv[]) {	// Programa principal, argumentos de entrada
     return usage(argv[0]);	// Vuelve a usage, para que se vuelva a introducir la informacion deseada
   }
 
+  // GraphicsMagick solo hace falta para los formatos que no leemos nosotros.
+  // Si ya se sabe que hara falta, se inicializa aqui y no en la carga.
+  magick_path = argv[0];
+  for (int imgarg = optind; imgarg < argc; ++imgarg) {
+    if (!IsLiveStream(argv[imgarg]) && !rgb_matrix::IsNativeImage(argv[imgarg])) {
+      InitMagickOnce();	// Inicializacion de la biblioteca Magick
+      break;
+    }
+  }
+
   // Preparacion de la matriz
   runtime_opt.do_gpio_init = (stream_output == NULL);
   RGBMatrix *matrix = CreateMatrixFromOptions(matrix_options, runtime_opt);	// Valores de la matriz
@@ -346,66 +923,117 @@ int main(int argc, char *argv[]) {	// Programa principal, argumentos de entrada
   // En caso de pedirse salida externa, establece la salida externa objetivo.
   rgb_matrix::StreamIO *stream_io = NULL;
   rgb_matrix::StreamWriter *global_stream_writer = NULL;
+  rgb_matrix::RGBStreamWriter *global_rgb_writer = NULL;
   if (stream_output) {
     int fd = open(stream_output, O_CREAT|O_WRONLY, 0644);
     if (fd < 0) {
       perror("No se ha podido abrir la salida externa objetivo");
       return 1;
     }
-    stream_io = new rgb_matrix::FileStreamIO(fd);
-    global_stream_writer = new rgb_matrix::StreamWriter(stream_io);
+    // Sin buffer para pipes y sockets, para que se lean en directo.
+    if (lseek(fd, 0, SEEK_CUR) >= 0) {
+      stream_io = new rgb_matrix::BufferedFileStreamIO(fd);
+    } else {
+      stream_io = new rgb_matrix::FileStreamIO(fd);
+    }
+    if (rgb_stream_output) {
+      global_rgb_writer = new rgb_matrix::RGBStreamWriter(
+        stream_io, matrix->width(), matrix->height());
+    } else {
+      global_stream_writer = new rgb_matrix::StreamWriter(
+        stream_io, delta_stream_output);
+    }
+  }
+
+  const int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  // Todos los nucleos menos el ultimo, que es el del refresco de la matriz.
+  const uint32_t affinity = (cpus > 1) ? (1U << (cpus - 1)) - 1 : 0;
+
+  if (memory_budget_mb > 0 && !stream_output) {
+    signal(SIGTERM, InterruptHandler);
+    signal(SIGINT, InterruptHandler);
+    std::vector<PlaylistEntry> entries;
+    for (int imgarg = optind; imgarg < argc; ++imgarg) {
+      PlaylistEntry entry;
+      entry.filename = argv[imgarg];
+      entry.params = filename_params[argv[imgarg]];
+      // Los mismos ajustes que tras cargar todo (ver abajo).
+      if (filename_count == 1) {
+        entry.params.wait_ms = distant_future;
+      } else if (entry.params.loops < 0
+                 && entry.params.anim_duration_ms == distant_future) {
+        entry.params.loops = 1;
+      }
+      entries.push_back(entry);
+    }
+    DisplayPlaylistLazily(entries, (size_t)memory_budget_mb << 20, prefetch,
+                          do_forever, do_shuffle, fill_width, fill_height,
+                          do_center, affinity, matrix, offscreen_canvas,
+                          vsync_multiple);
+    if (interrupt_received) {
+      fprintf(stderr, "Señal recibida. Saliendo.\n");
+    }
+    PrintPeakMemory();
+    matrix->Clear();
+    delete matrix;
+    return 0;
   }
 
   const tmillis_t start_load = GetTimeInMillis();
   fprintf(stderr, "Cargando %d archivos...\n", argc - optind);
   //Se preparan los ficheron antes de mostrarlos, para evitar la ralentizacion del sistema
   std::vector<FileInfo*> file_imgs;
+  size_t saved_bytes = 0;  // No guardados en memoria por frames repetidos.
+
+  // Decodificar y convertir las imagenes en paralelo, en todos los nucleos
+  // de "affinity". Con salida externa solo se decodifican; se escriben despues
+  // en orden.
+  std::vector<PreloadedFile> preloaded(argc - optind);
   for (int imgarg = optind; imgarg < argc; ++imgarg) {
-    const char *filename = argv[imgarg];
+    preloaded[imgarg - optind].filename = argv[imgarg];
+    preloaded[imgarg - optind].params = filename_params[argv[imgarg]];
+  }
+  const int thread_count = std::max(1, std::min(cpus - 1,
+                                                (int)preloaded.size()));
+  rgb_matrix::Mutex preload_mutex;
+  size_t next_preload = 0;
+  std::vector<PreloadThread*> preload_threads;
+  for (int i = 0; i < thread_count; ++i) {
+    PreloadThread *t = new PreloadThread(&preloaded, &next_preload,
+                                         &preload_mutex,
+                                         matrix->CreateFrameCanvas(),
+                                         fill_width, fill_height, do_center,
+                                         stream_output == NULL);
+    t->Start(0, affinity);
+    preload_threads.push_back(t);
+  }
+  for (size_t i = 0; i < preload_threads.size(); ++i) {
+    delete preload_threads[i];  // Espera a que termine.
+  }
+
+  for (size_t f = 0; f < preloaded.size(); ++f) {
+    PreloadedFile &loaded = preloaded[f];
+    const char *filename = loaded.filename;
     FileInfo *file_info = NULL;
 
-    std::string err_msg;
-    std::vector<Magick::Image> image_sequence;
-    if (LoadImageAndScale(filename, matrix->width(), matrix->height(),
-                          fill_width, fill_height, &image_sequence, &err_msg)) {
+    std::string err_msg = loaded.err_msg;
+    if (loaded.loaded) {
       file_info = new FileInfo();
-      file_info->params = filename_params[filename];
-      file_info->content_stream = new rgb_matrix::MemStreamIO();
-      file_info->is_multi_frame = image_sequence.size() > 1;
-      rgb_matrix::StreamWriter out(file_info->content_stream);
-      for (size_t i = 0; i < image_sequence.size(); ++i) {
-        const Magick::Image &img = image_sequence[i];
-        int64_t delay_time_us;		// Declara el tiempo entre muestra de archivos en us
-        if (file_info->is_multi_frame) {	// Comprobacion de si el archivo se trata de una animacion
-          delay_time_us = img.animationDelay() * 10000; // En caso de tratarse de un gif, lo muestra 10000 us
-        } else {
-          delay_time_us = file_info->params.wait_ms * 1000;  // En caso de ser una imagen, lo muestra 1500*1000 us
-        }
-        if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // Si el tiempo entre muestra de archivos es inferior a 0.1s, lo fija a este valor
-        StoreInStream(img, delay_time_us, do_center, offscreen_canvas,
-                      global_stream_writer ? global_stream_writer : &out);
+      file_info->params = loaded.params;
+      file_info->is_multi_frame = loaded.is_multi_frame;
+      if (loaded.content_stream) {
+        file_info->content_stream = loaded.content_stream;
+        saved_bytes += loaded.saved_bytes;
+      } else {
+        file_info->content_stream = new rgb_matrix::MemStreamIO();
+        StoreLoadedFile(&loaded, do_center, offscreen_canvas,
+                        global_stream_writer, global_rgb_writer);
       }
     } else {
-      // En caso de no resultar ser una imagen, prueba con una fuente externa
-      int fd = open(filename, O_RDONLY);
-      if (fd >= 0) {
-        file_info = new FileInfo();
-        file_info->params = filename_params[filename];
-        file_info->content_stream = new rgb_matrix::FileStreamIO(fd);
-        StreamReader reader(file_info->content_stream);
-        if (reader.GetNext(offscreen_canvas, NULL)) {  // header+size ok
-          file_info->is_multi_frame = reader.GetNext(offscreen_canvas, NULL);
-          reader.Rewind();
-          if (global_stream_writer) {
-            CopyStream(&reader, global_stream_writer, offscreen_canvas);
-          }
-        } else {
-          err_msg = "No se puede leer como una imagen compatible";
-          delete file_info->content_stream;
-          delete file_info;
-          file_info = NULL;
-        }
-      }
+      // En caso de no resultar ser una imagen, prueba con una fuente externa.
+      file_info = OpenStreamEntry(filename, loaded.params, offscreen_canvas,
+                                  global_stream_writer, global_rgb_writer,
+                                  &err_msg);
     }
 
     if (file_info) {
@@ -418,6 +1046,7 @@ int main(int argc, char *argv[]) {	// Programa principal, argumentos de entrada
 
   if (stream_output) {
     delete global_stream_writer;
+    delete global_rgb_writer;
     delete stream_io;
     if (file_imgs.size()) {
       fprintf(stderr, "Realizado: Salida externa %s; "
@@ -427,6 +1056,8 @@ int main(int argc, char *argv[]) {	// Programa principal, argumentos de entrada
       fprintf(stderr, "Nota: -s (mezcla) no tiene efecto al generarse archivos externos.\n");
     if (do_forever)
       fprintf(stderr, "Nota: -f (bucle perpetuo) no tiene efecto al generarse archivos externos.\n");
+    if (memory_budget_mb > 0)
+      fprintf(stderr, "Nota: -M (carga perezosa) no tiene efecto al generarse archivos externos.\n");
     // Si llega a este punto no se mostrara nada en pantalla
     return 0;
   }
@@ -449,8 +1080,12 @@ int main(int argc, char *argv[]) {	// Programa principal, argumentos de entrada
     }
   }
 
-  fprintf(stderr, "Loading took %.3fs; now: Display.\n",
-          (GetTimeInMillis() - start_load) / 1000.0);
+  fprintf(stderr, "Loading took %.3fs (%d threads); now: Display.\n",
+          (GetTimeInMillis() - start_load) / 1000.0, thread_count);
+  if (saved_bytes > 0) {
+    fprintf(stderr, "Frames repetidos: %.1f KiB ahorrados en memoria.\n",
+            saved_bytes / 1024.0);
+  }
 
   signal(SIGTERM, InterruptHandler);	// Termina la señal, libreria propia de c
   signal(SIGINT, InterruptHandler);		// Interrumpe la señal, libreria propia de c
@@ -468,6 +1103,7 @@ int main(int argc, char *argv[]) {	// Programa principal, argumentos de entrada
   if (interrupt_received) {	// En caso de recibir señal de interrupcion, se detiene el programa
     fprintf(stderr, "Señal recibida. Saliendo.\n");	// Aviso de interrupcion
   }
+  PrintPeakMemory();
 
   // Animacion terminada. Apagado de la matriz
   matrix->Clear();	// Limpiado de la matriz, puesta a 0 de todos los pixeles
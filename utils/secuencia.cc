@@ -1,414 +1,1171 @@
-// Previamente se debe haber instalado: image-magick development files
-// $ sudo apt-get install libgraphicsmagick++-dev libwebp-dev
-
-// Compilar con make secuencia
-
-#include "led-matrix.h"
-#include "pixel-mapper.h"
-#include "content-streamer.h"
-
-#include <fcntl.h>
-#include <math.h>
-#include <signal.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/stat.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-#include <algorithm>
-#include <map>
-#include <string>
-#include <vector>
-
-#include <Magick++.h>
-#include <magick/image.h>
-
-using rgb_matrix::GPIO;
-using rgb_matrix::Canvas;
-using rgb_matrix::FrameCanvas;
-using rgb_matrix::RGBMatrix;
-using rgb_matrix::StreamReader;
-
-typedef int64_t tmillis_t;
-static const tmillis_t distant_future = (1LL<<40); // that is a while.
-
-struct ImageParams {
-  ImageParams() : anim_duration_ms(distant_future), wait_ms(1500),
-                  anim_delay_ms(-1), loops(-1) {}
-  tmillis_t anim_duration_ms;  // If this is an animation, duration to show.
-  tmillis_t wait_ms;           // Regular image: duration to show.
-  tmillis_t anim_delay_ms;     // Animation delay override.
-  int loops;
-};
-
-struct FileInfo {
-  ImageParams params;      // Each file might have specific timing settings
-  bool is_multi_frame;
-  rgb_matrix::StreamIO *content_stream;
-};
-
-volatile bool interrupt_received = false;
-static void InterruptHandler(int signo) {
-  interrupt_received = true;
-}
-
-static tmillis_t GetTimeInMillis() {
-  struct timeval tp;
-  gettimeofday(&tp, NULL);
-  return tp.tv_sec * 1000 + tp.tv_usec / 1000;
-}
-
-static void SleepMillis(tmillis_t milli_seconds) {
-  if (milli_seconds <= 0) return;
-  struct timespec ts;
-  ts.tv_sec = milli_seconds / 1000;
-  ts.tv_nsec = (milli_seconds % 1000) * 1000000;
-  nanosleep(&ts, NULL);
-}
-
-static void StoreInStream(const Magick::Image &img, int delay_time_us,
-                          bool do_center,
-                          rgb_matrix::FrameCanvas *scratch,
-                          rgb_matrix::StreamWriter *output) {
-  scratch->Clear();
-  const int x_offset = do_center ? (scratch->width() - img.columns()) / 2 : 0;
-  const int y_offset = do_center ? (scratch->height() - img.rows()) / 2 : 0;
-  for (size_t y = 0; y < img.rows(); ++y) {
-    for (size_t x = 0; x < img.columns(); ++x) {
-      const Magick::Color &c = img.pixelColor(x, y);
-      if (c.alphaQuantum() < 256) {
-        scratch->SetPixel(x + x_offset, y + y_offset,
-                          ScaleQuantumToChar(c.redQuantum()),
-                          ScaleQuantumToChar(c.greenQuantum()),
-                          ScaleQuantumToChar(c.blueQuantum()));
-      }
-    }
-  }
-  output->Stream(*scratch, delay_time_us);
-}
-
-static void CopyStream(rgb_matrix::StreamReader *r,
-                       rgb_matrix::StreamWriter *w,
-                       rgb_matrix::FrameCanvas *scratch) {
-  uint32_t delay_us;
-  while (r->GetNext(scratch, &delay_us)) {
-    w->Stream(*scratch, delay_us);
-  }
-}
-
-// Load still image or animation.
-// Scale, so that it fits in "width" and "height" and store in "result".
-static bool LoadImageAndScale(const char *filename,
-                              int target_width, int target_height,
-                              bool fill_width, bool fill_height,
-                              std::vector<Magick::Image> *result,
-                              std::string *err_msg) {
-  std::vector<Magick::Image> frames;
-  try {
-    readImages(&frames, filename);
-  } catch (std::exception& e) {
-    if (e.what()) *err_msg = e.what();
-    return false;
-  }
-  if (frames.size() == 0) {
-    fprintf(stderr, "No image found.");
-    return false;
-  }
-
-  // Put together the animation from single frames. GIFs can have nasty
-  // disposal modes, but they are handled nicely by coalesceImages()
-  if (frames.size() > 1) {
-    Magick::coalesceImages(result, frames.begin(), frames.end());
-  } else {
-    result->push_back(frames[0]);   // just a single still image.
-  }
-
-  const int img_width = (*result)[0].columns();
-  const int img_height = (*result)[0].rows();
-  const float width_fraction = (float)target_width / img_width;
-  const float height_fraction = (float)target_height / img_height;
-  if (fill_width && fill_height) {
-    // Scrolling diagonally. Fill as much as we can get in available space.
-    // Largest scale fraction determines that.
-    const float larger_fraction = (width_fraction > height_fraction)
-      ? width_fraction
-      : height_fraction;
-    target_width = (int) roundf(larger_fraction * img_width);
-    target_height = (int) roundf(larger_fraction * img_height);
-  }
-  else if (fill_height) {
-    // Horizontal scrolling: Make things fit in vertical space.
-    // While the height constraint stays the same, we can expand to full
-    // width as we scroll along that axis.
-    target_width = (int) roundf(height_fraction * img_width);
-  }
-  else if (fill_width) {
-    // dito, vertical. Make things fit in horizontal space.
-    target_height = (int) roundf(width_fraction * img_height);
-  }
-
-  for (size_t i = 0; i < result->size(); ++i) {
-    (*result)[i].scale(Magick::Geometry(target_width, target_height));
-  }
-
-  return true;
-}
-
-
-static int usage(const char *progname) {
-  fprintf(stderr, "usage: %s [options] <image> [option] [<image> ...]\n",
-          progname);
-
-  fprintf(stderr, "Options:\n"
-          "\t-O<streamfile>            : Output to stream-file instead of matrix (Don't need to be root).\n"
-          "\t-C                        : Center images.\n"
-
-          "\nThese options affect images following them on the command line:\n"
-          "\t-w<seconds>               : Regular image: "
-          "Wait time in seconds before next image is shown (default: 1.5).\n"
-          "\t-t<seconds>               : "
-          "For animations: stop after this time.\n"
-          "\t-l<loop-count>            : "
-          "For animations: number of loops through a full cycle.\n"
-          "\t-D<animation-delay-ms>    : "
-          "For animations: override the delay between frames given in the\n"
-          "\t                            gif/stream animation with this value. Use -1 to use default value.\n"
-
-          "\nOptions affecting display of multiple images:\n"
-          "\t-f                        : "
-          "Forever cycle through the list of files on the command line.\n"
-          "\t-s                        : If multiple images are given: shuffle.\n"
-          "\nDisplay Options:\n"
-          "\t-V<vsync-multiple>        : Expert: Only do frame vsync-swaps on multiples of refresh (default: 1)\n"
-          );
-
-  fprintf(stderr, "\nGeneral LED matrix options:\n");
-  rgb_matrix::PrintMatrixFlags(stderr);
-
-  fprintf(stderr,
-          "\nSwitch time between files: "
-          "-w for static images; -t/-l for animations\n"
-          "Animated gifs: If both -l and -t are given, "
-          "whatever finishes first determines duration.\n");
-
-  fprintf(stderr, "\nThe -w, -t and -l options apply to the following images "
-          "until a new instance of one of these options is seen.\n"
-          "So you can choose different durations for different images.\n");
-
-  return 1;
-}
-
-int main(int argc, char *argv[]) {
-  Magick::InitializeMagick(*argv);
-
-  RGBMatrix::Options matrix_options;
-  rgb_matrix::RuntimeOptions runtime_opt;
-  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
-                                         &matrix_options, &runtime_opt)) {
-    return usage(argv[0]);
-  }
-
-  int vsync_multiple = 1;
-  bool do_forever = false;
-  bool do_center = false;
-  bool do_shuffle = false;
-
-  // We remember ImageParams for each image, which will change whenever
-  // there is a flag modifying them. This map keeps track of filenames
-  // and their image params (also for unrelated elements of argv[], but doesn't
-  // matter).
-  // We map the pointer instad of the string of the argv parameter so that
-  // we can have two times the same image on the commandline list with different
-  // parameters.
-  std::map<const void *, struct ImageParams> filename_params;
-
-  // Set defaults.
-  ImageParams img_param;
-  for (int i = 0; i < argc; ++i) {
-    filename_params[argv[i]] = img_param;
-  }
-
-  const char *stream_output = NULL;
-
-  int opt;
-  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:V:D:")) != -1) {
-    switch (opt) {
-    case 'w':
-      img_param.wait_ms = roundf(atof(optarg) * 1000.0f);
-      break;
-    case 't':
-      img_param.anim_duration_ms = roundf(atof(optarg) * 1000.0f);
-      break;
-    case 'l':
-      img_param.loops = atoi(optarg);
-      break;
-    case 'f':
-      do_forever = true;
-      break;
-    case 'C':
-      do_center = true;
-      break;
-    case 's':
-      do_shuffle = true;
-      break;
-    case 'r':
-      fprintf(stderr, "Instead of deprecated -r, use --led-rows=%s instead.\n",
-              optarg);
-      matrix_options.rows = atoi(optarg);
-      break;
-    case 'c':
-      fprintf(stderr, "Instead of deprecated -c, use --led-chain=%s instead.\n",
-              optarg);
-      matrix_options.chain_length = atoi(optarg);
-      break;
-    case 'P':
-      matrix_options.parallel = atoi(optarg);
-      break;
-    case 'L':
-      fprintf(stderr, "-L is deprecated. Use\n\t--led-pixel-mapper=\"U-mapper\" --led-chain=4\ninstead.\n");
-      return 1;
-      break;
-    case 'R':
-      fprintf(stderr, "-R is deprecated. "
-              "Use --led-pixel-mapper=\"Rotate:%s\" instead.\n", optarg);
-      return 1;
-      break;
-    case 'V':
-      vsync_multiple = atoi(optarg);
-      if (vsync_multiple < 1) vsync_multiple = 1;
-      break;
-    case 'h':
-    default:
-      return usage(argv[0]);
-    }
-
-    // Starting from the current file, set all the remaining files to
-    // the latest change.
-    for (int i = optind; i < argc; ++i) {
-      filename_params[argv[i]] = img_param;
-    }
-  }
-
-  const int filename_count = argc - optind;
-  if (filename_count == 0) {
-    fprintf(stderr, "Expected image filename.\n");
-    return usage(argv[0]);
-  }
-
-  // Prepare matrix
-  runtime_opt.do_gpio_init = (stream_output == NULL);
-  RGBMatrix *matrix = CreateMatrixFromOptions(matrix_options, runtime_opt);
-  if (matrix == NULL)
-    return 1;
-
-  FrameCanvas *offscreen_canvas = matrix->CreateFrameCanvas();
-
-  printf("Size: %dx%d. Hardware gpio mapping: %s\n",
-         matrix->width(), matrix->height(), matrix_options.hardware_mapping);
-
-  // These parameters are needed once we do scrolling.
-  const bool fill_width = false;
-  const bool fill_height = false;
- 
-
-  const tmillis_t start_load = GetTimeInMillis();
-  fprintf(stderr, "Loading %d files...\n", argc - optind);
-  // Preparing all the images beforehand as the Pi might be too slow to
-  // be quickly switching between these. So preprocess.
-  std::vector<FileInfo*> file_imgs;
-  for (int imgarg = optind; imgarg < argc; ++imgarg) {
-    const char *filename = argv[imgarg];
-    FileInfo *file_info = NULL;
-
-    std::string err_msg;
-    std::vector<Magick::Image> image_sequence;
-    if (LoadImageAndScale(filename, matrix->width(), matrix->height(),
-                          fill_width, fill_height, &image_sequence, &err_msg)) {
-      file_info = new FileInfo();
-      file_info->params = filename_params[filename];
-      file_info->content_stream = new rgb_matrix::MemStreamIO();
-      file_info->is_multi_frame = image_sequence.size() > 1;
-      rgb_matrix::StreamWriter out(file_info->content_stream);
-      for (size_t i = 0; i < image_sequence.size(); ++i) {
-        const Magick::Image &img = image_sequence[i];
-        int64_t delay_time_us;
-        delay_time_us = file_info->params.wait_ms * 1000;  // single image.
-        
-        if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // 1/10sec
-        StoreInStream(img, delay_time_us, do_center, offscreen_canvas,
-                      global_stream_writer ? global_stream_writer : &out);
-      }
-    } 
-
-    if (file_info) {
-      file_imgs.push_back(file_info);
-    } else {
-      fprintf(stderr, "%s skipped: Unable to open (%s)\n",
-              filename, err_msg.c_str());
-    }
-  }
-
-  if (stream_output) {
-    delete global_stream_writer;
-    delete stream_io;
-    if (file_imgs.size()) {
-      fprintf(stderr, "Done: Output to stream %s; "
-              "this can now be opened with led-image-viewer with the exact same panel configuration settings such as rows, chain, parallel and hardware-mapping\n", stream_output);
-    }
-    if (do_shuffle)
-      fprintf(stderr, "Note: -s (shuffle) does not have an effect when generating streams.\n");
-    if (do_forever)
-      fprintf(stderr, "Note: -f (forever) does not have an effect when generating streams.\n");
-    // Done, no actual output to matrix.
-    return 0;
-  }
-
-  // Some parameter sanity adjustments.
-  if (file_imgs.empty()) {
-    // e.g. if all files could not be interpreted as image.
-    fprintf(stderr, "No image could be loaded.\n");
-    return 1;
-  } else if (file_imgs.size() == 1) {
-    // Single image: show forever.
-    file_imgs[0]->params.wait_ms = distant_future;
-  } else {
-    for (size_t i = 0; i < file_imgs.size(); ++i) {
-      ImageParams &params = file_imgs[i]->params;
-      // Forever animation ? Set to loop only once, otherwise that animation
-      // would just run forever, stopping all the images after it.
-      if (params.loops < 0 && params.anim_duration_ms == distant_future) {
-        params.loops = 1;
-      }
-    }
-  }
-
-  fprintf(stderr, "Loading took %.3fs; now: Display.\n",
-          (GetTimeInMillis() - start_load) / 1000.0);
-
-  signal(SIGTERM, InterruptHandler);
-  signal(SIGINT, InterruptHandler);
-
-  do {
-    if (do_shuffle) {
-      std::random_shuffle(file_imgs.begin(), file_imgs.end());
-    }
-    for (size_t i = 0; i < file_imgs.size() && !interrupt_received; ++i) {
-      DisplayAnimation(file_imgs[i], matrix, offscreen_canvas, vsync_multiple);
-    }
-  } while (do_forever && !interrupt_received);
-
-  if (interrupt_received) {
-    fprintf(stderr, "Caught signal. Exiting.\n");
-  }
-
-  // Animation finished. Shut down the RGB matrix.
-  matrix->Clear();
-  delete matrix;
-
-  // Leaking the FileInfos, but don't care at program end.
-  return 0;
-}
-
+// Previamente se debe haber instalado: image-magick development files
+// $ sudo apt-get install libgraphicsmagick++-dev libwebp-dev
+
+// Compilar con make secuencia
+
+#include "led-matrix.h"
+#include "pixel-mapper.h"
+#include "content-streamer.h"
+#include "graphics.h"
+#include "image-loader.h"
+#include "thread.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <Magick++.h>
+#include <magick/image.h>
+
+using rgb_matrix::GPIO;
+using rgb_matrix::Canvas;
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::StreamReader;
+
+typedef int64_t tmillis_t;
+static const tmillis_t distant_future = (1LL<<40); // that is a while.
+
+struct ImageParams {
+  ImageParams() : anim_duration_ms(distant_future), wait_ms(1500),
+                  anim_delay_ms(-1), loops(-1),
+                  countdown_steps(0), bar_y(24), bar_height(5) {}
+  tmillis_t anim_duration_ms;  // If this is an animation, duration to show.
+  tmillis_t wait_ms;           // Regular image: duration to show.
+  tmillis_t anim_delay_ms;     // Animation delay override.
+  int loops;
+  std::string state;           // State machine mode: state of this file.
+
+  // Countdown: if steps > 0, the image is the base for that many frames
+  // (plus the empty one) with a progress bar growing at "bar_y". The bar is
+  // given in pixels of the image file, before it is scaled to the panel.
+  int countdown_steps;
+  int bar_y;
+  int bar_height;
+};
+
+struct FileInfo {
+  ImageParams params;      // Each file might have specific timing settings
+  bool is_multi_frame;
+  rgb_matrix::StreamIO *content_stream;
+};
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+static tmillis_t GetTimeInMillis() {
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  return tp.tv_sec * 1000 + tp.tv_usec / 1000;
+}
+
+static int64_t GetTimeInMicros() {
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  return tp.tv_sec * 1000000LL + tp.tv_usec;
+}
+
+static void SleepMillis(tmillis_t milli_seconds) {
+  if (milli_seconds <= 0) return;
+  struct timespec ts;
+  ts.tv_sec = milli_seconds / 1000;
+  ts.tv_nsec = (milli_seconds % 1000) * 1000000;
+  nanosleep(&ts, NULL);
+}
+
+// FNV-1a, 64 bit.
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t len) {
+  const uint8_t *bytes = (const uint8_t*) data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Key for everything that goes into rendering "filename": the file itself,
+// the panel configuration and the options applied to it. Returns 0 if the
+// file can't be read.
+static uint64_t AssetKey(const char *filename, const FrameCanvas &canvas,
+                         bool do_center, const ImageParams &params) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat sb;
+  fstat(fd, &sb);
+  uint64_t hash = 14695981039346656037ULL;
+  hash = HashBytes(hash, filename, strlen(filename));
+  const int64_t values[] = { sb.st_size, sb.st_mtime, canvas.ConfigHash(),
+                             canvas.width(), canvas.height(), do_center,
+                             params.wait_ms, params.countdown_steps,
+                             params.bar_y, params.bar_height };
+  hash = HashBytes(hash, values, sizeof(values));
+  char buffer[65536];
+  ssize_t r;
+  while ((r = read(fd, buffer, sizeof(buffer))) > 0) {
+    hash = HashBytes(hash, buffer, r);
+  }
+  close(fd);
+  return hash;
+}
+
+// Persistent cache of the rendered content streams, so that we don't have to
+// decode and convert all the images again on each start. The cache file is
+// mmap()ed and the streams are played directly from there.
+class AssetCache {
+public:
+  explicit AssetCache(const char *filename)
+    : filename_(filename), map_(MAP_FAILED), map_size_(0) {
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+      map_size_ = sb.st_size;
+      map_ = mmap(NULL, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map_ == MAP_FAILED) return;
+    const char *pos = (const char*) map_;
+    const char *const end = pos + map_size_;
+    EntryHeader header;
+    while ((size_t)(end - pos) >= sizeof(header)) {
+      memcpy(&header, pos, sizeof(header));
+      pos += sizeof(header);
+      if (header.magic != kEntryMagic || header.size > (size_t)(end - pos))
+        break;  // Truncated or garbage; what we have so far is fine.
+      const Entry entry = { pos, (size_t)header.size,
+                            header.is_multi_frame != 0 };
+      entries_[header.key] = entry;
+      pos += header.size;
+    }
+  }
+
+  ~AssetCache() {
+    if (map_ != MAP_FAILED) munmap(map_, map_size_);
+  }
+
+  // Returns stream stored for "key" or NULL if there is none.
+  rgb_matrix::StreamIO *Lookup(uint64_t key, bool *is_multi_frame) const {
+    std::map<uint64_t, Entry>::const_iterator found = entries_.find(key);
+    if (found == entries_.end()) return NULL;
+    *is_multi_frame = found->second.is_multi_frame;
+    return new rgb_matrix::MappedStreamIO(found->second.data,
+                                          found->second.size);
+  }
+
+  // Replace the cache file with one containing the given "files" with their
+  // "keys". The streams of "files" are read from the start.
+  bool Store(const std::vector<uint64_t> &keys,
+             const std::vector<FileInfo*> &files) const {
+    char tmp_name[1024];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", filename_.c_str(),
+             getpid());
+    const int fd = open(tmp_name, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+    if (fd < 0) return false;
+    rgb_matrix::BufferedFileStreamIO out(fd);
+    bool success = true;
+    std::vector<char> stream_data;
+    for (size_t i = 0; i < files.size(); ++i) {
+      rgb_matrix::StreamIO *stream = files[i]->content_stream;
+      stream_data.clear();
+      char buffer[65536];
+      ssize_t r;
+      stream->Rewind();
+      while ((r = stream->Read(buffer, sizeof(buffer))) > 0) {
+        stream_data.insert(stream_data.end(), buffer, buffer + r);
+      }
+      stream->Rewind();
+      EntryHeader header = {};
+      header.magic = kEntryMagic;
+      header.is_multi_frame = files[i]->is_multi_frame;
+      header.key = keys[i];
+      header.size = stream_data.size();
+      success &= (out.Append(&header, sizeof(header)) == sizeof(header));
+      if (!stream_data.empty()) {
+        success &= (out.Append(&stream_data[0], stream_data.size())
+                    == (ssize_t)stream_data.size());
+      }
+    }
+    success &= out.Flush();
+    if (!success || rename(tmp_name, filename_.c_str()) != 0) {
+      unlink(tmp_name);
+      return false;
+    }
+    return true;
+  }
+
+private:
+  static const uint32_t kEntryMagic = 0x5EC0CAC4;
+  struct EntryHeader {
+    uint32_t magic;
+    uint32_t is_multi_frame;
+    uint64_t key;
+    uint64_t size;  // Bytes of content stream following.
+  };
+  struct Entry {
+    const char *data;
+    size_t size;
+    bool is_multi_frame;
+  };
+
+  const std::string filename_;
+  void *map_;
+  size_t map_size_;
+  std::map<uint64_t, Entry> entries_;
+};
+
+// Export all pixels of "img" at once into "rgba": four bytes per pixel
+// (red, green, blue, alpha), row by row. A lot faster than asking for each
+// pixel with pixelColor(), which creates a Magick::Color every time.
+static void ExportRGBA(const Magick::Image &img, std::vector<uint8_t> *rgba) {
+  const size_t count = img.columns() * img.rows();
+  rgba->resize(4 * count);
+  if (count == 0) return;
+  const Magick::PixelPacket *pixel
+    = img.getConstPixels(0, 0, img.columns(), img.rows());
+  uint8_t *out = &(*rgba)[0];
+  for (size_t i = 0; i < count; ++i, ++pixel, out += 4) {
+    out[0] = ScaleQuantumToChar(pixel->red);
+    out[1] = ScaleQuantumToChar(pixel->green);
+    out[2] = ScaleQuantumToChar(pixel->blue);
+    out[3] = 255 - ScaleQuantumToChar(pixel->opacity);  // 0 is opaque.
+  }
+}
+
+static void RenderImage(const Magick::Image &img, bool do_center,
+                        rgb_matrix::FrameCanvas *scratch) {
+  scratch->Clear();
+  const int x_offset = do_center ? (scratch->width() - img.columns()) / 2 : 0;
+  const int y_offset = do_center ? (scratch->height() - img.rows()) / 2 : 0;
+  std::vector<uint8_t> rgba;
+  ExportRGBA(img, &rgba);
+  if (rgba.empty()) return;
+  // Transparent pixels are skipped.
+  scratch->SetPixelsRGBA(x_offset, y_offset, img.columns(), img.rows(),
+                         &rgba[0]);
+}
+
+// Native images are already in the layout the canvas wants.
+static void RenderImage(const rgb_matrix::RGBImage &img, bool do_center,
+                        rgb_matrix::FrameCanvas *scratch) {
+  scratch->Clear();
+  const int x_offset = do_center ? (scratch->width() - img.width) / 2 : 0;
+  const int y_offset = do_center ? (scratch->height() - img.height) / 2 : 0;
+  scratch->SetPixels(x_offset, y_offset, img.width, img.height,
+                     &img.pixels[0]);
+}
+
+static void StoreInStream(const Magick::Image &img, int delay_time_us,
+                          bool do_center,
+                          rgb_matrix::FrameCanvas *scratch,
+                          rgb_matrix::StreamWriter *output) {
+  RenderImage(img, do_center, scratch);
+  output->Stream(*scratch, delay_time_us);
+}
+
+// The most common color that is not black; that is the color of the text.
+static rgb_matrix::Color ForegroundColor(const Magick::Image &img) {
+  std::map<uint32_t, int> histogram;
+  std::vector<uint8_t> rgba;
+  ExportRGBA(img, &rgba);
+  for (size_t i = 0; i < rgba.size(); i += 4) {
+    const uint32_t rgb = (rgba[i] << 16) | (rgba[i + 1] << 8) | rgba[i + 2];
+    if (rgb != 0 && rgba[i + 3] == 0xff) histogram[rgb]++;
+  }
+  uint32_t best = 0xffffff;
+  int best_count = 0;
+  for (std::map<uint32_t, int>::const_iterator it = histogram.begin();
+       it != histogram.end(); ++it) {
+    if (it->second > best_count) {
+      best = it->first;
+      best_count = it->second;
+    }
+  }
+  return rgb_matrix::Color(best >> 16, (best >> 8) & 0xff, best & 0xff);
+}
+
+static rgb_matrix::Color ForegroundColor(const rgb_matrix::RGBImage &img) {
+  std::map<uint32_t, int> histogram;
+  for (size_t i = 0; i + 2 < img.pixels.size(); i += 3) {
+    const uint32_t rgb = (img.pixels[i] << 16) | (img.pixels[i + 1] << 8)
+      | img.pixels[i + 2];
+    if (rgb != 0) histogram[rgb]++;
+  }
+  uint32_t best = 0xffffff;
+  int best_count = 0;
+  for (std::map<uint32_t, int>::const_iterator it = histogram.begin();
+       it != histogram.end(); ++it) {
+    if (it->second > best_count) {
+      best = it->first;
+      best_count = it->second;
+    }
+  }
+  return rgb_matrix::Color(best >> 16, (best >> 8) & 0xff, best & 0xff);
+}
+
+// Instead of a separate image for each step of a countdown, generate them
+// from the base image of "img_width" x "img_height", already rendered into
+// "base", by drawing the progress bar on top.
+static void StoreCountdownInStream(int img_width, int img_height,
+                                   const rgb_matrix::Color &color,
+                                   int delay_time_us,
+                                   bool do_center, const ImageParams &params,
+                                   rgb_matrix::FrameCanvas *base,
+                                   rgb_matrix::FrameCanvas *scratch,
+                                   rgb_matrix::StreamWriter *output) {
+  const int x_offset = do_center ? (scratch->width() - img_width) / 2 : 0;
+  const int y_offset = do_center ? (scratch->height() - img_height) / 2 : 0;
+  const int steps = params.countdown_steps;
+  for (int step = 0; step <= steps; ++step) {
+    scratch->CopyFrom(*base);
+    const int bar_width = (img_width * step + steps / 2) / steps;
+    for (int y = 0; bar_width > 0 && y < params.bar_height; ++y) {
+      rgb_matrix::DrawLine(scratch, x_offset, y_offset + params.bar_y + y,
+                           x_offset + bar_width - 1,
+                           y_offset + params.bar_y + y, color);
+    }
+    output->Stream(*scratch, delay_time_us);
+  }
+}
+
+// Store all frames of "image_sequence" in "out".
+static void StoreImageSequence(const std::vector<Magick::Image> &image_sequence,
+                               const ImageParams &params, bool do_center,
+                               rgb_matrix::FrameCanvas *countdown_base,
+                               rgb_matrix::FrameCanvas *scratch,
+                               rgb_matrix::StreamWriter *out) {
+  for (size_t i = 0; i < image_sequence.size(); ++i) {
+    const Magick::Image &img = image_sequence[i];
+    int64_t delay_time_us;
+    delay_time_us = params.wait_ms * 1000;  // single image.
+
+    if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // 1/10sec
+    if (params.countdown_steps > 0) {
+      RenderImage(img, do_center, countdown_base);
+      StoreCountdownInStream(img.columns(), img.rows(), ForegroundColor(img),
+                             delay_time_us, do_center, params,
+                             countdown_base, scratch, out);
+    } else {
+      StoreInStream(img, delay_time_us, do_center, scratch, out);
+    }
+  }
+}
+
+// Same as StoreImageSequence(), for an image read by LoadNativeImage().
+static void StoreNativeImage(const rgb_matrix::RGBImage &img,
+                             const ImageParams &params, bool do_center,
+                             rgb_matrix::FrameCanvas *countdown_base,
+                             rgb_matrix::FrameCanvas *scratch,
+                             rgb_matrix::StreamWriter *out) {
+  int64_t delay_time_us = params.wait_ms * 1000;
+  if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // 1/10sec
+  if (params.countdown_steps > 0) {
+    RenderImage(img, do_center, countdown_base);
+    StoreCountdownInStream(img.width, img.height, ForegroundColor(img),
+                           delay_time_us, do_center, params,
+                           countdown_base, scratch, out);
+  } else {
+    RenderImage(img, do_center, scratch);
+    out->Stream(*scratch, delay_time_us);
+  }
+}
+
+static void CopyStream(rgb_matrix::StreamReader *r,
+                       rgb_matrix::StreamWriter *w,
+                       rgb_matrix::FrameCanvas *scratch) {
+  uint32_t delay_us;
+  while (r->GetNext(scratch, &delay_us)) {
+    w->Stream(*scratch, delay_us);
+  }
+}
+
+// Size to scale an image of "img_width" x "img_height" to, given the
+// available space in "target_width" and "target_height".
+static void ComputeTargetSize(int img_width, int img_height,
+                              bool fill_width, bool fill_height,
+                              int *target_width, int *target_height) {
+  const float width_fraction = (float)*target_width / img_width;
+  const float height_fraction = (float)*target_height / img_height;
+  if (fill_width && fill_height) {
+    // Scrolling diagonally. Fill as much as we can get in available space.
+    // Largest scale fraction determines that.
+    const float larger_fraction = (width_fraction > height_fraction)
+      ? width_fraction
+      : height_fraction;
+    *target_width = (int) roundf(larger_fraction * img_width);
+    *target_height = (int) roundf(larger_fraction * img_height);
+  }
+  else if (fill_height) {
+    // Horizontal scrolling: Make things fit in vertical space.
+    // While the height constraint stays the same, we can expand to full
+    // width as we scroll along that axis.
+    *target_width = (int) roundf(height_fraction * img_width);
+  }
+  else if (fill_width) {
+    // dito, vertical. Make things fit in horizontal space.
+    *target_height = (int) roundf(width_fraction * img_height);
+  }
+}
+
+// GraphicsMagick is initialized when first needed, which can be on any of
+// the loader threads.
+static const char *magick_path = NULL;
+static pthread_once_t magick_once = PTHREAD_ONCE_INIT;
+static void InitMagick() { Magick::InitializeMagick(magick_path); }
+static void InitMagickOnce() { pthread_once(&magick_once, InitMagick); }
+
+// Load still image or animation.
+// Scale, so that it fits in "width" and "height" and store in "result".
+static bool LoadImageAndScale(const char *filename,
+                              int target_width, int target_height,
+                              bool fill_width, bool fill_height,
+                              std::vector<Magick::Image> *result,
+                              int *source_height,
+                              std::string *err_msg) {
+  InitMagickOnce();
+  std::vector<Magick::Image> frames;
+  try {
+    readImages(&frames, filename);
+  } catch (std::exception& e) {
+    if (e.what()) *err_msg = e.what();
+    return false;
+  }
+  if (frames.size() == 0) {
+    fprintf(stderr, "No image found.");
+    return false;
+  }
+
+  // Put together the animation from single frames. GIFs can have nasty
+  // disposal modes, but they are handled nicely by coalesceImages()
+  if (frames.size() > 1) {
+    Magick::coalesceImages(result, frames.begin(), frames.end());
+  } else {
+    result->push_back(frames[0]);   // just a single still image.
+  }
+
+  *source_height = (*result)[0].rows();
+  ComputeTargetSize((*result)[0].columns(), (*result)[0].rows(),
+                    fill_width, fill_height, &target_width, &target_height);
+  for (size_t i = 0; i < result->size(); ++i) {
+    (*result)[i].scale(Magick::Geometry(target_width, target_height));
+  }
+
+  return true;
+}
+
+// Same as LoadImageAndScale() for the simple formats we can read without
+// GraphicsMagick (see image-loader.h). A lot faster for small assets.
+static bool LoadNativeImageAndScale(const char *filename,
+                                    int target_width, int target_height,
+                                    bool fill_width, bool fill_height,
+                                    rgb_matrix::RGBImage *result,
+                                    int *source_height,
+                                    std::string *err_msg) {
+  rgb_matrix::RGBImage img;
+  // Raw files have no header; they are expected to have the panel size.
+  if (!rgb_matrix::LoadNativeImage(filename, target_width, target_height,
+                                   &img, err_msg)) {
+    return false;
+  }
+  *source_height = img.height;
+  ComputeTargetSize(img.width, img.height, fill_width, fill_height,
+                    &target_width, &target_height);
+  // Like Magick::Geometry, keep the aspect ratio within the target size.
+  const float fraction = std::min((float)target_width / img.width,
+                                  (float)target_height / img.height);
+  const int width = std::max(1, (int) roundf(fraction * img.width));
+  const int height = std::max(1, (int) roundf(fraction * img.height));
+  if (width == img.width && height == img.height) {
+    result->width = width;
+    result->height = height;
+    result->pixels.swap(img.pixels);
+  } else {
+    rgb_matrix::ScaleImage(img, width, height, result);
+  }
+  return true;
+}
+
+
+// Result of preparing a file to be shown. Done for all files in parallel.
+struct PreloadedFile {
+  PreloadedFile() : filename(NULL), asset_key(0), loaded(false),
+                    from_cache(false), is_multi_frame(false), is_native(false),
+                    source_height(0), content_stream(NULL) {}
+  const char *filename;
+  ImageParams params;
+  uint64_t asset_key;
+  bool loaded;          // From cache, or LoadImageAndScale() succeeded.
+  bool from_cache;
+  bool is_multi_frame;
+  bool is_native;       // Loaded into native_image, not image_sequence.
+  int source_height;    // Height of the image file before scaling.
+  std::string err_msg;
+  std::vector<Magick::Image> image_sequence;  // If not converted yet.
+  rgb_matrix::RGBImage native_image;          // If not converted yet.
+  rgb_matrix::StreamIO *content_stream;       // Converted if not NULL.
+};
+
+static void StoreLoadedFile(PreloadedFile *file, bool do_center,
+                            rgb_matrix::FrameCanvas *countdown_base,
+                            rgb_matrix::FrameCanvas *scratch,
+                            rgb_matrix::StreamWriter *out) {
+  // The countdown bar is given in pixels of the image file, so it is scaled
+  // together with the image.
+  ImageParams params = file->params;
+  const int height = file->is_native
+    ? file->native_image.height
+    : (file->image_sequence.empty() ? 0 : file->image_sequence[0].rows());
+  if (params.countdown_steps > 0 && file->source_height > 0
+      && height != file->source_height) {
+    const int source = file->source_height;
+    params.bar_y = (params.bar_y * height + source / 2) / source;
+    params.bar_height = std::max(
+      1, (params.bar_height * height + source / 2) / source);
+  }
+  if (file->is_native) {
+    StoreNativeImage(file->native_image, params, do_center,
+                     countdown_base, scratch, out);
+  } else {
+    StoreImageSequence(file->image_sequence, params, do_center,
+                       countdown_base, scratch, out);
+  }
+  // Not needed anymore.
+  file->image_sequence.clear();
+  std::vector<uint8_t>().swap(file->native_image.pixels);
+}
+
+// Thread loading, scaling and converting files until there are none left.
+// Each thread takes the next file in the list; results stay in their place,
+// so the order of the files doesn't change.
+class PreloadThread : public rgb_matrix::Thread {
+public:
+  PreloadThread(std::vector<PreloadedFile> *files, size_t *next_file,
+                rgb_matrix::Mutex *mutex, const AssetCache *cache,
+                FrameCanvas *scratch, FrameCanvas *countdown_base,
+                bool fill_width, bool fill_height, bool do_center,
+                bool convert)
+    : files_(files), next_file_(next_file), mutex_(mutex), cache_(cache),
+      scratch_(scratch), countdown_base_(countdown_base),
+      fill_width_(fill_width), fill_height_(fill_height),
+      do_center_(do_center), convert_(convert) {}
+
+  virtual void Run() {
+    for (;;) {
+      PreloadedFile *file;
+      {
+        rgb_matrix::MutexLock l(mutex_);
+        if (*next_file_ >= files_->size()) return;
+        file = &(*files_)[(*next_file_)++];
+      }
+      if (cache_) {
+        file->asset_key = AssetKey(file->filename, *scratch_, do_center_,
+                                   file->params);
+        file->content_stream = cache_->Lookup(file->asset_key,
+                                              &file->is_multi_frame);
+        if (file->content_stream) {
+          file->loaded = file->from_cache = true;
+          continue;
+        }
+      }
+      file->is_native = rgb_matrix::IsNativeImage(file->filename)
+        && LoadNativeImageAndScale(file->filename,
+                                   scratch_->width(), scratch_->height(),
+                                   fill_width_, fill_height_,
+                                   &file->native_image,
+                                   &file->source_height, &file->err_msg);
+      if (file->is_native) {
+        file->loaded = true;
+      } else {
+        // Whatever we can't read ourselves is left to GraphicsMagick.
+        file->loaded = LoadImageAndScale(file->filename,
+                                         scratch_->width(), scratch_->height(),
+                                         fill_width_, fill_height_,
+                                         &file->image_sequence,
+                                         &file->source_height,
+                                         &file->err_msg);
+      }
+      if (!file->loaded) continue;
+      const bool countdown = file->params.countdown_steps > 0;
+      file->is_multi_frame = file->image_sequence.size() > 1 || countdown;
+      if (!convert_) continue;
+      file->content_stream = new rgb_matrix::MemStreamIO();
+      // Countdown steps only differ in the bar, so store just the changes.
+      // Repeated frames are stored once; this stream is never piped.
+      rgb_matrix::StreamWriter out(file->content_stream, countdown, true);
+      StoreLoadedFile(file, do_center_, countdown_base_, scratch_, &out);
+    }
+  }
+
+private:
+  std::vector<PreloadedFile> *const files_;
+  size_t *const next_file_;
+  rgb_matrix::Mutex *const mutex_;
+  const AssetCache *const cache_;
+  FrameCanvas *const scratch_;
+  FrameCanvas *const countdown_base_;
+  const bool fill_width_;
+  const bool fill_height_;
+  const bool do_center_;
+  const bool convert_;
+};
+
+void DisplayAnimation(const FileInfo *file,
+                      RGBMatrix *matrix, FrameCanvas *offscreen_canvas,
+                      int vsync_multiple) {
+  const tmillis_t duration_ms = (file->is_multi_frame
+                                 ? file->params.anim_duration_ms
+                                 : file->params.wait_ms);
+  rgb_matrix::StreamReader reader(file->content_stream);
+  int loops = file->params.loops;
+  const tmillis_t end_time_ms = GetTimeInMillis() + duration_ms;
+  const tmillis_t override_anim_delay = file->params.anim_delay_ms;
+  for (int k = 0;
+       (loops < 0 || k < loops)
+         && !interrupt_received
+         && GetTimeInMillis() < end_time_ms;
+       ++k) {
+    uint32_t delay_us = 0;
+    while (!interrupt_received && GetTimeInMillis() <= end_time_ms
+           && reader.GetNext(offscreen_canvas, &delay_us)) {
+      const tmillis_t anim_delay_ms =
+        override_anim_delay >= 0 ? override_anim_delay : delay_us / 1000;
+      const tmillis_t start_wait_ms = GetTimeInMillis();
+      offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas, vsync_multiple);
+      const tmillis_t time_already_spent = GetTimeInMillis() - start_wait_ms;
+      SleepMillis(anim_delay_ms - time_already_spent);
+    }
+    reader.Rewind();
+  }
+}
+
+// Name of the directory "filename" is in, e.g. PASE for
+// "Imagenes secuencia/PASE/pase10.bmp".
+static std::string StateFromPath(const char *filename) {
+  std::string dir = filename;
+  const size_t slash = dir.find_last_of('/');
+  if (slash == std::string::npos) return ".";
+  dir.resize(slash);
+  const size_t parent_slash = dir.find_last_of('/');
+  return parent_slash == std::string::npos
+    ? dir : dir.substr(parent_slash + 1);
+}
+
+// Reads commands from the controller: names of the state to switch to, one
+// per line, from a named pipe. The display waits on these instead of just
+// sleeping, so that a new state is shown at the very next refresh.
+class StateCommandReader : public rgb_matrix::Thread {
+public:
+  explicit StateCommandReader(int fd)
+    : fd_(fd), received_us_(0), has_command_(false) {
+    pthread_cond_init(&command_arrived_, NULL);
+  }
+
+  // Wait up to "timeout_ms" for a command. Returns true if there is one;
+  // then "state" is set as well as the time it was received.
+  bool WaitCommand(tmillis_t timeout_ms, std::string *state,
+                   int64_t *received_us) {
+    const tmillis_t end_ms = GetTimeInMillis() + timeout_ms;
+    tmillis_t now_ms;
+    rgb_matrix::MutexLock l(&mutex_);
+    while (!has_command_ && (now_ms = GetTimeInMillis()) < end_ms) {
+      mutex_.WaitOn(&command_arrived_, end_ms - now_ms);
+    }
+    if (!has_command_) return false;
+    *state = command_;
+    *received_us = received_us_;
+    has_command_ = false;
+    return true;
+  }
+
+  virtual void Run() {
+    std::string line;
+    char buffer[256];
+    ssize_t r;
+    while ((r = read(fd_, buffer, sizeof(buffer))) != 0) {
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        perror("Reading state commands");
+        break;
+      }
+      for (ssize_t i = 0; i < r; ++i) {
+        if (buffer[i] == '\r') continue;
+        if (buffer[i] != '\n') {
+          line.push_back(buffer[i]);
+          continue;
+        }
+        if (!line.empty()) {
+          rgb_matrix::MutexLock l(&mutex_);
+          command_ = line;  // The latest command wins.
+          received_us_ = GetTimeInMicros();
+          has_command_ = true;
+          pthread_cond_signal(&command_arrived_);
+        }
+        line.clear();
+      }
+    }
+  }
+
+private:
+  const int fd_;
+  rgb_matrix::Mutex mutex_;
+  pthread_cond_t command_arrived_;
+  std::string command_;
+  int64_t received_us_;
+  bool has_command_;
+};
+
+typedef std::map<std::string, std::vector<FileInfo*> > StateMap;
+
+// State machine mode: show the files of the current state in a loop until
+// the controller switches to another state.
+static void RunStateMachine(const StateMap &states, std::string current,
+                            StateCommandReader *commands,
+                            RGBMatrix *matrix, FrameCanvas *offscreen_canvas,
+                            int vsync_multiple) {
+  std::string requested;
+  int64_t command_us = -1;  // Time of command not shown yet.
+  while (!interrupt_received) {
+    const std::vector<FileInfo*> &files = states.find(current)->second;
+    bool switched = false;
+    for (size_t i = 0; i < files.size() && !switched && !interrupt_received;
+         ++i) {
+      rgb_matrix::StreamReader reader(files[i]->content_stream);
+      const tmillis_t override_anim_delay = files[i]->params.anim_delay_ms;
+      uint32_t delay_us = 0;
+      while (!switched && !interrupt_received
+             && reader.GetNext(offscreen_canvas, &delay_us)) {
+        const tmillis_t start_ms = GetTimeInMillis();
+        offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas,
+                                               vsync_multiple);
+        if (command_us >= 0) {
+          // SwapOnVSync() returns when the refresh of the new frame starts.
+          fprintf(stderr, "State %s: shown %.1fms after command\n",
+                  current.c_str(), (GetTimeInMicros() - command_us) / 1000.0);
+          command_us = -1;
+        }
+        const tmillis_t end_ms = start_ms + (override_anim_delay >= 0
+                                             ? override_anim_delay
+                                             : delay_us / 1000);
+        tmillis_t now_ms;
+        while (!switched && (now_ms = GetTimeInMillis()) < end_ms
+               && commands->WaitCommand(end_ms - now_ms,
+                                        &requested, &command_us)) {
+          if (states.find(requested) != states.end()) {
+            current = requested;
+            switched = true;
+          } else {
+            fprintf(stderr, "Unknown state '%s'\n", requested.c_str());
+            command_us = -1;
+          }
+        }
+      }
+    }
+  }
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] <image> [option] [<image> ...]\n",
+          progname);
+
+  fprintf(stderr, "Options:\n"
+          "\t-O<streamfile>            : Output to stream-file instead of matrix (Don't need to be root).\n"
+          "\t-C                        : Center images.\n"
+          "\t-K<cache-file>            : Keep rendered images in this cache file; later starts\n"
+          "\t                            with the same images and settings don't need to decode them.\n"
+
+          "\nThese options affect images following them on the command line:\n"
+          "\t-w<seconds>               : Regular image: "
+          "Wait time in seconds before next image is shown (default: 1.5).\n"
+          "\t-t<seconds>               : "
+          "For animations: stop after this time.\n"
+          "\t-l<loop-count>            : "
+          "For animations: number of loops through a full cycle.\n"
+          "\t-B<steps>[,<y>,<height>]  : "
+          "Countdown: generate steps+1 frames from the image with a progress\n"
+          "\t                            bar growing from empty to full at row y (default: 24,5),\n"
+          "\t                            in pixels of the image file; scaled with the image.\n"
+          "\t                            Use -B0 to go back to plain images.\n"
+          "\t-D<animation-delay-ms>    : "
+          "For animations: override the delay between frames given in the\n"
+          "\t                            gif/stream animation with this value. Use -1 to use default value.\n"
+
+          "\nOptions affecting display of multiple images:\n"
+          "\t-f                        : "
+          "Forever cycle through the list of files on the command line.\n"
+          "\t-s                        : If multiple images are given: shuffle.\n"
+          "\nState machine mode (instead of playing the files in order):\n"
+          "\t-Q<fifo>                  : Switch between states on command: names of states, one\n"
+          "\t                            per line, are read from this named pipe.\n"
+          "\t-S<state>                 : Following files belong to this state (default: the name\n"
+          "\t                            of the directory they are in). Starts with the first one.\n"
+          "\nDisplay Options:\n"
+          "\t-V<vsync-multiple>        : Expert: Only do frame vsync-swaps on multiples of refresh (default: 1)\n"
+          );
+
+  fprintf(stderr, "\nGeneral LED matrix options:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+
+  fprintf(stderr,
+          "\nSwitch time between files: "
+          "-w for static images; -t/-l for animations\n"
+          "Animated gifs: If both -l and -t are given, "
+          "whatever finishes first determines duration.\n");
+
+  fprintf(stderr, "\nThe -w, -t and -l options apply to the following images "
+          "until a new instance of one of these options is seen.\n"
+          "So you can choose different durations for different images.\n");
+
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  int vsync_multiple = 1;
+  bool do_forever = false;
+  bool do_center = false;
+  bool do_shuffle = false;
+
+  // We remember ImageParams for each image, which will change whenever
+  // there is a flag modifying them. This map keeps track of filenames
+  // and their image params (also for unrelated elements of argv[], but doesn't
+  // matter).
+  // We map the pointer instad of the string of the argv parameter so that
+  // we can have two times the same image on the commandline list with different
+  // parameters.
+  std::map<const void *, struct ImageParams> filename_params;
+
+  // Set defaults.
+  ImageParams img_param;
+  for (int i = 0; i < argc; ++i) {
+    filename_params[argv[i]] = img_param;
+  }
+
+  const char *stream_output = NULL;
+  const char *cache_file = NULL;
+  const char *command_fifo = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:K:Q:S:B:V:D:")) != -1) {
+    switch (opt) {
+    case 'w':
+      img_param.wait_ms = roundf(atof(optarg) * 1000.0f);
+      break;
+    case 't':
+      img_param.anim_duration_ms = roundf(atof(optarg) * 1000.0f);
+      break;
+    case 'l':
+      img_param.loops = atoi(optarg);
+      break;
+    case 'f':
+      do_forever = true;
+      break;
+    case 'C':
+      do_center = true;
+      break;
+    case 's':
+      do_shuffle = true;
+      break;
+    case 'O':
+      stream_output = strdup(optarg);
+      break;
+    case 'K':
+      cache_file = strdup(optarg);
+      break;
+    case 'Q':
+      command_fifo = strdup(optarg);
+      break;
+    case 'S':
+      img_param.state = optarg;
+      break;
+    case 'B':
+      if (sscanf(optarg, "%d,%d,%d", &img_param.countdown_steps,
+                 &img_param.bar_y, &img_param.bar_height) < 1
+          || img_param.countdown_steps < 0) {
+        fprintf(stderr, "-B expects <steps>[,<y>,<height>]\n");
+        return usage(argv[0]);
+      }
+      break;
+    case 'D':
+      img_param.anim_delay_ms = atoi(optarg);
+      break;
+    case 'r':
+      fprintf(stderr, "Instead of deprecated -r, use --led-rows=%s instead.\n",
+              optarg);
+      matrix_options.rows = atoi(optarg);
+      break;
+    case 'c':
+      fprintf(stderr, "Instead of deprecated -c, use --led-chain=%s instead.\n",
+              optarg);
+      matrix_options.chain_length = atoi(optarg);
+      break;
+    case 'P':
+      matrix_options.parallel = atoi(optarg);
+      break;
+    case 'L':
+      fprintf(stderr, "-L is deprecated. Use\n\t--led-pixel-mapper=\"U-mapper\" --led-chain=4\ninstead.\n");
+      return 1;
+      break;
+    case 'R':
+      fprintf(stderr, "-R is deprecated. "
+              "Use --led-pixel-mapper=\"Rotate:%s\" instead.\n", optarg);
+      return 1;
+      break;
+    case 'V':
+      vsync_multiple = atoi(optarg);
+      if (vsync_multiple < 1) vsync_multiple = 1;
+      break;
+    case 'h':
+    default:
+      return usage(argv[0]);
+    }
+
+    // Starting from the current file, set all the remaining files to
+    // the latest change.
+    for (int i = optind; i < argc; ++i) {
+      filename_params[argv[i]] = img_param;
+    }
+  }
+
+  const int filename_count = argc - optind;
+  if (filename_count == 0) {
+    fprintf(stderr, "Expected image filename.\n");
+    return usage(argv[0]);
+  }
+
+  // GraphicsMagick is only needed for formats we can't read ourselves. If
+  // we already know it is, initialize it here instead of while loading.
+  magick_path = argv[0];
+  for (int imgarg = optind; imgarg < argc; ++imgarg) {
+    if (!rgb_matrix::IsNativeImage(argv[imgarg])) {
+      InitMagickOnce();
+      break;
+    }
+  }
+
+  // Prepare matrix
+  runtime_opt.do_gpio_init = (stream_output == NULL);
+  RGBMatrix *matrix = CreateMatrixFromOptions(matrix_options, runtime_opt);
+  if (matrix == NULL)
+    return 1;
+
+  FrameCanvas *offscreen_canvas = matrix->CreateFrameCanvas();
+
+  printf("Size: %dx%d. Hardware gpio mapping: %s\n",
+         matrix->width(), matrix->height(), matrix_options.hardware_mapping);
+
+  // These parameters are needed once we do scrolling.
+  const bool fill_width = false;
+  const bool fill_height = false;
+
+  // In case the output should go to a stream, set up the writer.
+  rgb_matrix::StreamIO *stream_io = NULL;
+  rgb_matrix::StreamWriter *global_stream_writer = NULL;
+  if (stream_output) {
+    int fd = open(stream_output, O_CREAT|O_WRONLY, 0644);
+    if (fd < 0) {
+      perror("Couldn't open output stream");
+      return 1;
+    }
+    // Pipes and sockets are written unbuffered, so live readers keep up.
+    if (lseek(fd, 0, SEEK_CUR) >= 0) {
+      stream_io = new rgb_matrix::BufferedFileStreamIO(fd);
+    } else {
+      stream_io = new rgb_matrix::FileStreamIO(fd);
+    }
+    global_stream_writer = new rgb_matrix::StreamWriter(stream_io);
+  }
+
+  // The cache holds individual streams per file, not used for stream output.
+  const AssetCache *cache = (cache_file && !stream_output)
+    ? new AssetCache(cache_file) : NULL;
+  std::vector<uint64_t> asset_keys;  // For each of file_imgs.
+  FrameCanvas *countdown_base = NULL;
+  int cache_hits = 0;
+
+  const tmillis_t start_load = GetTimeInMillis();
+  fprintf(stderr, "Loading %d files...\n", argc - optind);
+  // Preparing all the images beforehand as the Pi might be too slow to
+  // be quickly switching between these. So preprocess.
+  std::vector<FileInfo*> file_imgs;
+
+  // Decode and convert the images in parallel on all but the last core,
+  // which runs the matrix refresh. For stream output, they are only decoded
+  // here and written in order below.
+  std::vector<PreloadedFile> preloaded(argc - optind);
+  for (int imgarg = optind; imgarg < argc; ++imgarg) {
+    preloaded[imgarg - optind].filename = argv[imgarg];
+    preloaded[imgarg - optind].params = filename_params[argv[imgarg]];
+  }
+  const int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  const int thread_count = std::max(1, std::min(cpus - 1,
+                                                (int)preloaded.size()));
+  const uint32_t affinity = (cpus > 1) ? (1U << (cpus - 1)) - 1 : 0;
+  rgb_matrix::Mutex preload_mutex;
+  size_t next_preload = 0;
+  std::vector<PreloadThread*> preload_threads;
+  for (int i = 0; i < thread_count; ++i) {
+    PreloadThread *t = new PreloadThread(&preloaded, &next_preload,
+                                         &preload_mutex, cache,
+                                         matrix->CreateFrameCanvas(),
+                                         matrix->CreateFrameCanvas(),
+                                         fill_width, fill_height, do_center,
+                                         stream_output == NULL);
+    t->Start(0, affinity);
+    preload_threads.push_back(t);
+  }
+  for (size_t i = 0; i < preload_threads.size(); ++i) {
+    delete preload_threads[i];  // Waits for it to finish.
+  }
+
+  for (size_t f = 0; f < preloaded.size(); ++f) {
+    PreloadedFile &loaded = preloaded[f];
+    const char *filename = loaded.filename;
+    FileInfo *file_info = NULL;
+    if (loaded.loaded) {
+      file_info = new FileInfo();
+      file_info->params = loaded.params;
+      file_info->is_multi_frame = loaded.is_multi_frame;
+      if (loaded.content_stream) {
+        file_info->content_stream = loaded.content_stream;
+        if (loaded.from_cache) ++cache_hits;
+      } else {
+        file_info->content_stream = new rgb_matrix::MemStreamIO();
+        if (!countdown_base) countdown_base = matrix->CreateFrameCanvas();
+        StoreLoadedFile(&loaded, do_center, countdown_base, offscreen_canvas,
+                        global_stream_writer);
+      }
+    }
+
+    if (file_info) {
+      if (file_info->params.state.empty())
+        file_info->params.state = StateFromPath(filename);
+      file_imgs.push_back(file_info);
+      asset_keys.push_back(loaded.asset_key);
+    } else {
+      fprintf(stderr, "%s skipped: Unable to open (%s)\n",
+              filename, loaded.err_msg.c_str());
+    }
+  }
+
+  if (stream_output) {
+    delete global_stream_writer;
+    delete stream_io;
+    if (file_imgs.size()) {
+      fprintf(stderr, "Done: Output to stream %s; "
+              "this can now be opened with led-image-viewer with the exact same panel configuration settings such as rows, chain, parallel and hardware-mapping\n", stream_output);
+    }
+    if (do_shuffle)
+      fprintf(stderr, "Note: -s (shuffle) does not have an effect when generating streams.\n");
+    if (do_forever)
+      fprintf(stderr, "Note: -f (forever) does not have an effect when generating streams.\n");
+    // Done, no actual output to matrix.
+    return 0;
+  }
+
+  // Some parameter sanity adjustments.
+  if (file_imgs.empty()) {
+    // e.g. if all files could not be interpreted as image.
+    fprintf(stderr, "No image could be loaded.\n");
+    return 1;
+  } else if (file_imgs.size() == 1) {
+    // Single image: show forever.
+    file_imgs[0]->params.wait_ms = distant_future;
+  } else {
+    for (size_t i = 0; i < file_imgs.size(); ++i) {
+      ImageParams &params = file_imgs[i]->params;
+      // Forever animation ? Set to loop only once, otherwise that animation
+      // would just run forever, stopping all the images after it.
+      if (params.loops < 0 && params.anim_duration_ms == distant_future) {
+        params.loops = 1;
+      }
+    }
+  }
+
+  if (cache && cache_hits < (int)file_imgs.size()) {
+    if (!cache->Store(asset_keys, file_imgs))
+      fprintf(stderr, "Couldn't write cache %s\n", cache_file);
+  }
+
+  if (cache) {
+    fprintf(stderr, "Loading took %.3fs (%d threads; %s start: "
+            "%d of %d files cached); now: Display.\n",
+            (GetTimeInMillis() - start_load) / 1000.0, thread_count,
+            cache_hits == (int)file_imgs.size() ? "warm" : "cold",
+            cache_hits, (int)file_imgs.size());
+  } else {
+    fprintf(stderr, "Loading took %.3fs (%d threads); now: Display.\n",
+            (GetTimeInMillis() - start_load) / 1000.0, thread_count);
+  }
+
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  if (command_fifo) {
+    // All states are loaded already; group files by state.
+    StateMap states;
+    std::string initial_state;
+    for (size_t i = 0; i < file_imgs.size(); ++i) {
+      const std::string &state = file_imgs[i]->params.state;
+      if (initial_state.empty()) initial_state = state;
+      states[state].push_back(file_imgs[i]);
+    }
+    mkfifo(command_fifo, 0660);  // Fine if it exists already.
+    // Opening read/write: we don't see EOF when a controller disconnects.
+    const int fd = open(command_fifo, O_RDWR);
+    if (fd < 0) {
+      perror("Can't open command pipe");
+      return 1;
+    }
+    fprintf(stderr, "%d states; starting with %s. Commands from %s\n",
+            (int)states.size(), initial_state.c_str(), command_fifo);
+    StateCommandReader *commands = new StateCommandReader(fd);
+    commands->Start();
+    RunStateMachine(states, initial_state, commands,
+                    matrix, offscreen_canvas, vsync_multiple);
+    // Not waiting for the command reader; it is blocked on the pipe.
+  } else {
+    do {
+      if (do_shuffle) {
+        std::random_shuffle(file_imgs.begin(), file_imgs.end());
+      }
+      for (size_t i = 0; i < file_imgs.size() && !interrupt_received; ++i) {
+        DisplayAnimation(file_imgs[i], matrix, offscreen_canvas,
+                         vsync_multiple);
+      }
+    } while (do_forever && !interrupt_received);
+  }
+
+  if (interrupt_received) {
+    fprintf(stderr, "Caught signal. Exiting.\n");
+  }
+
+  // Animation finished. Shut down the RGB matrix.
+  matrix->Clear();
+  delete matrix;
+
+  // Leaking the FileInfos, but don't care at program end.
+  return 0;
+}
+
@@ -20,29 +20,46 @@ extern "C" {
 #include <getopt.h>
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "led-matrix.h"
 #include "content-streamer.h"
+#include "thread.h"
 
 using rgb_matrix::FrameCanvas;
+using rgb_matrix::Mutex;
+using rgb_matrix::MutexLock;
 using rgb_matrix::RGBMatrix;
 using rgb_matrix::StreamWriter;
 using rgb_matrix::StreamIO;
+using rgb_matrix::Thread;
 
 volatile bool interrupt_received = false;
 static void InterruptHandler(int) {
   interrupt_received = true;
 }
 
-// compatibility with newer API
+// Decoded frames are handed to another thread, so they need to own their
+// data. That needs reference counted frames.
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(55,28,1)
-#  define av_frame_alloc avcodec_alloc_frame
-#  define av_frame_free avcodec_free_frame
+#  error "libavcodec too old; need reference counted frames (55.28.1)"
 #endif
 
+// Monotonic, so playback is not disturbed if the wall clock is set.
+static double GetTimeInSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 struct LedPixel {
   uint8_t r, g, b;
 };
@@ -58,10 +75,294 @@ void CopyFrame(AVFrame *pFrame, FrameCanvas *canvas) {
   }
 }
 
+// Fixed size queue to hand items from one thread to the next. Push() blocks
+// while the queue is full, Pop() while it is empty; so a slow stage holds
+// back the ones before it instead of piling up memory.
+// After Close(), Push() fails and Pop() only returns what is left.
+template <typename T> class BoundedQueue {
+public:
+  BoundedQueue(size_t capacity)
+    : items_(capacity), start_(0), count_(0), closed_(false),
+      depth_sum_(0), push_count_(0), max_depth_(0) {
+    pthread_cond_init(&changed_, NULL);
+  }
+  ~BoundedQueue() { pthread_cond_destroy(&changed_); }
+
+  // Returns false if the queue is closed; "item" then stays with the caller.
+  bool Push(const T &item) {
+    MutexLock l(&mutex_);
+    while (!closed_ && count_ == items_.size()) mutex_.WaitOn(&changed_);
+    if (closed_) return false;
+    items_[(start_ + count_) % items_.size()] = item;
+    ++count_;
+    depth_sum_ += count_;
+    ++push_count_;
+    max_depth_ = std::max(max_depth_, count_);
+    pthread_cond_broadcast(&changed_);
+    return true;
+  }
+
+  // Returns false once the queue is closed and empty.
+  bool Pop(T *item) {
+    MutexLock l(&mutex_);
+    while (!closed_ && count_ == 0) mutex_.WaitOn(&changed_);
+    if (count_ == 0) return false;
+    *item = items_[start_];
+    start_ = (start_ + 1) % items_.size();
+    --count_;
+    pthread_cond_broadcast(&changed_);
+    return true;
+  }
+
+  void Close() {
+    MutexLock l(&mutex_);
+    closed_ = true;
+    pthread_cond_broadcast(&changed_);
+  }
+
+  // Fill level right after each Push(); high values mean the consumer is
+  // the bottleneck, values near one that the producer is.
+  double average_depth() {
+    MutexLock l(&mutex_);
+    return push_count_ ? (double)depth_sum_ / push_count_ : 0;
+  }
+  size_t max_depth() {
+    MutexLock l(&mutex_);
+    return max_depth_;
+  }
+
+private:
+  Mutex mutex_;
+  pthread_cond_t changed_;
+  std::vector<T> items_;
+  size_t start_;
+  size_t count_;
+  bool closed_;
+  uint64_t depth_sum_;
+  uint64_t push_count_;
+  size_t max_depth_;
+};
+
+// A frame with its presentation time in seconds from the stream start.
+struct DecodedFrame {
+  AVFrame *frame;
+  double pts;
+};
+struct ReadyFrame {
+  FrameCanvas *canvas;
+  double pts;
+};
+
+// Maps presentation times to the monotonic clock. Started with the first
+// frame that is shown; all others are due relative to it.
+class PresentationClock {
+public:
+  PresentationClock() : started_(false), origin_(0) {}
+
+  void Start(double pts) {
+    MutexLock l(&mutex_);
+    if (!started_) {
+      origin_ = GetTimeInSeconds() - pts;
+      started_ = true;
+    }
+  }
+
+  // Seconds the frame with "pts" is behind its time; negative if early.
+  // Zero as long as the clock is not started.
+  double Lateness(double pts) {
+    MutexLock l(&mutex_);
+    return started_ ? GetTimeInSeconds() - (origin_ + pts) : 0;
+  }
+
+private:
+  Mutex mutex_;
+  bool started_;
+  double origin_;
+};
+
+// Reads packets and decodes them; the frames go to "output".
+class DecodeThread : public Thread {
+public:
+  DecodeThread(AVFormatContext *format_ctx, int video_stream,
+               AVCodecContext *codec_ctx, double frame_interval,
+               BoundedQueue<DecodedFrame> *output)
+    : format_ctx_(format_ctx), video_stream_(video_stream),
+      codec_ctx_(codec_ctx), frame_interval_(frame_interval),
+      output_(output), frame_count_(0) {}
+
+  virtual void Run() {
+    const AVStream *stream = format_ctx_->streams[video_stream_];
+    const double time_base = av_q2d(stream->time_base);
+    const int64_t start = (stream->start_time != AV_NOPTS_VALUE)
+      ? stream->start_time : 0;
+    double last_pts = -frame_interval_;
+    AVPacket packet;
+    AVFrame *frame = av_frame_alloc();
+    bool running = true;
+    while (running && !interrupt_received
+           && av_read_frame(format_ctx_, &packet) >= 0) {
+      // Is this a packet from the video stream?
+      if (packet.stream_index == video_stream_) {
+        int frame_finished = 0;
+        avcodec_decode_video2(codec_ctx_, frame, &frame_finished, &packet);
+        if (frame_finished) {
+          ++frame_count_;
+          // Frames without timestamp just follow the previous one.
+          const int64_t timestamp = av_frame_get_best_effort_timestamp(frame);
+          DecodedFrame decoded;
+          decoded.frame = frame;
+          decoded.pts = (timestamp != AV_NOPTS_VALUE)
+            ? (timestamp - start) * time_base
+            : last_pts + frame_interval_;
+          last_pts = decoded.pts;
+          if (output_->Push(decoded)) {
+            frame = av_frame_alloc();   // The converter owns that one now.
+          } else {
+            running = false;            // Shutting down.
+          }
+        }
+      }
+      // Free the packet that was allocated by av_read_frame
+      av_free_packet(&packet);
+    }
+    av_frame_free(&frame);
+    output_->Close();
+  }
+
+  // Only valid after the thread finished.
+  long frame_count() const { return frame_count_; }
+
+private:
+  AVFormatContext *const format_ctx_;
+  const int video_stream_;
+  AVCodecContext *const codec_ctx_;
+  const double frame_interval_;
+  BoundedQueue<DecodedFrame> *const output_;
+  long frame_count_;
+};
+
+// Scales decoded frames to the matrix size and draws them on canvases taken
+// from "free_canvases". Filled canvases go to "output".
+//
+// Frames that are already more than "max_lateness" behind the clock are
+// dropped right away, before spending any time on them. With a
+// "min_interval", frames following the previous one closer than that are
+// dropped as well.
+//
+// YUV 4:2:0 frames, which is what most codecs deliver, are directly
+// converted into the canvas unless "use_swscale" is set; everything else
+// goes through libswscale to RGB first.
+class ConvertThread : public Thread {
+public:
+  ConvertThread(SwsContext *sws_ctx, bool use_swscale, int source_height,
+                int width, int height,
+                PresentationClock *clock, double max_lateness,
+                double min_interval,
+                BoundedQueue<DecodedFrame> *input,
+                BoundedQueue<FrameCanvas*> *free_canvases,
+                BoundedQueue<ReadyFrame> *output)
+    : sws_ctx_(sws_ctx), use_swscale_(use_swscale),
+      source_height_(source_height),
+      clock_(clock), max_lateness_(max_lateness), min_interval_(min_interval),
+      input_(input), free_canvases_(free_canvases), output_(output),
+      dropped_count_(0), converted_count_(0), direct_count_(0),
+      conversion_time_(0) {
+    rgb_frame_ = av_frame_alloc();
+    buffer_ = (uint8_t *)av_malloc(avpicture_get_size(AV_PIX_FMT_RGB24,
+                                                      width, height));
+    avpicture_fill((AVPicture *)rgb_frame_, buffer_, AV_PIX_FMT_RGB24,
+                   width, height);
+  }
+  virtual ~ConvertThread() {
+    WaitStopped();
+    av_free(buffer_);
+    av_frame_free(&rgb_frame_);
+  }
+
+  virtual void Run() {
+    DecodedFrame decoded;
+    ReadyFrame ready;
+    double last_pts = 0;
+    bool have_last = false;
+    while (input_->Pop(&decoded)) {
+      if (clock_->Lateness(decoded.pts) > max_lateness_
+          || (have_last && decoded.pts - last_pts < min_interval_)) {
+        ++dropped_count_;
+        av_frame_free(&decoded.frame);
+        continue;
+      }
+      if (!free_canvases_->Pop(&ready.canvas)) {
+        av_frame_free(&decoded.frame);
+        break;
+      }
+      const double start = GetTimeInSeconds();
+      const AVFrame *frame = decoded.frame;
+      if (!use_swscale_ && (frame->format == AV_PIX_FMT_YUV420P
+                            || frame->format == AV_PIX_FMT_YUVJ420P)) {
+        const bool full_range = (frame->format == AV_PIX_FMT_YUVJ420P
+                                 || frame->color_range == AVCOL_RANGE_JPEG);
+        ready.canvas->SetPixelsYUV420(frame->data, frame->linesize,
+                                      frame->width, frame->height,
+                                      full_range);
+        ++direct_count_;
+      } else {
+        // Convert the image from its native format to RGB
+        sws_scale(sws_ctx_, (uint8_t const * const *)frame->data,
+                  frame->linesize, 0, source_height_,
+                  rgb_frame_->data, rgb_frame_->linesize);
+        CopyFrame(rgb_frame_, ready.canvas);
+      }
+      conversion_time_ += GetTimeInSeconds() - start;
+      ++converted_count_;
+      av_frame_free(&decoded.frame);
+      ready.pts = last_pts = decoded.pts;
+      have_last = true;
+      if (!output_->Push(ready)) break;
+    }
+    output_->Close();
+  }
+
+  // Only valid after the thread finished.
+  long dropped_count() const { return dropped_count_; }
+  long converted_count() const { return converted_count_; }
+  long direct_count() const { return direct_count_; }
+  double conversion_time() const { return conversion_time_; }
+
+private:
+  SwsContext *const sws_ctx_;
+  const bool use_swscale_;
+  const int source_height_;
+  PresentationClock *const clock_;
+  const double max_lateness_;
+  const double min_interval_;
+  BoundedQueue<DecodedFrame> *const input_;
+  BoundedQueue<FrameCanvas*> *const free_canvases_;
+  BoundedQueue<ReadyFrame> *const output_;
+  AVFrame *rgb_frame_;
+  uint8_t *buffer_;
+  long dropped_count_;
+  long converted_count_;
+  long direct_count_;
+  double conversion_time_;
+};
+
+// Time between two refreshes of the panel.
+static double MeasureRefreshInterval(RGBMatrix *matrix) {
+  static const int kFrames = 20;
+  matrix->SwapOnVSync(NULL);   // Start right after a refresh.
+  const double start = GetTimeInSeconds();
+  for (int i = 0; i < kFrames; ++i) matrix->SwapOnVSync(NULL);
+  return (GetTimeInSeconds() - start) / kFrames;
+}
+
 static int usage(const char *progname) {
   fprintf(stderr, "usage: %s [options] <video>\n", progname);
   fprintf(stderr, "Options:\n"
           "\t-O<streamfile>     : Output to stream-file instead of matrix (don't need to be root).\n"
+          "\t-F                 : Cap frame rate at the panel refresh rate; drop frames that\n"
+          "\t                     would come faster.\n"
+          "\t-S                 : Always scale with libswscale, even for YUV 4:2:0 video\n"
+          "\t                     that can be converted directly (for comparison).\n"
           "\t-v                 : verbose.\n");
 
   fprintf(stderr, "\nGeneral LED matrix options:\n");
@@ -78,14 +379,22 @@ int main(int argc, char *argv[]) {
   }
 
   bool verbose = false;
+  bool cap_at_refresh = false;
+  bool use_swscale = false;
   const char *stream_output = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "vO:R:L")) != -1) {
+  while ((opt = getopt(argc, argv, "vO:R:LFS")) != -1) {
     switch (opt) {
     case 'v':
       verbose = true;
       break;
+    case 'F':
+      cap_at_refresh = true;
+      break;
+    case 'S':
+      use_swscale = true;
+      break;
     case 'O':
       stream_output = strdup(optarg);
       break;
@@ -114,12 +423,6 @@ int main(int argc, char *argv[]) {
   AVCodecContext    *pCodecCtxOrig = NULL;
   AVCodecContext    *pCodecCtx = NULL;
   AVCodec           *pCodec = NULL;
-  AVFrame           *pFrame = NULL;
-  AVFrame           *pFrameRGB = NULL;
-  AVPacket          packet;
-  int               frameFinished;
-  int               numBytes;
-  uint8_t           *buffer = NULL;
   struct SwsContext *sws_ctx = NULL;
 
   const char *movie_file = argv[optind];
@@ -141,14 +444,12 @@ int main(int argc, char *argv[]) {
     av_dump_format(pFormatCtx, 0, movie_file, 0);
   }
 
-  long frame_count = 0;
   runtime_opt.do_gpio_init = (stream_output == NULL);
   RGBMatrix *matrix = CreateMatrixFromOptions(matrix_options, runtime_opt);
   if (matrix == NULL) {
     return 1;
   }
 
-  FrameCanvas *offscreen_canvas = matrix->CreateFrameCanvas();
   StreamIO *stream_io = NULL;
   StreamWriter *stream_writer = NULL;
   if (stream_output) {
@@ -157,7 +458,13 @@ int main(int argc, char *argv[]) {
       perror("Couldn't open output stream");
       return 1;
     }
-    stream_io = new rgb_matrix::FileStreamIO(fd);
+    // Recording is limited by writes; batch them in a background thread.
+    // Not for pipes or sockets: a live reader would get frames in bursts.
+    if (lseek(fd, 0, SEEK_CUR) >= 0) {
+      stream_io = new rgb_matrix::BufferedFileStreamIO(fd, 4 << 20, true);
+    } else {
+      stream_io = new rgb_matrix::FileStreamIO(fd);
+    }
     stream_writer = new StreamWriter(stream_io);
   }
   // Find the first video stream
@@ -192,29 +499,14 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
+  // Frames are passed on to the converter thread, so they must stay valid
+  // after decoding the next one.
+  pCodecCtx->refcounted_frames = 1;
+
   // Open codec
   if (avcodec_open2(pCodecCtx, pCodec, NULL)<0)
     return -1;
 
-  // Allocate video frame
-  pFrame=av_frame_alloc();
-
-  // Allocate an AVFrame structure
-  pFrameRGB=av_frame_alloc();
-  if (pFrameRGB==NULL)
-    return -1;
-
-  // Determine required buffer size and allocate buffer
-  numBytes=avpicture_get_size(AV_PIX_FMT_RGB24, pCodecCtx->width,
-                              pCodecCtx->height);
-  buffer=(uint8_t *)av_malloc(numBytes*sizeof(uint8_t));
-
-  // Assign appropriate parts of buffer to image planes in pFrameRGB
-  // Note that pFrameRGB is an AVFrame, but AVFrame is a superset
-  // of AVPicture
-  avpicture_fill((AVPicture *)pFrameRGB, buffer, AV_PIX_FMT_RGB24,
-                 pCodecCtx->width, pCodecCtx->height);
-
   // initialize SWS context for software scaling
   sws_ctx = sws_getContext(pCodecCtx->width,
                            pCodecCtx->height,
@@ -235,33 +527,69 @@ int main(int argc, char *argv[]) {
   signal(SIGTERM, InterruptHandler);
   signal(SIGINT, InterruptHandler);
 
+  // Decoding, conversion and display each run in their own thread, so a
+  // slow packet doesn't stall the display as long as the queues have
+  // frames. The canvases circulate: free -> converter -> ready -> display.
+  static const int kDecodedQueueSize = 4;
+  static const int kCanvasCount = 4;
+  BoundedQueue<DecodedFrame> decoded_frames(kDecodedQueueSize);
+  BoundedQueue<FrameCanvas*> free_canvases(kCanvasCount + 1);
+  BoundedQueue<ReadyFrame> ready_frames(kCanvasCount + 1);
+  for (int c = 0; c < kCanvasCount; ++c) {
+    free_canvases.Push(matrix->CreateFrameCanvas());
+  }
+
   const int frame_wait_micros = 1e6 / fps;
-  while (!interrupt_received && av_read_frame(pFormatCtx, &packet) >= 0) {
-    // Is this a packet from the video stream?
-    if (packet.stream_index==videoStream) {
-      // Decode video frame
-      avcodec_decode_video2(pCodecCtx, pFrame, &frameFinished, &packet);
-
-      // Did we get a video frame?
-      if (frameFinished) {
-        // Convert the image from its native format to RGB
-        sws_scale(sws_ctx, (uint8_t const * const *)pFrame->data,
-                  pFrame->linesize, 0, pCodecCtx->height,
-                  pFrameRGB->data, pFrameRGB->linesize);
-
-        CopyFrame(pFrameRGB, offscreen_canvas);
-        frame_count++;
-        if (stream_writer) {
-          stream_writer->Stream(*offscreen_canvas, frame_wait_micros);
-        } else {
-          offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas);
-        }
-      }
-      if (!stream_writer) usleep(frame_wait_micros);
+  const double frame_interval = 1.0 / fps;
+  double min_interval = 0;
+  if (cap_at_refresh && !stream_writer) {
+    min_interval = MeasureRefreshInterval(matrix);
+    if (verbose) {
+      fprintf(stderr, "Panel refresh: %.1fHz\n", 1.0 / min_interval);
     }
+  }
 
-    // Free the packet that was allocated by av_read_frame
-    av_free_packet(&packet);
+  // All cores but the last one, which runs the matrix refresh.
+  const int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  const uint32_t affinity = (cpus > 1) ? (1U << (cpus - 1)) - 1 : 0;
+  // The clock is only started when showing on the matrix; a recording
+  // gets all frames.
+  PresentationClock clock;
+  DecodeThread decoder(pFormatCtx, videoStream, pCodecCtx, frame_interval,
+                       &decoded_frames);
+  ConvertThread converter(sws_ctx, use_swscale, pCodecCtx->height,
+                          matrix->width(), matrix->height(),
+                          &clock, frame_interval, min_interval,
+                          &decoded_frames, &free_canvases, &ready_frames);
+  decoder.Start(0, affinity);
+  converter.Start(0, affinity);
+
+  const double start_time = GetTimeInSeconds();
+  long shown_count = 0, late_dropped_count = 0;
+  double lateness_sum = 0;
+  FrameCanvas *canvas = NULL;
+  ReadyFrame ready;
+  while (!interrupt_received && ready_frames.Pop(&ready)) {
+    canvas = ready.canvas;
+    if (stream_writer) {
+      // Recording: every frame, as fast as we get them.
+      stream_writer->Stream(*canvas, frame_wait_micros);
+      ++shown_count;
+    } else {
+      clock.Start(ready.pts);
+      const double lateness = clock.Lateness(ready.pts);
+      if (lateness > frame_interval) {
+        // Got too late while waiting in the queue; showing it would only
+        // delay the next one.
+        ++late_dropped_count;
+      } else {
+        if (lateness < 0) usleep(-lateness * 1e6);   // Early: hold it.
+        canvas = matrix->SwapOnVSync(canvas);
+        lateness_sum += clock.Lateness(ready.pts);
+        ++shown_count;
+      }
+    }
+    free_canvases.Push(canvas);
   }
 
   if (interrupt_received) {
@@ -270,12 +598,14 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Got interrupt. Exiting\n");
   }
 
-  // Free the RGB image
-  av_free(buffer);
-  av_frame_free(&pFrameRGB);
-
-  // Free the YUV frame
-  av_frame_free(&pFrame);
+  // Wake up all threads that might wait on a queue and let them finish.
+  decoded_frames.Close();
+  free_canvases.Close();
+  ready_frames.Close();
+  decoder.WaitStopped();
+  converter.WaitStopped();
+  DecodedFrame left_over;
+  while (decoded_frames.Pop(&left_over)) av_frame_free(&left_over.frame);
 
   // Close the codecs
   avcodec_close(pCodecCtx);
@@ -285,8 +615,40 @@ int main(int argc, char *argv[]) {
   avformat_close_input(&pFormatCtx);
 
   delete stream_writer;
-  delete stream_io;
-  fprintf(stderr, "Total of %ld frames decoded\n", frame_count);
+  delete stream_io;   // Flushes remaining data.
+  fprintf(stderr, "Total of %ld frames decoded; %ld shown, %ld dropped "
+          "(%ld before conversion)", decoder.frame_count(), shown_count,
+          converter.dropped_count() + late_dropped_count,
+          converter.dropped_count());
+  if (!stream_writer && shown_count > 0) {
+    fprintf(stderr, ", average lateness %.1fms",
+            1000.0 * lateness_sum / shown_count);
+  }
+  fprintf(stderr, "\n");
+  if (verbose) {
+    fprintf(stderr, "Queue depth (average/max): decoded %.1f/%zu, "
+            "ready %.1f/%zu\n",
+            decoded_frames.average_depth(), decoded_frames.max_depth(),
+            ready_frames.average_depth(), ready_frames.max_depth());
+    if (converter.converted_count() > 0) {
+      fprintf(stderr, "Conversion: %.2fms/frame (%ld of %ld frames direct "
+              "from YUV, others with libswscale)\n",
+              1000.0 * converter.conversion_time()
+              / converter.converted_count(),
+              converter.direct_count(), converter.converted_count());
+    }
+  }
+  if (stream_output && canvas != NULL) {
+    // Recording throughput; to compare with the frame rate of the video.
+    const double duration = GetTimeInSeconds() - start_time;
+    const char *data;
+    size_t frame_size;
+    canvas->Serialize(&data, &frame_size);
+    fprintf(stderr, "Recorded in %.3fs: %.1f frames/s (video: %.1f fps), "
+            "%.1f MiB/s raw frame data\n",
+            duration, shown_count / duration, fps,
+            shown_count * frame_size / duration / (1 << 20));
+  }
 
   return 0;
 }